@@ -0,0 +1,469 @@
+/*
+ * file:        benchmark.c
+ * description: block layer benchmarks for the CS 5600 file system.
+ *              Compares the block backends on the same access patterns,
+ *              the block cache policies on a file system workload, and
+ *              free block search on nearly full bitmaps.
+ *
+ *  usage: ./benchmark [image.img]
+ *              image.img - scratch image to use (default bench.img);
+ *                          created with BENCH_BLOCKS blocks if missing.
+ *                          The cache test builds its own file system
+ *                          in benchfs.img.
+ */
+
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "fs5600.h"
+
+extern void block_init_backend(char *file, const char *backend);
+extern int block_read(void *buf, int lba, int nblks);
+extern int block_readv(struct block_seg *segs, int nsegs);
+extern void block_counts(uint64_t *reads, uint64_t *writes, uint64_t *syscalls);
+extern void cache_set_size(int nblocks);
+extern int cache_set_policy(const char *name);
+extern void cache_counts(uint64_t *hits, uint64_t *misses, uint64_t *writebacks);
+extern struct fuse_operations fs_ops;
+extern int find_free_run(const unsigned char *map, int nbits, int start, int max, int *len);
+extern int find_free_summary(const unsigned char *map, unsigned char *const *full, int nlevels,
+                             int nbits, int start, int max, int *len);
+
+#define BENCH_BLOCKS 16384	/* 64 MB */
+#define BENCH_OPS    4096	/* blocks transferred per test */
+#define QUEUE_DEPTH  32
+
+#define FS_IMAGE     "benchfs.img"
+#define FS_DIRS      8		/* small files: FS_DIRS x FS_FILES */
+#define FS_FILES     16
+#define FS_BIG       8		/* big files, FS_BIG_BLOCKS each */
+#define FS_BIG_BLOCKS 512
+#define FS_CACHE     256	/* cache size for the test, 1 MB */
+#define FS_ROUNDS    64
+
+static char *image = "bench.img";
+static int nblocks;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* make sure the image exists and none of it is in the page cache, so
+ * every backend starts out reading from the device.
+ */
+static void prepare_image(void)
+{
+    struct stat sb;
+    int fd = open(image, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        perror(image);
+        exit(1);
+    }
+    if (sb.st_size < (off_t)BENCH_BLOCKS * FS_BLOCK_SIZE) {
+        char block[FS_BLOCK_SIZE];
+        for (int i = 0; i < BENCH_BLOCKS; i++) {
+            memset(block, i, sizeof(block));
+            if (pwrite(fd, block, sizeof(block), (off_t)i * FS_BLOCK_SIZE) < 0) {
+                perror(image);
+                exit(1);
+            }
+        }
+        sb.st_size = (off_t)BENCH_BLOCKS * FS_BLOCK_SIZE;
+    }
+    nblocks = sb.st_size / FS_BLOCK_SIZE;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void report(const char *backend, const char *test, double t, uint64_t syscalls)
+{
+    printf("%-6s %-22s %8.1f us/block %10.0f blocks/s %6.2f syscalls/block\n",
+           backend, test, t * 1e6 / BENCH_OPS, BENCH_OPS / t,
+           (double)syscalls / BENCH_OPS);
+}
+
+static void run(const char *backend)
+{
+    static char bufs[QUEUE_DEPTH * 8][FS_BLOCK_SIZE];
+    struct block_seg segs[QUEUE_DEPTH * 8];
+    uint64_t r, w, s0, s1;
+    double t;
+
+    /* one block at a time, random LBAs - queue depth 1 */
+    prepare_image();
+    block_init_backend(image, backend);
+    srandom(1);
+    block_counts(&r, &w, &s0);
+    t = now();
+    for (int i = 0; i < BENCH_OPS; i++)
+        block_read(bufs[0], 1 + random() % (nblocks - 1), 1);
+    t = now() - t;
+    block_counts(&r, &w, &s1);
+    report(backend, "random read, qd 1", t, s1 - s0);
+
+    /* random LBAs in batches, as fs_readdir fetches a directory's inodes */
+    prepare_image();
+    block_init_backend(image, backend);
+    block_counts(&r, &w, &s0);
+    t = now();
+    for (int i = 0; i < BENCH_OPS; i += QUEUE_DEPTH) {
+        for (int j = 0; j < QUEUE_DEPTH; j++) {
+            segs[j].lba = 1 + random() % (nblocks - 1);
+            segs[j].buf = bufs[j];
+        }
+        block_readv(segs, QUEUE_DEPTH);
+    }
+    t = now() - t;
+    block_counts(&r, &w, &s1);
+    report(backend, "random read, qd 32", t, s1 - s0);
+
+    /* sequential 1 MB requests, as fs_read of a contiguous file */
+    prepare_image();
+    block_init_backend(image, backend);
+    block_counts(&r, &w, &s0);
+    t = now();
+    for (int i = 0; i < BENCH_OPS; i += QUEUE_DEPTH * 8) {
+        int lba = 1 + i % (nblocks - QUEUE_DEPTH * 8 - 1);
+        for (int j = 0; j < QUEUE_DEPTH * 8; j++) {
+            segs[j].lba = lba + j;
+            segs[j].buf = bufs[j];
+        }
+        block_readv(segs, QUEUE_DEPTH * 8);
+    }
+    t = now() - t;
+    block_counts(&r, &w, &s1);
+    report(backend, "sequential read, 1 MB", t, s1 - s0);
+}
+
+/* Block allocation on a nearly full bitmap: get ALLOC_BLOCKS blocks,
+ * as fs_write does for a 256 KB append. The old way tested one bit at
+ * a time and started over from block 2 for each block; find_free_run
+ * looks at 64 bits at a time and returns whole runs.
+ */
+#define MAP_BITS     (FS_BLOCK_SIZE * 8)
+#define ALLOC_BLOCKS 64
+#define ALLOC_ROUNDS 2000
+
+static int alloc_bitwise(unsigned char *map, uint32_t *lba)
+{
+    for (int i = 0; i < ALLOC_BLOCKS; i++) {
+        int b;
+        for (b = 2; b < MAP_BITS; b++)
+            if (!(map[b / 8] & (1 << (b % 8))))
+                break;
+        if (b == MAP_BITS)
+            return -1;
+        map[b / 8] |= 1 << (b % 8);
+        lba[i] = b;
+    }
+    return 0;
+}
+
+static int alloc_runs(unsigned char *map, uint32_t *lba)
+{
+    int got = 0, start = 2, len;
+    while (got < ALLOC_BLOCKS) {
+        int b = find_free_run(map, MAP_BITS, start, ALLOC_BLOCKS - got, &len);
+        if (b < 0)
+            return -1;
+        for (int i = 0; i < len; i++) {
+            map[(b + i) / 8] |= 1 << ((b + i) % 8);
+            lba[got++] = b + i;
+        }
+        start = b + len;
+    }
+    return 0;
+}
+
+static void run_alloc(double full)
+{
+    static unsigned char map[FS_BLOCK_SIZE], work[FS_BLOCK_SIZE];
+    uint32_t lba[ALLOC_BLOCKS];
+    struct {
+        const char *name;
+        int (*alloc)(unsigned char *, uint32_t *);
+    } how[] = {{"bitwise", alloc_bitwise}, {"words", alloc_runs}};
+
+    /* 'full' of the blocks in use, scattered at random */
+    srandom(2);
+    memset(map, 0, sizeof(map));
+    for (int b = 0; b < MAP_BITS; b++)
+        if (b < 2 || random() < full * RAND_MAX)
+            map[b / 8] |= 1 << (b % 8);
+
+    for (int h = 0; h < 2; h++) {
+        double t = now();
+        for (int i = 0; i < ALLOC_ROUNDS; i++) {
+            memcpy(work, map, sizeof(map));
+            how[h].alloc(work, lba);
+        }
+        t = now() - t;
+        printf("%-7s %-22s %8.2f us/alloc of %d blocks, %.1f%% full\n",
+               how[h].name, "free block search", t * 1e6 / ALLOC_ROUNDS,
+               ALLOC_BLOCKS, full * 100);
+    }
+}
+
+/* Free block search on a big image as it fills up: HUGE_BITS blocks
+ * (64 GB), in use from the front up to 'full' and half used at random
+ * after that. Finding ALLOC_BLOCKS free blocks starting from block 2
+ * reads the whole full part of the bitmap a word at a time; with the
+ * summary levels (a bit per full word of the level below) it reads a
+ * few words per level.
+ */
+#define HUGE_BITS   (1 << 24)
+#define HUGE_ROUNDS 200
+#define HUGE_LEVELS 3		/* 2^18, 2^12 and 2^6 bits */
+
+/* set bit w of level l if word w of the level below is full */
+static void summarize(unsigned char **levels, const unsigned char *map, int nbits)
+{
+    static const uint64_t ones = ~0ULL;
+    for (int l = 0; l < HUGE_LEVELS; l++) {
+        memset(levels[l], 0, nbits / 64 / 8);
+        for (int w = 0; w < nbits / 64; w++)
+            if (memcmp(map + 8 * w, &ones, 8) == 0)
+                levels[l][w / 8] |= 1 << (w % 8);
+        map = levels[l];
+        nbits /= 64;
+    }
+}
+
+static void run_fill(double full)
+{
+    static unsigned char map[HUGE_BITS / 8], l0[HUGE_BITS / 64 / 8],
+        l1[HUGE_BITS / 64 / 64 / 8], l2[8];
+    unsigned char *levels[HUGE_LEVELS] = {l0, l1, l2};
+    int used = full * HUGE_BITS;
+
+    srandom(3);
+    memset(map, 0xff, used / 8);
+    memset(map + used / 8, 0, sizeof(map) - used / 8);
+    for (int b = used / 8 * 8; b < HUGE_BITS; b++)
+        if (b < used || random() & 1)
+            map[b / 8] |= 1 << (b % 8);
+    summarize(levels, map, HUGE_BITS);
+
+    for (int h = 0; h < 2; h++) {
+        double t = now();
+        for (int i = 0; i < HUGE_ROUNDS; i++) {
+            int got = 0, start = 2, len;
+            while (got < ALLOC_BLOCKS) {
+                int b = find_free_summary(map, levels, h ? HUGE_LEVELS : 0, HUGE_BITS,
+                                          start, ALLOC_BLOCKS - got, &len);
+                if (b < 0)
+                    break;
+                got += len;
+                start = b + len;
+            }
+        }
+        t = now() - t;
+        printf("%-7s %-22s %8.2f us/alloc of %d blocks, %.1f%% full\n",
+               h ? "summary" : "words", "search, 64 GB image",
+               t * 1e6 / HUGE_ROUNDS, ALLOC_BLOCKS, full * 100);
+    }
+}
+
+/* fs_create and fs_mkdir ask FUSE who the caller is */
+struct fuse_context *fuse_get_context(void)
+{
+    static struct fuse_context ctx = {.uid = 500, .gid = 500};
+    return &ctx;
+}
+
+static void put_block(int fd, void *buf, int lba)
+{
+    if (pwrite(fd, buf, FS_BLOCK_SIZE, (off_t)lba * FS_BLOCK_SIZE) < 0) {
+        perror(FS_IMAGE);
+        exit(1);
+    }
+}
+
+/* an empty file system of BENCH_BLOCKS blocks: superblock, bitmap, root
+ * directory inode at block 2 and its one directory block at 3.
+ */
+static void mkfs(void)
+{
+    static char block[FS_BLOCK_SIZE];
+    struct fs_super *sb = (void*)block;
+    struct fs_inode *root = (void*)block;
+    int fd = open(FS_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0 || ftruncate(fd, (off_t)BENCH_BLOCKS * FS_BLOCK_SIZE) < 0) {
+        perror(FS_IMAGE);
+        exit(1);
+    }
+    memset(block, 0, sizeof(block));
+    sb->magic = FS_MAGIC;
+    sb->disk_size = BENCH_BLOCKS;
+    sb->version = FS_VERSION_INDIRECT;
+    put_block(fd, block, 0);
+
+    memset(block, 0, sizeof(block));
+    block[0] = 0x0f;		/* blocks 0-3 */
+    put_block(fd, block, 1);
+
+    memset(block, 0, sizeof(block));
+    root->mode = S_IFDIR | 0777;
+    root->size = FS_BLOCK_SIZE;
+    root->ptrs[0] = 3;
+    put_block(fd, block, 2);
+    close(fd);
+}
+
+/* a tree of small files, then big files that together are several
+ * times the size of the cache.
+ */
+static void populate(void)
+{
+    static char data[FS_BIG_BLOCKS * FS_BLOCK_SIZE];
+    char path[64];
+
+    for (int d = 0; d < FS_DIRS; d++) {
+        sprintf(path, "/d%d", d);
+        fs_ops.mkdir(path, 0777);
+        for (int f = 0; f < FS_FILES; f++) {
+            sprintf(path, "/d%d/f%d", d, f);
+            fs_ops.create(path, 0666 | S_IFREG, NULL);
+            fs_ops.write(path, path, strlen(path), 0, NULL);
+        }
+    }
+    for (int b = 0; b < FS_BIG; b++) {
+        sprintf(path, "/big%d", b);
+        memset(data, b, sizeof(data));
+        fs_ops.create(path, 0666 | S_IFREG, NULL);
+        fs_ops.write(path, data, sizeof(data), 0, NULL);
+    }
+}
+
+/* a backup or grep running next to an interactive user: read one big
+ * file straight through, then stat every small file, over and over.
+ * With plain LRU each scan flushes the directory and inode blocks the
+ * lookups need.
+ */
+static void run_cache(const char *policy)
+{
+    static char data[FS_BIG_BLOCKS * FS_BLOCK_SIZE];
+    uint64_t h0, m0, wb, h1, m1, r, w, s0, s1;
+    struct stat st;
+    char path[64];
+    double t;
+
+    fs_ops.destroy(NULL);
+    cache_set_size(FS_CACHE);
+    cache_set_policy(policy);
+    fs_ops.init(NULL);
+
+    block_counts(&r, &w, &s0);
+    cache_counts(&h0, &m0, &wb);
+    t = now();
+    for (int i = 0; i < FS_ROUNDS; i++) {
+        sprintf(path, "/big%d", i % FS_BIG);
+        fs_ops.read(path, data, sizeof(data), 0, NULL);
+        for (int d = 0; d < FS_DIRS; d++)
+            for (int f = 0; f < FS_FILES; f++) {
+                sprintf(path, "/d%d/f%d", d, f);
+                fs_ops.getattr(path, &st);
+            }
+    }
+    t = now() - t;
+    block_counts(&r, &w, &s1);
+    cache_counts(&h1, &m1, &wb);
+
+    printf("%-6s %-22s %8.1f ms/round %9.1f%% hits %10.1f syscalls/round\n",
+           policy, "scan + getattr", t * 1e3 / FS_ROUNDS,
+           100.0 * (h1 - h0) / (h1 - h0 + m1 - m0),
+           (double)(s1 - s0) / FS_ROUNDS);
+}
+
+/* the same file system work on each backend, starting with nothing
+ * cached: stream every big file in 128 KB reads (the largest FUSE
+ * hands over), then stat every small file.
+ */
+static void run_fs(const char *backend)
+{
+    static char data[128 * 1024];
+    uint64_t r, w, s0, s1;
+    struct stat st;
+    char path[64];
+    double t;
+    int fd;
+
+    fs_ops.destroy(NULL);
+    if ((fd = open(FS_IMAGE, O_RDONLY)) >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    block_init_backend(FS_IMAGE, backend);
+    cache_set_size(1024);
+    cache_set_policy("2q");
+    fs_ops.init(NULL);
+
+    block_counts(&r, &w, &s0);
+    t = now();
+    for (int b = 0; b < FS_BIG; b++) {
+        sprintf(path, "/big%d", b);
+        for (int off = 0; off < FS_BIG_BLOCKS * FS_BLOCK_SIZE; off += sizeof(data))
+            fs_ops.read(path, data, sizeof(data), off, NULL);
+    }
+    for (int d = 0; d < FS_DIRS; d++)
+        for (int f = 0; f < FS_FILES; f++) {
+            sprintf(path, "/d%d/f%d", d, f);
+            fs_ops.getattr(path, &st);
+        }
+    t = now() - t;
+    block_counts(&r, &w, &s1);
+
+    printf("%-6s %-22s %8.1f ms %10.1f MB/s %14llu syscalls\n",
+           backend, "fs read + getattr", t * 1e3,
+           FS_BIG * FS_BIG_BLOCKS * (FS_BLOCK_SIZE / 1e6) / t,
+           (unsigned long long)(s1 - s0));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        image = argv[1];
+
+    run("file");
+    run("uring");
+    run("mmap");
+    run("ram");
+
+    run_alloc(0.90);
+    run_alloc(0.99);
+    run_alloc(0.995);
+    run_fill(0.0);
+    run_fill(0.5);
+    run_fill(0.9);
+    run_fill(0.99);
+    run_fill(0.999);
+
+    mkfs();
+    block_init_backend(FS_IMAGE, "file");
+    fs_ops.init(NULL);
+    populate();
+    run_cache("lru");
+    run_cache("2q");
+    run_fs("file");
+    run_fs("uring");
+    run_fs("mmap");
+    run_fs("ram");
+    fs_ops.destroy(NULL);
+    return 0;
+}
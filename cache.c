@@ -0,0 +1,986 @@
+/*
+ * file:        cache.c
+ * description: write-back block cache for the CS 5600 file system.
+ *              Sits between homework.c and the block layer in misc.c:
+ *              same calling conventions as block_read/block_write, but
+ *              one block per call, tagged with what it holds, and
+ *              blocks are kept in memory.
+ *
+ * CS 5600, Computer Systems, Northeastern
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fs5600.h"
+
+extern int block_readv(struct block_seg *segs, int nsegs);
+extern int block_writev(struct block_seg *segs, int nsegs);
+extern void *block_ptr(int lba);
+extern int block_discard(int lba, int nblks);
+
+#define CACHE_BLOCKS 1024	/* default capacity, 4 MB */
+
+/* The flusher thread wakes up every FLUSH_INTERVAL seconds and writes
+ * back blocks that have been dirty for DIRTY_EXPIRE seconds or more;
+ * it is woken early, and writes back everything, when more than a
+ * quarter of the cache is dirty. Before that it calls the file
+ * system's flush hook, if one is set, to write its own caches (the
+ * inode cache) into this one on the same schedule.
+ */
+#define FLUSH_INTERVAL 1
+#define DIRTY_EXPIRE   5
+
+/* Replacement policies. CACHE_LRU keeps every block on one LRU list.
+ * CACHE_2Q is the "2Q" scheme of Johnson and Shasha: a data block read
+ * for the first time goes on a short FIFO (a1in) and only moves to the
+ * main LRU list (am) if it is asked for again after falling off the
+ * FIFO, which is remembered in a list of recently evicted LBAs (a1out,
+ * no data). A large sequential read then only churns a1in and cannot
+ * push directory and inode blocks out; those go straight onto am.
+ */
+enum { CACHE_LRU, CACHE_2Q };
+
+/* Discards are not passed to the device when blocks are freed: until
+ * the bitmap and the inode or directory that let go of them are on
+ * disk, a crash would bring back a file whose blocks had been punched
+ * out. Freed blocks are kept as runs, sorted by LBA, with the time they
+ * were freed; a run is sent once no block dirtied at or before then is
+ * still dirty - after the writeback that took the metadata out. A
+ * block written again before that is taken out of its run. When the
+ * table is full a discard is dropped, which is always safe.
+ */
+#define DISCARD_RUNS 256
+
+struct drun {
+    int    lba, n;
+    time_t freed;
+};
+
+enum { Q_AM, Q_A1IN, Q_A1OUT };
+
+/* A block that missed is on its hash chain and list while cache_readv
+ * reads it in without the lock, so that nobody else caches the LBA or
+ * evicts the block meanwhile. A write to it fills it in (and the reader
+ * then returns that instead); a discard takes it off the hash chain and
+ * list and leaves it for the reader to free.
+ */
+enum { RD_NONE, RD_PENDING, RD_WRITTEN, RD_DROPPED };
+
+/* One cached block, or a ghost (a1out entry, data == NULL). Both are
+ * on a hash chain by LBA and on the list for their queue, most recently
+ * used (or inserted) at the head.
+ */
+struct cblock {
+    int            lba;
+    int            dirty;
+    time_t         dirtied;	/* when it last went from clean to dirty */
+    int            queue;	/* Q_AM, ... */
+    int            prefetched;	/* read ahead and not used yet */
+    int            reading;	/* RD_NONE, ... (see RD_PENDING) */
+    char          *data;
+    struct cblock *hnext;
+    struct cblock *prev, *next;
+};
+
+static struct {
+    int              capacity;	/* in blocks; 0 = pass everything through */
+    int              policy;
+    int              nused;
+    int              nreading;	/* blocks not RD_NONE */
+    struct cblock   *blocks;	/* 'capacity' of them */
+    char            *data;
+    struct cblock   *ghosts;	/* 'nghosts' of them, for a1out */
+    int              nghosts, ghosts_used;
+    struct cblock   *free_ghosts;	/* chained through hnext */
+    struct cblock   *free_blocks;	/* discarded, ditto */
+    struct cblock  **hash;
+    int              nhash;
+    struct cblock    q[3];	/* list heads, indexed by Q_AM... */
+    int              qlen[3];
+    uint64_t         hits, misses, writebacks;
+    uint64_t         ra_blocks, ra_hits;
+    uint64_t         gen;	/* bumped by every write */
+    int              ndirty;
+    int              flusher;	/* flusher thread started */
+    int              wb_error;	/* its writeback failed, not reported yet */
+    struct drun      discards[DISCARD_RUNS];	/* sorted by lba */
+    int              ndiscard;
+    pthread_mutex_t  lock;
+    pthread_cond_t   flush_wake;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .flush_wake = PTHREAD_COND_INITIALIZER};
+
+/* Readahead requests (cache_prefetch) are queued for one background
+ * thread, so the reader doesn't wait for them. If the queue is full a
+ * request is dropped - it is only a hint.
+ */
+#define RA_QUEUE      16
+#define RA_MAX_BLOCKS 64
+
+static struct {
+    struct {
+        int lba[RA_MAX_BLOCKS];
+        int n;
+    }               req[RA_QUEUE];
+    int             head, count;	/* the one at head is in progress */
+    int             started;
+    pthread_mutex_t lock;
+    pthread_cond_t  work, idle;
+} ra = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER};
+
+static int cache_size = CACHE_BLOCKS;	/* used by the next cache_init */
+static int cache_policy = CACHE_2Q;
+static int dirty_expire = DIRTY_EXPIRE;
+static int (*flush_hook)(time_t cutoff);
+
+/* capacity, in blocks, for the next cache_init (hw3fuse -cache)
+ */
+void cache_set_size(int nblocks)
+{
+    cache_size = nblocks < 0 ? 0 : nblocks;
+}
+
+/* replacement policy for the next cache_init, "lru" or "2q"
+ * (hw3fuse -cache-policy). Returns -EINVAL if unknown, 0 otherwise
+ */
+int cache_set_policy(const char *name)
+{
+    if (!strcmp(name, "lru"))
+        cache_policy = CACHE_LRU;
+    else if (!strcmp(name, "2q"))
+        cache_policy = CACHE_2Q;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+/* seconds a block may stay dirty before the flusher writes it back
+ */
+void cache_set_expire(int secs)
+{
+    dirty_expire = secs < 0 ? 0 : secs;
+}
+
+/* have the flusher call 'hook' on each pass, without the cache lock,
+ * with the time at or before which anything dirty is due to be written
+ * (NULL for none). A non-zero return is reported like a failed
+ * writeback, by the next cache_sync.
+ */
+void cache_set_flush_hook(int (*hook)(time_t cutoff))
+{
+    pthread_mutex_lock(&cache.lock);
+    flush_hook = hook;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void cache_counts(uint64_t *hits, uint64_t *misses, uint64_t *writebacks)
+{
+    pthread_mutex_lock(&cache.lock);
+    *hits = cache.hits;
+    *misses = cache.misses;
+    *writebacks = cache.writebacks;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* blocks read ahead, and how many of them were then read for real
+ */
+void cache_ra_counts(uint64_t *prefetched, uint64_t *used)
+{
+    pthread_mutex_lock(&cache.lock);
+    *prefetched = cache.ra_blocks;
+    *used = cache.ra_hits;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static int bypass(void)
+{
+    return cache.capacity == 0;
+}
+
+static void q_unlink(struct cblock *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    cache.qlen[b->queue]--;
+}
+
+static void q_push(struct cblock *b, int queue)
+{
+    struct cblock *head = &cache.q[queue];
+    b->queue = queue;
+    b->next = head->next;
+    b->prev = head;
+    head->next->prev = b;
+    head->next = b;
+    cache.qlen[queue]++;
+}
+
+static struct cblock **hash_slot(int lba)
+{
+    return &cache.hash[(unsigned)lba % cache.nhash];
+}
+
+/* cached block or ghost for 'lba', or NULL */
+static struct cblock *lookup(int lba)
+{
+    for (struct cblock *b = *hash_slot(lba); b != NULL; b = b->hnext)
+        if (b->lba == lba)
+            return b;
+    return NULL;
+}
+
+static void hash_insert(struct cblock *b)
+{
+    b->hnext = *hash_slot(b->lba);
+    *hash_slot(b->lba) = b;
+}
+
+static void hash_remove(struct cblock *b)
+{
+    struct cblock **pp = hash_slot(b->lba);
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+static int cmp_seg(const void *a, const void *b)
+{
+    return ((struct block_seg*)a)->lba - ((struct block_seg*)b)->lba;
+}
+
+static void mark_dirty(struct cblock *b)
+{
+    if (!b->dirty) {
+        b->dirty = 1;
+        b->dirtied = time(NULL);
+        if (++cache.ndirty == cache.capacity / 4 + 1)
+            pthread_cond_signal(&cache.flush_wake);
+    }
+}
+
+/* write the (dirty) cached blocks in 'segs' back in LBA order, so that
+ * adjacent blocks go out in one transfer, and mark them clean. Called
+ * with the lock held.
+ */
+static int write_segs(struct block_seg *segs, int n)
+{
+    int rv;
+
+    if (n == 0)
+        return 0;
+    qsort(segs, n, sizeof(*segs), cmp_seg);
+    if ((rv = block_writev(segs, n)) == 0) {
+        for (int i = 0; i < n; i++)
+            lookup(segs[i].lba)->dirty = 0;
+        cache.ndirty -= n;
+        cache.writebacks += n;
+    }
+    return rv;
+}
+
+/* write back every block that went dirty at or before 'cutoff' (all of
+ * them for cutoff = time(NULL)). Called with the lock held.
+ */
+static int writeback(time_t cutoff)
+{
+    struct block_seg *segs = malloc(cache.nused * sizeof(*segs));
+    int n = 0, rv;
+
+    if (!segs)
+        return -ENOMEM;
+    for (int q = Q_AM; q <= Q_A1IN; q++)
+        for (struct cblock *b = cache.q[q].next; b != &cache.q[q]; b = b->next)
+            if (b->dirty && b->dirtied <= cutoff) {
+                segs[n].lba = b->lba;
+                segs[n++].buf = b->data;
+            }
+    rv = write_segs(segs, n);
+    free(segs);
+    return rv;
+}
+
+/* index of the first pending discard run that ends after 'lba'. Called
+ * with the lock held.
+ */
+static int drun_find(int lba)
+{
+    int lo = 0, hi = cache.ndiscard;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cache.discards[mid].lba + cache.discards[mid].n <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void drun_remove(int i)
+{
+    memmove(&cache.discards[i], &cache.discards[i + 1],
+            (cache.ndiscard - i - 1) * sizeof(struct drun));
+    cache.ndiscard--;
+}
+
+/* queue a discard of [lba, lba+n), freed at 'freed', merging it with
+ * the runs either side of it if they touch. Called with the lock held.
+ */
+static void drun_add(int lba, int n, time_t freed)
+{
+    int i = drun_find(lba - 1);
+    struct drun *d = &cache.discards[i];
+
+    if (i < cache.ndiscard && d->lba <= lba + n) {
+        int end = d->lba + d->n;
+        if (lba < d->lba)
+            d->lba = lba;
+        if (end < lba + n)
+            end = lba + n;
+        d->freed = freed;
+        while (i + 1 < cache.ndiscard && d[1].lba <= end) {
+            if (end < d[1].lba + d[1].n)
+                end = d[1].lba + d[1].n;
+            drun_remove(i + 1);
+        }
+        d->n = end - d->lba;
+        return;
+    }
+    if (cache.ndiscard == DISCARD_RUNS)
+        return;
+    memmove(d + 1, d, (cache.ndiscard - i) * sizeof(*d));
+    d->lba = lba;
+    d->n = n;
+    d->freed = freed;
+    cache.ndiscard++;
+}
+
+/* block 'lba' is being written: it is in use again, so it must not be
+ * discarded. Called with the lock held.
+ */
+static void drun_cancel(int lba)
+{
+    int i = drun_find(lba);
+    struct drun *d = &cache.discards[i];
+
+    if (i == cache.ndiscard || d->lba > lba)
+        return;
+    if (d->n == 1)
+        drun_remove(i);
+    else if (lba == d->lba) {
+        d->lba++;
+        d->n--;
+    } else if (lba == d->lba + d->n - 1)
+        d->n--;
+    else if (cache.ndiscard == DISCARD_RUNS)
+        drun_remove(i);
+    else {
+        memmove(d + 1, d, (cache.ndiscard - i) * sizeof(*d));
+        cache.ndiscard++;
+        d->n = lba - d->lba;
+        d[1].n -= lba + 1 - d[1].lba;
+        d[1].lba = lba + 1;
+    }
+}
+
+/* send the pending discards freed before the oldest dirty block went
+ * dirty (all of them if nothing is dirty). A discard is only a hint,
+ * so errors are ignored. Called with the lock held.
+ */
+static void send_discards(void)
+{
+    time_t oldest = 0;
+    int ndirty = 0;
+
+    if (cache.ndiscard == 0)
+        return;
+    for (int q = Q_AM; q <= Q_A1IN; q++)
+        for (struct cblock *b = cache.q[q].next; b != &cache.q[q]; b = b->next)
+            if (b->dirty && (ndirty++ == 0 || b->dirtied < oldest))
+                oldest = b->dirtied;
+    for (int i = 0; i < cache.ndiscard; ) {
+        struct drun *d = &cache.discards[i];
+        if (ndirty > 0 && d->freed >= oldest) {
+            i++;
+            continue;
+        }
+        block_discard(d->lba, d->n);
+        drun_remove(i);
+    }
+}
+
+/* remember that 'lba' was just evicted from a1in, forgetting the
+ * oldest such LBA if a1out is full.
+ */
+static void add_ghost(int lba)
+{
+    struct cblock *g;
+
+    if (cache.nghosts == 0)
+        return;
+    if (cache.free_ghosts) {
+        g = cache.free_ghosts;
+        cache.free_ghosts = g->hnext;
+    } else if (cache.ghosts_used < cache.nghosts)
+        g = &cache.ghosts[cache.ghosts_used++];
+    else {
+        g = cache.q[Q_A1OUT].prev;
+        q_unlink(g);
+        hash_remove(g);
+    }
+    g->lba = lba;
+    g->dirty = 0;
+    hash_insert(g);
+    q_push(g, Q_A1OUT);
+}
+
+/* least recently used block on 'queue' that isn't being read in, or
+ * NULL
+ */
+static struct cblock *victim(int queue)
+{
+    for (struct cblock *b = cache.q[queue].prev; b != &cache.q[queue];
+         b = b->prev)
+        if (b->reading == RD_NONE)
+            return b;
+    return NULL;
+}
+
+/* get a block to hold a new LBA: a free one, or else a victim - the
+ * oldest a1in block while a1in is over its share (a quarter of the
+ * cache), otherwise the least recently used am block. Evicting a dirty
+ * block writes back all dirty blocks at once, which costs about the
+ * same as writing the one. Called with the lock held; the block comes
+ * back off both lists.
+ */
+static struct cblock *get_free(void)
+{
+    struct cblock *b;
+    int q = Q_AM;
+
+    if (cache.free_blocks) {
+        b = cache.free_blocks;
+        cache.free_blocks = b->hnext;
+        return b;
+    }
+    if (cache.nused < cache.capacity)
+        return &cache.blocks[cache.nused++];
+
+    if (cache.qlen[Q_A1IN] > 0 &&
+        (cache.qlen[Q_A1IN] > cache.capacity / 4 || cache.qlen[Q_AM] == 0))
+        q = Q_A1IN;
+    if (!(b = victim(q)) && !(b = victim(q == Q_AM ? Q_A1IN : Q_AM)))
+        return NULL;
+    if (b->dirty && writeback(time(NULL)) != 0)
+        return NULL;
+    q_unlink(b);
+    hash_remove(b);
+    if (b->queue == Q_A1IN)
+        add_ghost(b->lba);
+    return b;
+}
+
+/* take a block for 'lba', which missed, and put it on its hash chain
+ * and list, clean and with its data not filled in. Under 2Q, file data
+ * seen for the first time goes on a1in, everything else on am; 'g' is
+ * the block's a1out ghost, if any, which is dropped.
+ */
+static struct cblock *new_block(int lba, int type, struct cblock *g)
+{
+    struct cblock *b;
+    int queue = Q_AM;
+
+    if (g) {
+        q_unlink(g);
+        hash_remove(g);
+        g->hnext = cache.free_ghosts;
+        cache.free_ghosts = g;
+    } else if (cache.policy == CACHE_2Q && type == BLOCK_DATA)
+        queue = Q_A1IN;
+
+    if (!(b = get_free()))
+        return NULL;
+    b->lba = lba;
+    b->dirty = 0;
+    b->prefetched = 0;
+    b->reading = RD_NONE;
+    hash_insert(b);
+    q_push(b, queue);
+    return b;
+}
+
+/* cache a block that missed, with the data in 'buf'
+ */
+static int insert(int lba, const void *buf, int dirty, int type,
+                  struct cblock *g)
+{
+    struct cblock *b = new_block(lba, type, g);
+
+    if (!b)
+        return -EIO;
+    if (dirty)
+        mark_dirty(b);
+    memcpy(b->data, buf, FS_BLOCK_SIZE);
+    return 0;
+}
+
+/* a cached block was used again. On am that makes it most recently
+ * used; on a1in it stays put (a re-read soon after the first is the
+ * same access, not a sign of reuse) unless it turns out to be metadata.
+ */
+static void touch(struct cblock *b, int type)
+{
+    if (b->queue == Q_A1IN && type == BLOCK_DATA)
+        return;
+    q_unlink(b);
+    q_push(b, Q_AM);
+}
+
+/* read 'nsegs' single blocks of the given type (enum block_type). Hits
+ * are copied out of the cache; all the misses are fetched with one
+ * vectored read, without the lock, and then cached (see RD_PENDING). A
+ * miss already being read in by someone else is just read again, and so
+ * are misses past the point where only one block in the cache would be
+ * left to evict.
+ * Returns -EIO if error, 0 otherwise
+ */
+int cache_readv(struct block_seg *segs, int nsegs, int type)
+{
+    struct block_seg *miss;
+    struct cblock **mine;	/* the block reserved for each miss, or NULL */
+    int nmiss = 0, rv = 0;
+
+    if (bypass())
+        return block_readv(segs, nsegs);
+    miss = malloc(nsegs * sizeof(*miss));
+    mine = malloc(nsegs * sizeof(*mine));
+    if (!miss || !mine) {
+        free(miss);
+        free(mine);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < nsegs && rv == 0; i++) {
+        struct cblock *b = lookup(segs[i].lba);
+        if (b && b->data && b->reading != RD_PENDING) {
+            memcpy(segs[i].buf, b->data, FS_BLOCK_SIZE);
+            touch(b, type);
+            cache.hits++;
+            if (b->prefetched) {
+                b->prefetched = 0;
+                cache.ra_hits++;
+            }
+            continue;
+        }
+        mine[nmiss] = NULL;
+        if ((!b || !b->data) && cache.nreading < cache.capacity - 1) {
+            if (!(mine[nmiss] = new_block(segs[i].lba, type, b)))
+                rv = -EIO;
+            else {
+                mine[nmiss]->reading = RD_PENDING;
+                cache.nreading++;
+            }
+        }
+        miss[nmiss++] = segs[i];
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (nmiss > 0 && rv == 0)
+        rv = block_readv(miss, nmiss);
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < nmiss; i++) {
+        struct cblock *b = mine[i];
+        if (!b)
+            continue;
+        cache.nreading--;
+        if (b->reading == RD_WRITTEN)
+            memcpy(miss[i].buf, b->data, FS_BLOCK_SIZE);
+        else if (b->reading == RD_PENDING && rv == 0)
+            memcpy(b->data, miss[i].buf, FS_BLOCK_SIZE);
+        else {
+            if (b->reading == RD_PENDING) {
+                q_unlink(b);
+                hash_remove(b);
+            }
+            b->hnext = cache.free_blocks;
+            cache.free_blocks = b;
+        }
+        b->reading = RD_NONE;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    free(miss);
+    free(mine);
+    return rv == 0 ? 0 : -EIO;
+}
+
+/* write 'nsegs' single blocks of the given type into the cache,
+ * marking them dirty. They reach the disk when the flusher thread gets
+ * to them, on eviction, or on cache_sync or cache_flush.
+ * Returns -EIO if error, 0 otherwise
+ */
+int cache_writev(struct block_seg *segs, int nsegs, int type)
+{
+    int rv = 0;
+
+    if (bypass())
+        return block_writev(segs, nsegs);
+
+    pthread_mutex_lock(&cache.lock);
+    cache.gen++;
+    for (int i = 0; i < nsegs && rv == 0; i++) {
+        struct cblock *b = lookup(segs[i].lba);
+        if (cache.ndiscard > 0)
+            drun_cancel(segs[i].lba);
+        if (b && b->data) {
+            memcpy(b->data, segs[i].buf, FS_BLOCK_SIZE);
+            mark_dirty(b);
+            touch(b, type);
+            if (b->reading == RD_PENDING)
+                b->reading = RD_WRITTEN;
+        } else {
+            rv = insert(segs[i].lba, segs[i].buf, 1, type, b);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return rv == 0 ? 0 : -EIO;
+}
+
+int cache_read(void *buf, int lba, int type)
+{
+    struct block_seg seg = {lba, buf};
+    return cache_readv(&seg, 1, type);
+}
+
+int cache_write(void *buf, int lba, int type)
+{
+    struct block_seg seg = {lba, buf};
+    return cache_writev(&seg, 1, type);
+}
+
+/* read the blocks in 'lba' that aren't cached and add them as file
+ * data. (Blocks on a1out are left alone: a real read of one of those
+ * should promote it, which a prefetch would prevent.) The read is done
+ * without the cache lock; if anything was written to the cache
+ * meanwhile the blocks are dropped, since one of them might be older
+ * than what was written.
+ */
+static void prefetch(int *lba, int n)
+{
+    static char bufs[RA_MAX_BLOCKS][FS_BLOCK_SIZE];	/* worker only */
+    struct block_seg segs[RA_MAX_BLOCKS];
+    int nmiss = 0;
+    uint64_t gen;
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < n; i++)
+        if (!lookup(lba[i])) {
+            segs[nmiss].lba = lba[i];
+            segs[nmiss].buf = bufs[nmiss];
+            nmiss++;
+        }
+    gen = cache.gen;
+    pthread_mutex_unlock(&cache.lock);
+
+    if (nmiss == 0 || block_readv(segs, nmiss) != 0)
+        return;
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < nmiss && gen == cache.gen && !bypass(); i++)
+        if (!lookup(segs[i].lba) &&
+            insert(segs[i].lba, segs[i].buf, 0, BLOCK_DATA, NULL) == 0) {
+            lookup(segs[i].lba)->prefetched = 1;
+            cache.ra_blocks++;
+        }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void *ra_thread(void *arg)
+{
+    pthread_mutex_lock(&ra.lock);
+    for (;;) {
+        while (ra.count == 0)
+            pthread_cond_wait(&ra.work, &ra.lock);
+        int i = ra.head;
+        pthread_mutex_unlock(&ra.lock);
+
+        prefetch(ra.req[i].lba, ra.req[i].n);
+
+        pthread_mutex_lock(&ra.lock);
+        ra.head = (ra.head + 1) % RA_QUEUE;
+        ra.count--;
+        if (ra.count == 0)
+            pthread_cond_broadcast(&ra.idle);
+    }
+    return NULL;
+}
+
+/* start reading blocks 'lba[0..n-1]' into the cache in the background
+ * (at most RA_MAX_BLOCKS; more are ignored).
+ */
+void cache_prefetch(const int *lba, int n)
+{
+    if (bypass() || n <= 0)
+        return;
+    if (n > RA_MAX_BLOCKS)
+        n = RA_MAX_BLOCKS;
+
+    pthread_mutex_lock(&ra.lock);
+    if (!ra.started) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, ra_thread, NULL) != 0) {
+            pthread_mutex_unlock(&ra.lock);
+            return;
+        }
+        pthread_detach(t);
+        ra.started = 1;
+    }
+    if (ra.count < RA_QUEUE) {
+        int i = (ra.head + ra.count) % RA_QUEUE;
+        memcpy(ra.req[i].lba, lba, n * sizeof(*lba));
+        ra.req[i].n = n;
+        ra.count++;
+        pthread_cond_signal(&ra.work);
+    }
+    pthread_mutex_unlock(&ra.lock);
+}
+
+/* wait until all queued readahead is done
+ */
+void cache_prefetch_wait(void)
+{
+    pthread_mutex_lock(&ra.lock);
+    while (ra.count > 0)
+        pthread_cond_wait(&ra.idle, &ra.lock);
+    pthread_mutex_unlock(&ra.lock);
+}
+
+/* write all dirty blocks back to the block layer, then send the
+ * pending discards.
+ * Returns -EIO if error, 0 otherwise
+ */
+int cache_flush(void)
+{
+    int rv;
+
+    if (bypass())
+        return 0;
+    pthread_mutex_lock(&cache.lock);
+    if ((rv = writeback(time(NULL))) == 0)
+        send_discards();
+    pthread_mutex_unlock(&cache.lock);
+    return rv == 0 ? 0 : -EIO;
+}
+
+/* write back just those of blocks 'lba[0..n-1]' that are dirty - for
+ * fsync of one file.
+ * Returns -EIO if error, or if the flusher thread failed to write
+ * something back since the last call, 0 otherwise
+ */
+int cache_sync(const int *lba, int n)
+{
+    struct block_seg *segs;
+    int nseg = 0, rv;
+
+    if (bypass())
+        return 0;
+    if (!(segs = malloc(n * sizeof(*segs))))
+        return -EIO;
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < n; i++) {
+        struct cblock *b = lookup(lba[i]);
+        if (b && b->dirty) {
+            b->dirty = 0;	/* so a duplicate LBA is only taken once */
+            segs[nseg].lba = lba[i];
+            segs[nseg++].buf = b->data;
+        }
+    }
+    for (int i = 0; i < nseg; i++)
+        lookup(segs[i].lba)->dirty = 1;
+    rv = write_segs(segs, nseg);
+    if (cache.wb_error) {
+        cache.wb_error = 0;
+        rv = -EIO;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    free(segs);
+    return rv == 0 ? 0 : -EIO;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* blocks 'lba[0..n-1]' have been freed by the file system: drop them
+ * from the cache - dirty or not, they never need to be written - and
+ * queue the discard for the device, one run of adjacent blocks at a
+ * time, to be sent after the metadata that freed them is written back
+ * (see DISCARD_RUNS). The caller has put that metadata in the cache
+ * already. Without a cache the discard is passed on at once.
+ * Returns -EIO if error, 0 otherwise
+ */
+int cache_discard(const int *lba, int n)
+{
+    int *sorted = malloc(n * sizeof(*sorted));
+    int rv = 0;
+    time_t now = time(NULL);
+
+    if (!sorted)
+        return -EIO;
+    memcpy(sorted, lba, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), cmp_int);
+
+    pthread_mutex_lock(&cache.lock);
+    if (!bypass()) {
+        cache.gen++;
+        for (int i = 0; i < n; i++) {
+            struct cblock *b = lookup(sorted[i]);
+            if (!b)
+                continue;
+            q_unlink(b);
+            hash_remove(b);
+            if (!b->data) {
+                b->hnext = cache.free_ghosts;
+                cache.free_ghosts = b;
+                continue;
+            }
+            if (b->dirty)
+                cache.ndirty--;
+            b->dirty = 0;
+            if (b->reading != RD_NONE) {
+                b->reading = RD_DROPPED;	/* cache_readv frees it */
+                continue;
+            }
+            b->hnext = cache.free_blocks;
+            cache.free_blocks = b;
+        }
+    }
+
+    for (int i = 0; i < n && rv == 0; ) {
+        int j = i + 1;
+        while (j < n && sorted[j] <= sorted[j - 1] + 1)
+            j++;
+        if (bypass())
+            rv = block_discard(sorted[i], sorted[j - 1] - sorted[i] + 1);
+        else
+            drun_add(sorted[i], sorted[j - 1] - sorted[i] + 1, now);
+        i = j;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    free(sorted);
+    return rv == 0 ? 0 : -EIO;
+}
+
+static void *flush_thread(void *arg)
+{
+    pthread_mutex_lock(&cache.lock);
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += FLUSH_INTERVAL;
+        pthread_cond_timedwait(&cache.flush_wake, &cache.lock, &ts);
+
+        /* nobody is waiting for this; the next cache_sync reports it */
+        if (flush_hook) {
+            int (*hook)(time_t) = flush_hook;
+            pthread_mutex_unlock(&cache.lock);
+            int rv = hook(time(NULL) - dirty_expire);
+            pthread_mutex_lock(&cache.lock);
+            if (rv != 0)
+                cache.wb_error = 1;
+        }
+        if (bypass())
+            continue;
+        if (cache.ndirty > 0 &&
+            writeback(cache.ndirty > cache.capacity / 4 ?
+                      time(NULL) : time(NULL) - dirty_expire) != 0)
+            cache.wb_error = 1;
+        send_discards();
+    }
+    return NULL;
+}
+
+/* (re)create the cache with the size and policy set by cache_set_size
+ * and cache_set_policy, writing back and dropping anything cached
+ * before, and start the flusher thread if it isn't running. A
+ * memory-mapped image already is a cache, so then the cache passes
+ * everything through.
+ * Returns -ENOMEM or -EIO if error, 0 otherwise
+ */
+int cache_init(void)
+{
+    int rv;
+
+    cache_prefetch_wait();
+    rv = cache_flush();
+
+    pthread_mutex_lock(&cache.lock);
+    free(cache.blocks);
+    free(cache.data);
+    free(cache.ghosts);
+    free(cache.hash);
+    cache.blocks = NULL;
+    cache.data = NULL;
+    cache.ghosts = NULL;
+    cache.hash = NULL;
+    cache.nused = cache.ghosts_used = cache.nreading = 0;
+    cache.free_ghosts = cache.free_blocks = NULL;
+    for (int q = Q_AM; q <= Q_A1OUT; q++) {
+        cache.q[q].next = cache.q[q].prev = &cache.q[q];
+        cache.qlen[q] = 0;
+    }
+    cache.hits = cache.misses = cache.writebacks = 0;
+    cache.ra_blocks = cache.ra_hits = 0;
+    cache.ndirty = 0;
+    cache.wb_error = 0;
+    cache.ndiscard = 0;
+    cache.gen++;
+
+    cache.capacity = block_ptr(0) ? 0 : cache_size;
+    cache.policy = cache_policy;
+    cache.nghosts = (cache.policy == CACHE_2Q) ? cache.capacity / 2 : 0;
+    if (cache.capacity > 0) {
+        cache.nhash = cache.capacity * 2 + 1;
+        cache.blocks = calloc(cache.capacity, sizeof(*cache.blocks));
+        cache.data = malloc((size_t)cache.capacity * FS_BLOCK_SIZE);
+        cache.ghosts = calloc(cache.nghosts + 1, sizeof(*cache.ghosts));
+        cache.hash = calloc(cache.nhash, sizeof(*cache.hash));
+        if (!cache.blocks || !cache.data || !cache.ghosts || !cache.hash) {
+            free(cache.blocks);
+            free(cache.data);
+            free(cache.ghosts);
+            free(cache.hash);
+            cache.blocks = NULL;
+            cache.data = NULL;
+            cache.ghosts = NULL;
+            cache.hash = NULL;
+            cache.capacity = cache.nghosts = 0;
+            rv = -ENOMEM;
+        }
+        for (int i = 0; i < cache.capacity; i++)
+            cache.blocks[i].data = cache.data + (size_t)i * FS_BLOCK_SIZE;
+    }
+    if (!cache.flusher) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, flush_thread, NULL) == 0) {
+            pthread_detach(t);
+            cache.flusher = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return rv;
+}
@@ -7,10 +7,20 @@ class dirent(Structure):
                 ("inode", c_uint, 31),
                 ("name", c_char * 28)]
         
+VERSION_DENSE = 2               # 1 was dense with block pointers, not extents
+VERSION_INDIRECT = 3            # inode per block, ending in indir[] etc.
+
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("bitmap_blocks", c_uint),
+                ("version", c_uint),
+                ("inode_map", c_uint),
+                ("inode_table", c_uint),
+                ("inode_count", c_uint),
+                ("_pad", c_char * 4068)]
+
+NDIRECT = 1014                  # block pointers in the inode
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -19,7 +29,42 @@ class inode(Structure):
                 ("ctime", c_uint),
                 ("mtime", c_uint),
                 ("size", c_int),
-                ("ptrs", c_uint * 1019)]
+                ("ptrs", c_uint * NDIRECT),
+                ("indir", c_uint * 3),
+                ("size_hi", c_uint),
+                ("flags", c_uint)]
+
+INODE_INLINE = 1                # file data in ptrs[], no blocks
+
+# inode table entry in a dense image (VERSION_DENSE): blocks are mapped
+# by extents, NEXTENT in the inode and the rest in an extent tree
+class extent(Structure):
+    _fields_ = [("fblk", c_uint),
+                ("lba", c_uint),
+                ("len", c_uint)]
+
+NEXTENT = 8
+
+class dinode(Structure):
+    _fields_ = [("uid", c_ushort),
+                ("gid", c_ushort),
+                ("mode", c_uint),
+                ("ctime", c_uint),
+                ("mtime", c_uint),
+                ("size", c_int),
+                ("depth", c_ushort),
+                ("nextent", c_ushort),
+                ("ext", extent * NEXTENT),
+                ("_pad", c_uint * 2)]
+
+EXTENTS_PER_BLOCK = (4096 - 8) // sizeof(extent)
+
+class extent_block(Structure):
+    _fields_ = [("depth", c_uint),
+                ("count", c_uint),
+                ("ext", extent * EXTENTS_PER_BLOCK)]
+
+INODES_PER_BLOCK = 4096 // sizeof(dinode)
 
 class bitmap(Structure):
     _fields_ = [("vals", c_uint * 1024)]
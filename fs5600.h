@@ -12,6 +12,9 @@
 #define FS_BLOCK_SIZE 4096
 #define FS_MAGIC 0x30303635
 
+/* one bitmap block covers this many blocks (128 MB of image) */
+#define FS_BITS_PER_BLOCK (FS_BLOCK_SIZE * 8)
+
 #define MAX_PATH_LEN 10
 #define MAX_NAME_LEN 27
 
@@ -27,24 +30,140 @@ struct fs_dirent {
     char name[28];              /* with trailing NUL */
 };
 
+/* Image format versions. In the original one (0) each inode takes a
+ * whole block and an inode number is that block's number; all of the
+ * inode past its header is direct block pointers. Version 3 is the
+ * same but for the end of the inode, which holds the indirect block
+ * pointers, the high half of the size and flags (struct fs_inode); in
+ * a version 0 image that part must be zero, and is left that way, so
+ * files stay within FS_NDIRECT blocks. A dense image packs
+ * FS_INODES_PER_BLOCK inodes into each block of an inode table, with
+ * a bitmap of the ones in use; inode numbers index the table, the
+ * root is inode 1 and inode 0 is never used. Version 1 was the first
+ * dense format, whose inodes held block pointers instead of extents;
+ * it is no longer supported.
+ */
+#define FS_VERSION_DENSE_PTRS 1
+#define FS_VERSION_DENSE 2
+#define FS_VERSION_INDIRECT 3
+
 /* Superblock - holds file system parameters. 
  */
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t bitmap_blocks;     /* blocks 1..bitmap_blocks; 0 means 1 */
+    uint32_t version;           /* 0, FS_VERSION_INDIRECT or _DENSE */
+    uint32_t inode_map;         /* dense: first block of the inode bitmap */
+    uint32_t inode_table;       /* dense: first block of the inode table */
+    uint32_t inode_count;       /* dense: inodes in the table */
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 7 * sizeof(uint32_t)]; 
 };
 
+/* Inode in the original format. The first FS_NDIRECT blocks of a file
+ * are in ptrs[]; after that come indir[0], a block of FS_PTRS_PER_BLOCK
+ * block pointers, then the blocks under indir[1] (double indirect: a
+ * block of pointers to such blocks) and indir[2] (triple indirect).
+ * A file of up to FS_INLINE_MAX bytes with FS_INODE_INLINE set has no
+ * blocks: its data is stored in ptrs[] itself.
+ */
+#define FS_NDIRECT (FS_BLOCK_SIZE/4 - 10)
+#define FS_NINDIR 3
+#define FS_PTRS_PER_BLOCK (FS_BLOCK_SIZE/4)
+
 struct fs_inode {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int32_t  size;              /* low 32 bits */
+    uint32_t ptrs[FS_NDIRECT];
+    uint32_t indir[FS_NINDIR];  /* single, double, triple indirect */
+    uint32_t size_hi;           /* high 32 bits of the size */
+    uint32_t flags;
+};                              /* inode = 4096 bytes */
+
+#define FS_INODE_INLINE 1       /* data in ptrs[] */
+#define FS_INLINE_MAX   (FS_NDIRECT * 4)
+
+/* Inode in a dense image's inode table. Its blocks are mapped by
+ * extents, runs of file blocks held in consecutive disk blocks. Up to
+ * FS_NEXTENT of them fit in the inode; past that the inode holds the
+ * root of an extent tree (depth > 0), whose nodes are extent blocks.
+ * An entry of a node at depth d > 0 points to a node at depth d-1 and
+ * 'len' is the span of file blocks under it; at depth 0 it is an extent.
+ */
+struct fs_extent {
+    uint32_t fblk;              /* first file block */
+    uint32_t lba;               /* first disk block, or the node below */
+    uint32_t len;               /* in blocks */
+};
+
+#define FS_NEXTENT 8
+
+struct fs_dinode {
     uint16_t uid;
     uint16_t gid;
     uint32_t mode;
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
-    uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+    uint16_t depth;             /* of the extent tree; 0 = none */
+    uint16_t nextent;           /* entries used in ext[] */
+    struct fs_extent ext[FS_NEXTENT];
+    uint32_t pad[2];
+};                              /* 128 bytes */
+
+#define FS_INODES_PER_BLOCK ((int)(FS_BLOCK_SIZE / sizeof(struct fs_dinode)))
+
+/* A node of an extent tree below the inode, entries in file order.
+ */
+#define FS_EXTENTS_PER_BLOCK \
+    ((int)((FS_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct fs_extent)))
+
+struct fs_extent_block {
+    uint32_t depth;             /* 0 = leaf */
+    uint32_t count;
+    struct fs_extent ext[FS_EXTENTS_PER_BLOCK];
+};
+
+/* One block of a vectored transfer (block_readv, block_writev):
+ * the block at 'lba' goes to or from 'buf'.
+ */
+struct block_seg {
+    int   lba;
+    void *buf;
+};
+
+/* What a block holds, passed to the block cache so it can tell
+ * metadata from file data (see cache_set_policy in cache.c).
+ */
+enum block_type {
+    BLOCK_DATA = 0,		/* file contents */
+    BLOCK_DIR,			/* directory entries */
+    BLOCK_INODE,		/* inodes, inode table, extent blocks */
+    BLOCK_META,			/* superblock, bitmaps */
+};
+
+/* Operations counted in stats.c: the FUSE entry points, then the
+ * block layer.
+ */
+enum stat_op {
+    OP_GETATTR = 0, OP_READDIR, OP_CREATE, OP_MKDIR, OP_UNLINK, OP_RMDIR,
+    OP_RENAME, OP_CHMOD, OP_UTIME, OP_TRUNCATE, OP_READ, OP_WRITE,
+    OP_STATFS, OP_FSYNC, OP_FLUSH, OP_RELEASE, OP_FALLOCATE,
+    OP_BLOCK_READ, OP_BLOCK_WRITE,
+    N_STAT_OPS
+};
+
+/* one timed call, from stats_begin to stats_end */
+struct stat_timer {
+    int      op;
+    uint64_t start_ns;
+    uint64_t blocks_read, blocks_written;	/* this thread's, at start */
 };
 
 #endif
@@ -1,17 +1,45 @@
 #!/usr/bin/python
 #
-# usage: gen-disk.py input output.img
+# usage: gen-disk.py [-q] [-d] input output.img
 #
-# see comments in disk1.in for file format
+# see comments in disk1.in for file format. With -d the image is in the
+# dense format (fs5600.h): inodes are numbered in the order they're
+# listed, with the root as inode 1, and packed into an inode table.
 
 import sys
 import diskfmt as fs
 import random as rnd
 
 quiet = False
-if sys.argv[1] == '-q':
-    quiet = True
-    sys.argv.pop(1)
+dense = False
+while sys.argv[1][0] == '-':
+    opt = sys.argv.pop(1)
+    if opt == '-q':
+        quiet = True
+    if opt == '-d':
+        dense = True
+
+# inode numbers in the input are block numbers; with -d, old -> new
+inums = dict()
+
+# runs of consecutive blocks, as (file block, first block, length)
+def extents(blocks):
+    ext = []
+    for i in range(len(blocks)):
+        if ext and ext[-1][1] + ext[-1][2] == blocks[i]:
+            ext[-1][2] += 1
+        else:
+            ext.append([i, blocks[i], 1])
+    return ext
+
+def dinode(f, ext, depth):
+    i = fs.dinode()
+    i.uid, i.gid, i.mode = f.uid, f.gid, f.mode
+    i.ctime, i.mtime, i.size = f.ctime, f.mtime, f.size
+    i.depth, i.nextent = depth, len(ext)
+    for j in range(len(ext)):
+        i.ext[j].fblk, i.ext[j].lba, i.ext[j].len = ext[j]
+    return bytearray(i)
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
@@ -76,6 +104,7 @@ class dir(object):
         j = 0
         for i in range(offset*128, min(len(self.entries), (offset+1)*128)):
             val,name,num = self.entries[i]
+            num = inums.get(num, num)
             de.valid, de.inode, de.name = val, num, name.encode('ascii')
             data[j:j+32] = bytearray(de)
             j += 32
@@ -114,11 +143,12 @@ blockmap = fs.bitmap()
 blockmap.set(0,True)                      # superblock
 blockmap.set(1,True)                      # bitmap
 
-blocks = [None] * 400
+blocks = [None] * nblocks
 
 for f in files + dirs:
-    blocks[f.inum] = [f]
-    blockmap.set(f.inum, True)
+    if not dense:
+        blocks[f.inum] = [f]
+        blockmap.set(f.inum, True)
     i = 0
     for b in f.blocks:
         if blockmap.get(b):
@@ -129,14 +159,62 @@ for f in files + dirs:
 
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
+sb.version = fs.VERSION_INDIRECT
 zeros = bytearray(4096)
 
+# dense: the inode bitmap, the inode table (an inode per 4 blocks, or
+# more if needed) and any extent tree blocks go in the first free blocks
+def alloc(n):
+    start = 2
+    while not all(not blockmap.get(b) for b in range(start, start + n)):
+        start += 1
+    for b in range(start, start + n):
+        blockmap.set(b, True)
+    return start
+
+if dense:
+    items = sorted(files + dirs, key=lambda f: f.name != '/')
+    for n in range(len(items)):
+        inums[items[n].inum] = n + 1
+    ninodes = max(len(items) + 1, nblocks // 4)
+    ntable = (ninodes + fs.INODES_PER_BLOCK - 1) // fs.INODES_PER_BLOCK
+    sb.version = fs.VERSION_DENSE
+    sb.inode_count = ntable * fs.INODES_PER_BLOCK
+    sb.inode_map = alloc(1)
+    sb.inode_table = alloc(ntable)
+
+    imap = fs.bitmap()
+    table = bytearray(4096 * ntable)
+    imap.set(0, True)
+    for f in items:
+        n = inums[f.inum]
+        imap.set(n, True)
+        ext, depth = extents(f.blocks), 0
+        while len(ext) > fs.NEXTENT:
+            up = []
+            for k in range(0, len(ext), fs.EXTENTS_PER_BLOCK):
+                part = ext[k:k + fs.EXTENTS_PER_BLOCK]
+                node = fs.extent_block()
+                node.depth, node.count = depth, len(part)
+                for j in range(len(part)):
+                    node.ext[j].fblk, node.ext[j].lba, node.ext[j].len = part[j]
+                b = alloc(1)
+                blocks[b] = bytearray(node)
+                up.append([part[0][0], b, part[-1][0] + part[-1][2] - part[0][0]])
+            ext, depth = up, depth + 1
+        table[n*128:(n+1)*128] = dinode(f, ext, depth)
+    blocks[sb.inode_map] = bytearray(imap)
+    for t in range(ntable):
+        blocks[sb.inode_table + t] = table[t*4096:(t+1)*4096]
+
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
 fp.write(bytearray(blockmap))
 for i in range(2,nblocks):
     if not blocks[i]:
         fp.write(zeros)
+    elif isinstance(blocks[i], bytearray):
+        fp.write(blocks[i])
     elif len(blocks[i]) == 1:
         filedir = blocks[i][0]
         fp.write(filedir.inode())
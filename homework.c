@@ -23,6 +23,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <pthread.h>
+#include <assert.h>
+#include <linux/falloc.h>
 
 #include "fs5600.h"
 
@@ -35,103 +38,2542 @@
 #define write(a,b,c) error do not use write()
 
 /* disk access. All access is in terms of 4KB blocks; read and
- * write functions return 0 (success) or -EIO.
+ * write functions return 0 (success) or -EIO. Everything except the
+ * superblock goes through the block cache (cache.c), which keeps
+ * blocks in memory and writes them back later.
  */
 extern int block_read(void *buf, int lba, int nblks);
-extern int block_write(void *buf, int lba, int nblks);
+
+extern int cache_init(void);
+extern int cache_read(void *buf, int lba, int type);
+extern int cache_write(void *buf, int lba, int type);
+extern int cache_readv(struct block_seg *segs, int nsegs, int type);
+extern int cache_writev(struct block_seg *segs, int nsegs, int type);
+extern int cache_flush(void);
+extern int cache_sync(const int *lba, int n);
+extern int cache_discard(const int *lba, int n);
+extern void cache_prefetch(const int *lba, int n);
+extern void cache_prefetch_wait(void);
+extern void cache_set_flush_hook(int (*hook)(time_t cutoff));
+
+/* when the image is memory-mapped, block_ptr returns a read-only
+ * pointer to a block in place (NULL otherwise). block_flush makes all
+ * writes so far durable.
+ */
+extern void *block_ptr(int lba);
+extern int block_flush(void);
+
+/* statistics (stats.c): every entry point in fs_ops is timed, and the
+ * report can be read from STATS_FILE.
+ */
+extern void stats_begin(struct stat_timer *t, int op);
+extern void stats_end(struct stat_timer *t, int rv, uint64_t bytes);
+extern int stats_report(char *buf, int size);
+
+#define STATS_FILE "/.fs5600-stats"
 
 /*
    Global variables and structures used by the filesystem.
  */
-static struct fs_super superblock;      // global superblock
-static unsigned char *bitmap;   // global block bitmap
+static struct fs_super superblock;      // global superblock
+static unsigned char *bitmap;   // global block bitmap
+static int bitmap_nblks;        // its length, on disk at blocks 1..bitmap_nblks
+static uint32_t root_inum;      // root directory inode, just after the bitmap (1 if dense)
+
+/* Dense images (FS_VERSION_DENSE) keep inodes in a table; 'imap' is
+ * their inode bitmap, on disk from block superblock.inode_map on.
+ */
+static int dense;
+static unsigned char *imap;
+static pthread_mutex_t imap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Version 0 images (see FS_VERSION_INDIRECT) have nothing at the end
+ * of the inode: their files stay within the direct pointers and never
+ * go inline, so the image stays readable as version 0.
+ */
+static int v0;
+
+/* Allocation groups. The block space is split into groups of
+ * FS_BITS_PER_BLOCK blocks, one per bitmap block, each with its own
+ * lock, free count and summary of its part of the bitmap, so threads
+ * allocating in different groups don't wait for each other. A group's
+ * lock covers only its part of the bitmap; what else a writer changes
+ * is covered by the file locks below. Group g starts at block
+ * g * FS_BITS_PER_BLOCK and its bitmap is block 1+g. The summary has
+ * two levels: bit w of full0 is set when word w of the group's bitmap
+ * is all ones, bit v of full1 when word v of full0 is (see
+ * find_free_summary).
+ */
+#define GROUP_WORDS (FS_BITS_PER_BLOCK / 64)
+
+struct alloc_group {
+	pthread_mutex_t lock;
+	int start;		/* first block */
+	int nblocks;
+	int nfree;
+	int dirty;		/* bitmap block changed since write_bitmap */
+	unsigned char full0[GROUP_WORDS / 8];
+	unsigned char full1[8];
+} __attribute__((aligned(64)));
+
+static struct alloc_group *groups;
+static int ngroups;
+
+/* Each thread has a home group, handed out in turn, and the inodes it
+ * creates go there (see inode_goal).
+ */
+static int next_home;
+static __thread int home_group = -1;
+
+/* Locking of the operations (see the op_ functions at the end). Those
+ * that change the name space - create, mkdir, unlink, rmdir, rename -
+ * and chmod and utime, which may change a directory's inode, run one at
+ * a time under ns_lock. A file's inode and blocks only change under its
+ * file lock, one of FILE_LOCKS picked by inode number, which write,
+ * truncate, fallocate, flush, fsync and release hold for the whole
+ * call, as do unlink, rmdir, chmod and utime for the files they
+ * change, and rename while it renames one. Writers of different files
+ * then only meet in the allocation groups and the caches, which have
+ * locks of their own. Reads, getattr, readdir and statfs take
+ * neither. The order is ns_lock, then one file lock, then the others;
+ * delay_write only ever tries for a second file lock.
+ */
+#define FILE_LOCKS 61	/* prime: files sharing a da_table slot rarely share a lock */
+
+static pthread_mutex_t ns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_locks[FILE_LOCKS] = {
+	[0 ... FILE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *file_lock(uint32_t inum)
+{
+	return &file_locks[inum % FILE_LOCKS];
+}
+
+/* Sequential readahead. For each recently read file we remember the
+ * block after the end of the last read; a read starting there is
+ * sequential, and then the blocks following it are prefetched into the
+ * cache in the background while FUSE hands the data back. The window
+ * starts at RA_MIN_BLOCKS and doubles with each sequential read up to
+ * RA_MAX_BLOCKS; a read anywhere else halves it. New blocks are only
+ * requested once less than half a window is left ahead of the reader.
+ */
+#define RA_SLOTS      64
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
+struct readahead {
+	uint32_t inum;
+	int next;		/* block after the last read */
+	int window;		/* in blocks */
+	int end;		/* prefetched up to here */
+};
+static struct readahead ra_table[RA_SLOTS];
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Delayed allocation. Data appended past the last allocated block of a
+ * file is kept in memory, in the file's slot of da_table, and no blocks
+ * are allocated for it yet: the inode gets the new size, with zero
+ * pointers for the buffered blocks. Blocks are allocated for all of it
+ * at once, as one extent where possible, when it is written out - on
+ * flush, fsync, release and unmount, and when the buffer is full or
+ * another file needs the slot. Buffered blocks are reserved, with the
+ * indirect blocks that may be needed to map them, so running out of
+ * space is still reported by the write. A slot that can't be written
+ * out keeps its data and its reservation, to be tried again later.
+ * da_lock covers the table and the buffers.
+ */
+#define DA_SLOTS      16
+#define DA_MAX_BLOCKS 128	/* 512 KB buffered per file */
+
+struct delalloc {
+	uint32_t inum;		/* 0 if the slot is free */
+	int first;		/* file block in data[0], the first unallocated one */
+	int nblks;		/* blocks buffered */
+	int reserved;		/* blocks reserved for them, metadata too */
+	char *data;		/* room for DA_MAX_BLOCKS blocks */
+};
+static struct delalloc da_table[DA_SLOTS];
+static pthread_mutex_t da_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reserved_blocks;	/* buffered, not allocated yet */
+
+/* Block maps. A file's blocks past the N_PTRS in its inode are found
+ * through indirect blocks (see struct fs_inode); INDIRECT_LEVELS is
+ * how many levels of them are used, 2 capping a file at about 4 GB and
+ * 3 at about 4 TB. The last leaf - block of data block pointers - that
+ * was looked up for a file is kept in its slot of map_table, so a
+ * sequential read goes down the tree once per FS_PTRS_PER_BLOCK blocks
+ * instead of once per read.
+ */
+#ifndef INDIRECT_LEVELS
+#define INDIRECT_LEVELS 3
+#endif
+#define MAP_SLOTS 16
+
+struct mapcache {
+	uint32_t inum;		/* 0 if the slot is free */
+	int first;		/* file block that ptrs[0] maps */
+	uint32_t ptrs[FS_PTRS_PER_BLOCK];
+};
+static struct mapcache map_table[MAP_SLOTS];
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_delayed(struct delalloc *da);
+static void icache_reset(void);
+static void dcache_reset(void);
+static int iflush(void);
+static int iflush_expired(time_t cutoff);
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* block pointers in an inode */
+#define N_PTRS ((int)(sizeof(((struct fs_inode *)0)->ptrs) / sizeof(uint32_t)))
+
+/* A dense file is mapped by an extent tree (see struct fs_dinode). In
+ * memory the root, the part kept in the inode table, goes where the
+ * block pointers of a struct fs_inode would be; the nodes below it are
+ * read and written through the block cache as they are needed, like
+ * indirect blocks. EXT_MAX_DEPTH levels of nodes are far more than the
+ * largest file a dense inode's 32-bit size allows can use.
+ */
+#define EXT_MAX_DEPTH 4
+
+struct ext_root {
+	uint16_t depth;
+	uint16_t nextent;
+	struct fs_extent ext[FS_NEXTENT];
+};
+
+static struct ext_root *ext_root(const struct fs_inode *inode)
+{
+	return (struct ext_root *)inode->ptrs;
+}
+
+/* bitmap functions
+ */
+void bit_set(unsigned char *map, int i)
+{
+	map[i/8] |= (1 << (i%8));
+}
+void bit_clear(unsigned char *map, int i)
+{
+	map[i/8] &= ~(1 << (i%8));
+}
+int bit_test(unsigned char *map, int i)
+{
+	return map[i/8] & (1 << (i%8));
+}
+
+/* bits 64*w .. 64*w+63 of the map, bit 64*w+k in position k */
+static uint64_t bit_word(const unsigned char *map, int w)
+{
+	uint64_t v;
+	memcpy(&v, map + 8 * w, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+/* The block bitmap is only changed through set_used and set_free,
+ * with the group's lock held. They keep the group's free count and
+ * summary up to date, and a count of the blocks in use, so statfs
+ * doesn't have to count them.
+ */
+static int used_blocks;
+
+/* blocks neither in use nor reserved for delayed allocation */
+static int free_blocks(void)
+{
+	return superblock.disk_size - __atomic_load_n(&used_blocks, __ATOMIC_RELAXED) -
+		__atomic_load_n(&reserved_blocks, __ATOMIC_RELAXED);
+}
+
+static unsigned char *group_map(struct alloc_group *grp)
+{
+	return bitmap + grp->start / 8;
+}
+
+static void set_used(struct alloc_group *grp, int i)
+{
+	unsigned char *map = group_map(grp);
+	int b = i - grp->start;
+	if (!bit_test(map, b)) 
+	{
+		bit_set(map, b);
+		if (bit_word(map, b / 64) == ~0ULL) 
+		{
+			bit_set(grp->full0, b / 64);
+			if (bit_word(grp->full0, b / 4096) == ~0ULL) 
+			{
+				bit_set(grp->full1, b / 4096);
+			}
+		}
+		grp->nfree--;
+		__atomic_store_n(&grp->dirty, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&used_blocks, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void set_free(struct alloc_group *grp, int i)
+{
+	unsigned char *map = group_map(grp);
+	int b = i - grp->start;
+	if (bit_test(map, b)) 
+	{
+		bit_clear(map, b);
+		bit_clear(grp->full0, b / 64);
+		bit_clear(grp->full1, b / 4096);
+		grp->nfree++;
+		__atomic_store_n(&grp->dirty, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&used_blocks, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void mark_free(int i)
+{
+	struct alloc_group *grp = &groups[i / FS_BITS_PER_BLOCK];
+	pthread_mutex_lock(&grp->lock);
+	set_free(grp, i);
+	pthread_mutex_unlock(&grp->lock);
+}
+
+/* write_bitmap - write the bitmap blocks changed since the last call
+ * to the cache; the others are left alone.
+ * Returns -EIO on error.
+ */
+static int write_bitmap(void)
+{
+	for (int g = 0; g < ngroups; g++) 
+	{
+		struct alloc_group *grp = &groups[g];
+		int rv = 0;
+		if (!__atomic_load_n(&grp->dirty, __ATOMIC_RELAXED)) 
+		{
+			continue;
+		}
+		pthread_mutex_lock(&grp->lock);
+		if (grp->dirty) 
+		{
+			rv = cache_write(group_map(grp), 1 + g, BLOCK_META);
+			if (rv == 0) 
+			{
+				__atomic_store_n(&grp->dirty, 0, __ATOMIC_RELAXED);
+			}
+		}
+		pthread_mutex_unlock(&grp->lock);
+		if (rv != 0) 
+		{
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* count_bits - count the set bits in map[0..nbits-1], a popcount per
+ * 64 bits.
+ */
+static int count_bits(const unsigned char *map, int nbits)
+{
+	int n = 0;
+	for (int w = 0; w < nbits / 64; w++) 
+	{
+		n += __builtin_popcountll(bit_word(map, w));
+	}
+	if (nbits % 64) 
+	{
+		n += __builtin_popcountll(bit_word(map, nbits / 64) & ((1ULL << (nbits % 64)) - 1));
+	}
+	return n;
+}
+
+/* count_used - count the blocks in use from scratch */
+static int count_used(void)
+{
+	return count_bits(bitmap, superblock.disk_size);
+}
+
+static void free_groups(void)
+{
+	for (int g = 0; g < ngroups; g++) 
+	{
+		pthread_mutex_destroy(&groups[g].lock);
+	}
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
+}
+
+/* build_groups - set up the allocation groups from the bitmap.
+ * Returns -ENOMEM if out of memory.
+ */
+static int build_groups(void)
+{
+	int n = DIV_ROUND_UP(superblock.disk_size, FS_BITS_PER_BLOCK);
+	void *mem;
+	if (posix_memalign(&mem, 64, n * sizeof(struct alloc_group)) != 0) 
+	{
+		return -ENOMEM;
+	}
+	groups = mem;
+	memset(groups, 0, n * sizeof(struct alloc_group));
+	for (ngroups = 0; ngroups < n; ngroups++) 
+	{
+		struct alloc_group *grp = &groups[ngroups];
+		pthread_mutex_init(&grp->lock, NULL);
+		grp->start = ngroups * FS_BITS_PER_BLOCK;
+		grp->nblocks = MIN(FS_BITS_PER_BLOCK, superblock.disk_size - grp->start);
+		grp->nfree = grp->nblocks - count_bits(group_map(grp), grp->nblocks);
+		for (int w = 0; w < GROUP_WORDS; w++) 
+		{
+			if (bit_word(group_map(grp), w) == ~0ULL) 
+			{
+				bit_set(grp->full0, w);
+			}
+		}
+		for (int v = 0; v < GROUP_WORDS / 64; v++) 
+		{
+			if (bit_word(grp->full0, v) == ~0ULL) 
+			{
+				bit_set(grp->full1, v);
+			}
+		}
+	}
+	used_blocks = count_used();
+	return 0;
+}
+
+/* inode_goal - where to look for a new inode created by this thread in
+ * directory 'parent': next to the parent if it is in the thread's home
+ * group, at the start of the home group if not.
+ */
+static uint32_t inode_goal(uint32_t parent)
+{
+	if (home_group < 0) 
+	{
+		home_group = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED);
+	}
+	int g = home_group % ngroups;
+	if (parent / FS_BITS_PER_BLOCK == g) 
+	{
+		return parent;
+	}
+	return groups[g].start;
+}
+
+/* inode_lba - the block holding inode 'inum'. */
+static int inode_lba(uint32_t inum)
+{
+	return dense ? superblock.inode_table + inum / FS_INODES_PER_BLOCK : inum;
+}
+
+/* data_goal - where to put the first block of file 'inum': right after
+ * its inode, or for a dense image (where the inodes are all together
+ * in the table) at the start of a group picked by inode number.
+ */
+static uint32_t data_goal(uint32_t inum)
+{
+	return dense ? groups[inum % ngroups].start : inum + 1;
+}
+
+/* find_free_summary - find the first clear bit at or after 'start'
+ * (and below 'nbits'), looking at 64 bits at a time. Returns its number
+ * and sets *len to the length of the run of clear bits starting there
+ * (at most 'max'), or returns -1 if every bit is set.
+ * full[0..nlevels-1] summarize 'map': full[0] has a bit per 64-bit word
+ * of 'map' that is set if the word has no clear bits, full[1] the same
+ * for full[0], and so on. Past the first word the search looks for the
+ * next clear bit in full[0] - the same way, one level up - instead of
+ * reading every full word of 'map'.
+ */
+int find_free_summary(const unsigned char *map, unsigned char *const *full, int nlevels,
+		      int nbits, int start, int max, int *len)
+{
+	int nwords = DIV_ROUND_UP(nbits, 64);
+	if (start >= nbits) 
+	{
+		return -1;
+	}
+
+	int w = start / 64;
+	uint64_t used = bit_word(map, w) | ((1ULL << (start % 64)) - 1);
+	while (used == ~0ULL) 
+	{
+		int n;
+		if (nlevels > 0) 
+		{
+			w = find_free_summary(full[0], full + 1, nlevels - 1, nwords, w + 1, 1, &n);
+		}
+		else 
+		{
+			w = w + 1 < nwords ? w + 1 : -1;
+		}
+		if (w < 0) 
+		{
+			return -1;
+		}
+		used = bit_word(map, w);
+	}
+	int first = w * 64 + __builtin_ctzll(~used);
+	if (first >= nbits) 
+	{
+		return -1;
+	}
+
+	/* the run ends at the next set bit, possibly words later */
+	int n;
+	uint64_t rest = used >> (first % 64);
+	if (rest != 0) 
+	{
+		n = __builtin_ctzll(rest);
+	} 
+	else 
+	{
+		n = 64 - first % 64;
+		while (++w < nwords && n < max && (used = bit_word(map, w)) == 0) 
+		{
+			n += 64;
+		}
+		if (w < nwords && n < max && used != 0) 
+		{
+			n += __builtin_ctzll(used);
+		}
+	}
+	*len = MIN(MIN(n, max), nbits - first);
+	return first;
+}
+
+/* find_free_run - find_free_summary without a summary */
+int find_free_run(const unsigned char *map, int nbits, int start, int max, int *len)
+{
+	return find_free_summary(map, NULL, 0, nbits, start, max, len);
+}
+
+/* Allocation works in extents. A request for 'want' blocks near block
+ * 'goal' (the block after the end of the file being extended, or the
+ * inode of the parent directory) is served, in order of preference:
+ *   - at the goal itself, if it's free, so a file grows in place;
+ *   - from the first free run after the goal (wrapping around) that
+ *     has room for ALLOC_ROOM blocks more than asked for, so a growing
+ *     file can keep growing there rather than filling a small hole;
+ *   - from the first run after the goal that is long enough;
+ *   - from the longest run there is, and then again for the rest.
+ * The search stays in the goal's allocation group, and moves on to the
+ * next group (wrapping around) only when that one is full.
+ */
+#define ALLOC_ROOM 8
+
+/* find_extent - the search above, in group 'grp', whose lock is held */
+static int find_extent(struct alloc_group *grp, int goal, int want, int *len)
+{
+	unsigned char *map = group_map(grp);
+	unsigned char *full[2] = {grp->full0, grp->full1};
+	int roomy = -1, fits = -1, longest = -1, longest_len = 0;
+	int n;
+
+	goal -= grp->start;
+	if (find_free_summary(map, full, 2, grp->nblocks, goal, want, &n) == goal) 
+	{
+		*len = n;
+		return grp->start + goal;
+	}
+	for (int pass = 0; pass < 2 && roomy < 0; pass++) 
+	{
+		int start = pass == 0 ? goal : 0;
+		int end = pass == 0 ? grp->nblocks : goal;
+		int b;
+		while (roomy < 0 && (b = find_free_summary(map, full, 2, end, start, want + ALLOC_ROOM, &n)) >= 0) 
+		{
+			if (n >= want + ALLOC_ROOM) 
+			{
+				roomy = b;
+			}
+			if (n >= want && fits < 0) 
+			{
+				fits = b;
+			}
+			if (n > longest_len) 
+			{
+				longest = b;
+				longest_len = n;
+			}
+			start = b + n;
+		}
+	}
+
+	if (roomy >= 0 || fits >= 0) 
+	{
+		*len = want;
+		return grp->start + (roomy >= 0 ? roomy : fits);
+	}
+	*len = longest_len;
+	return longest < 0 ? -1 : grp->start + longest;
+}
+
+/* alloc_blocks - allocate 'n' blocks near 'goal' (see above), in as few
+ * extents as possible, and mark them in the in-memory bitmap (the
+ * caller writes it out). Block numbers go in lba[0..n-1].
+ * Returns -ENOSPC, with nothing allocated, if there aren't 'n' free.
+ */
+static int alloc_blocks(uint32_t goal, uint32_t *lba, int n)
+{
+	int got = 0;
+	if (n > free_blocks()) 
+	{
+		return -ENOSPC;
+	}
+	if (goal < 1 + bitmap_nblks || goal >= superblock.disk_size) 
+	{
+		goal = 1 + bitmap_nblks;	/* skip superblock and bitmap */
+	}
+	int g = goal / FS_BITS_PER_BLOCK;
+	for (int tries = 0; got < n && tries < ngroups; tries++) 
+	{
+		struct alloc_group *grp = &groups[g];
+		pthread_mutex_lock(&grp->lock);
+		while (got < n && grp->nfree > 0) 
+		{
+			int len;
+			int b = find_extent(grp, goal, n - got, &len);
+			if (b < 0) 
+			{
+				break;
+			}
+			for (int i = 0; i < len; i++) 
+			{
+				set_used(grp, b + i);
+				lba[got++] = b + i;
+			}
+			goal = b + len;
+		}
+		pthread_mutex_unlock(&grp->lock);
+		g = (g + 1) % ngroups;
+		goal = groups[g].start;
+	}
+	if (got < n) 
+	{
+		for (int i = 0; i < got; i++) 
+		{
+			mark_free(lba[i]);
+		}
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+/* ialloc - allocate an inode for a new file in directory 'parent',
+ * near the parent. In the original format that's a block (still to be
+ * written out with write_bitmap); in a dense image a free slot in the
+ * inode table, and the inode bitmap block is written here.
+ * Returns -ENOSPC if there is none, -EIO on error.
+ */
+static int ialloc(uint32_t parent, uint32_t *inum)
+{
+	if (!dense) 
+	{
+		return alloc_blocks(inode_goal(parent), inum, 1);
+	}
+	int len, rv = 0;
+	pthread_mutex_lock(&imap_lock);
+	int i = find_free_run(imap, superblock.inode_count, parent, 1, &len);
+	if (i < 0) 
+	{
+		i = find_free_run(imap, parent, 0, 1, &len);
+	}
+	if (i < 0) 
+	{
+		rv = -ENOSPC;
+	}
+	else 
+	{
+		bit_set(imap, i);
+		int b = i / FS_BITS_PER_BLOCK;
+		if (cache_write(imap + (size_t)b * FS_BLOCK_SIZE, superblock.inode_map + b, BLOCK_META) != 0) 
+		{
+			bit_clear(imap, i);
+			rv = -EIO;
+		}
+		*inum = i;
+	}
+	pthread_mutex_unlock(&imap_lock);
+	return rv;
+}
+
+/* init - this is called once by the FUSE framework at startup. Ignore
+ * the 'conn' argument.
+ * recommended actions:
+ *   - read superblock
+ *   - allocate memory, read bitmaps and inodes
+ */
+void* fs_init(struct fuse_conn_info *conn)
+{
+	char buffer[FS_BLOCK_SIZE];
+	if (block_read(buffer, 0, 1) != 0) 
+	{
+		fprintf(stderr, "[fs_init]: superblock read failed\n");
+		return NULL;
+	}
+	memcpy(&superblock, buffer, sizeof(struct fs_super));
+
+	if (superblock.magic != FS_MAGIC) {
+		fprintf(stderr, "[fs_init]: invalid magic number\n");
+		return NULL;
+	}
+
+	if (cache_init() != 0) {
+		fprintf(stderr, "[fs_init]: block cache setup failed\n");
+	}
+	memset(ra_table, 0, sizeof(ra_table));
+	memset(map_table, 0, sizeof(map_table));
+	icache_reset();
+	cache_set_flush_hook(iflush_expired);
+	dcache_reset();
+	for (int i = 0; i < DA_SLOTS; i++) 
+	{
+		da_table[i].inum = 0;
+		da_table[i].reserved = 0;
+	}
+	__atomic_store_n(&reserved_blocks, 0, __ATOMIC_RELAXED);
+
+	// images from before the bitmap could span blocks have a zero here
+	bitmap_nblks = superblock.bitmap_blocks ? superblock.bitmap_blocks : 1;
+	if ((uint64_t)bitmap_nblks * FS_BITS_PER_BLOCK < superblock.disk_size) {
+		fprintf(stderr, "[fs_init]: bitmap too small for image\n");
+		return NULL;
+	}
+	dense = superblock.version == FS_VERSION_DENSE;
+	if (superblock.version == FS_VERSION_DENSE_PTRS) {
+		fprintf(stderr, "[fs_init]: old dense image (block pointers, not extents), "
+			"no longer supported\n");
+		return NULL;
+	}
+	if (superblock.version != 0 && superblock.version != FS_VERSION_INDIRECT && !dense) {
+		fprintf(stderr, "[fs_init]: unknown image version %u\n", superblock.version);
+		return NULL;
+	}
+	root_inum = dense ? 1 : 1 + bitmap_nblks;
+	v0 = superblock.version == 0;
+
+	bitmap = malloc((size_t)bitmap_nblks * FS_BLOCK_SIZE); // Allocate memory for block bitmap
+	if (!bitmap) {
+		fprintf(stderr, "[fs_init]: bitmap malloc failed\n");
+		return NULL;
+	}
+
+	struct block_seg segs[bitmap_nblks];
+	for (int i = 0; i < bitmap_nblks; i++) {
+		segs[i].lba = 1 + i;
+		segs[i].buf = bitmap + (size_t)i * FS_BLOCK_SIZE;
+	}
+	if (cache_readv(segs, bitmap_nblks, BLOCK_META) != 0) {
+		fprintf(stderr, "[fs_init]: bitmap read failed\n");
+		free(bitmap);
+		bitmap = NULL;
+		return NULL;
+	}
+	if (build_groups() != 0) {
+		fprintf(stderr, "[fs_init]: bitmap malloc failed\n");
+		free(bitmap);
+		bitmap = NULL;
+		return NULL;
+	}
+
+	if (dense) {
+		int n = DIV_ROUND_UP(superblock.inode_count, FS_BITS_PER_BLOCK);
+		struct block_seg isegs[n];
+		imap = malloc((size_t)n * FS_BLOCK_SIZE);
+		for (int i = 0; imap && i < n; i++) {
+			isegs[i].lba = superblock.inode_map + i;
+			isegs[i].buf = imap + (size_t)i * FS_BLOCK_SIZE;
+		}
+		if (!imap || cache_readv(isegs, n, BLOCK_META) != 0) {
+			fprintf(stderr, "[fs_init]: inode bitmap read failed\n");
+			free(imap);
+			imap = NULL;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* destroy - called by the FUSE framework at unmount. Dirty inodes and
+ * blocks are written back from the caches and the image is flushed
+ * (msync'ed, if it is memory-mapped).
+ */
+void fs_destroy(void *private_data)
+{
+	int rv = 0;
+	cache_set_flush_hook(NULL);
+	pthread_mutex_lock(&da_lock);
+	for (int i = 0; i < DA_SLOTS; i++) 
+	{
+		rv |= write_delayed(&da_table[i]);
+		free(da_table[i].data);
+		da_table[i].data = NULL;
+	}
+	pthread_mutex_unlock(&da_lock);
+	rv |= iflush();
+	cache_prefetch_wait();
+	if (rv != 0 || cache_flush() != 0 || block_flush() != 0) 
+	{
+		fprintf(stderr, "[fs_destroy]: flush failed\n");
+	}
+	free(bitmap);
+	bitmap = NULL;
+	free(imap);
+	imap = NULL;
+	free_groups();
+}
+
+/* Note on path translation errors:
+ * In addition to the method-specific errors listed below, almost
+ * every method can return one of the following errors if it fails to
+ * locate a file or directory corresponding to a specified path.
+ *
+ * ENOENT - a component of the path doesn't exist.
+ * ENOTDIR - an intermediate component of the path (e.g. 'b' in
+ *           /a/b/c) is not a directory
+ */
+
+/* note on splitting the 'path' variable:
+ * the value passed in by the FUSE framework is declared as 'const',
+ * which means you can't modify it. The standard mechanisms for
+ * splitting strings in C (strtok, strsep) modify the string in place,
+ * so you have to copy the string and then free the copy when you're
+ * done. One way of doing this:
+ *
+ *    char *_path = strdup(path);
+ *    int inum = translate(_path);
+ *    free(_path);
+ */
+
+/* block_view - read-only view of block 'lba'. If the image is mapped
+ * this points straight into the mapping (no syscall, no copy);
+ * otherwise the block is read into 'buf' and 'buf' is returned.
+ * 'type' (BLOCK_DIR, BLOCK_INODE...) tells the cache what it holds.
+ *  success - pointer to the block contents
+ *  errors - NULL
+ */
+void *block_view(int lba, void *buf, int type)
+{
+	void *p = block_ptr(lba);
+	if (p) 
+	{
+		return p;
+	}
+	return cache_read(buf, lba, type) == 0 ? buf : NULL;
+}
+
+/* block_viewv - block_view for a batch: with a mapped image each
+ * segment's 'buf' is pointed into the mapping, otherwise the blocks
+ * are read into the given buffers with one vectored request.
+ *  success - return 0
+ *  errors - EIO
+ */
+int block_viewv(struct block_seg *segs, int nsegs, int type)
+{
+	if (nsegs == 0 || !block_ptr(segs[0].lba)) 
+	{
+		return cache_readv(segs, nsegs, type) == 0 ? 0 : -EIO;
+	}
+	for (int i = 0; i < nsegs; i++) 
+	{
+		if (!(segs[i].buf = block_ptr(segs[i].lba))) 
+		{
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* Inode cache. Inodes are kept decoded, found by number through a hash
+ * table, so a lookup or a stat doesn't go through the block cache and
+ * a change to an inode doesn't build and write a 4 KB block each time:
+ * writers update the cached copy and mark it dirty, and it's written
+ * to the block cache when the entry is reused, when the file is
+ * synced, at unmount, and by the block cache's flusher thread once it
+ * has been dirty as long as a block may be (iflush_expired). An entry
+ * with references (iget without iput yet) is never reused. Decoding
+ * and encoding is also where the two image formats differ: in a dense
+ * image an inode is a slot in an inode table block, holding the root
+ * of the file's extent tree.
+ */
+#define ICACHE_SIZE 256
+#define ICACHE_HASH 509
+
+struct icache_entry {
+	struct fs_inode inode;		/* first: an inode pointer is its entry */
+	uint32_t inum;			/* 0 if unused */
+	int refs;
+	int dirty;
+	time_t dirtied;			/* when it last went from clean to dirty */
+	struct icache_entry *hnext;
+	struct icache_entry *prev, *next;	/* LRU order, most recent first */
+};
+
+static struct icache_entry icache[ICACHE_SIZE];
+static struct icache_entry *ihash[ICACHE_HASH];
+static struct icache_entry ilru;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ilru_unlink(struct icache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void ilru_front(struct icache_entry *e)
+{
+	e->next = ilru.next;
+	e->prev = &ilru;
+	ilru.next->prev = e;
+	ilru.next = e;
+}
+
+/* icache_reset - empty the cache, without writing anything back.
+ */
+static void icache_reset(void)
+{
+	memset(ihash, 0, sizeof(ihash));
+	ilru.next = ilru.prev = &ilru;
+	for (int i = 0; i < ICACHE_SIZE; i++) 
+	{
+		memset(&icache[i], 0, sizeof(icache[i]));
+		ilru_front(&icache[i]);
+	}
+}
+
+/* the entry for 'inum', or NULL. Called with icache_lock held. */
+static struct icache_entry *ilookup(uint32_t inum)
+{
+	struct icache_entry *e = ihash[inum % ICACHE_HASH];
+	while (e && e->inum != inum) 
+	{
+		e = e->hnext;
+	}
+	return e;
+}
+
+static void iunhash(struct icache_entry *e)
+{
+	struct icache_entry **pp = &ihash[e->inum % ICACHE_HASH];
+	while (*pp != e) 
+	{
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	e->inum = 0;
+	e->dirty = 0;
+}
+
+static int read_dense(struct block_seg *segs, int n);
+
+/* inode_ok - whether an inode read from a non-dense image can be used.
+ * In a version 0 image the end of the inode (indir[] on) must be zero:
+ * anything there is the block pointers of a file too big to map
+ * without them, or leftovers that would be taken for them. Otherwise
+ * the only flag is FS_INODE_INLINE, and only a regular file small
+ * enough to fit in ptrs[] can have it - anything else would have its
+ * block pointers read as data, or its data as block pointers.
+ */
+static int inode_ok(const struct fs_inode *inode)
+{
+	if (v0) 
+	{
+		return !inode->indir[0] && !inode->indir[1] && !inode->indir[2] && !inode->size_hi &&
+			!inode->flags && DIV_ROUND_UP((uint32_t)inode->size, FS_BLOCK_SIZE) <= N_PTRS;
+	}
+	if (inode->flags & FS_INODE_INLINE) 
+	{
+		return inode->flags == FS_INODE_INLINE && S_ISREG(inode->mode) && !inode->size_hi &&
+			(uint32_t)inode->size <= FS_INLINE_MAX;
+	}
+	return inode->flags == 0;
+}
+
+/* iread - read inode 'inum' from the image into 'inode'.
+ *  success - return 0
+ *  errors - EIO
+ */
+static int iread(uint32_t inum, struct fs_inode *inode)
+{
+	if (!dense) 
+	{
+		void *p = block_view(inum, inode, BLOCK_INODE);
+		if (p && p != inode) 
+		{
+			memcpy(inode, p, sizeof(*inode));
+		}
+		return p && inode_ok(inode) ? 0 : -EIO;
+	}
+	struct block_seg seg = {inum, inode};
+	return read_dense(&seg, 1);
+}
+
+/* iwrite_dense - write an inode to its slot in a dense image's inode
+ * table, with the root of its extent tree (the nodes below it are
+ * written as they change, see ext_insert). Called with icache_lock
+ * held.
+ */
+static int iwrite_dense(struct icache_entry *e)
+{
+	struct fs_inode *ip = &e->inode;
+	struct ext_root *root = ext_root(ip);
+	char buf[FS_BLOCK_SIZE];
+	int lba = inode_lba(e->inum);
+	if (cache_read(buf, lba, BLOCK_INODE) != 0) 
+	{
+		return -EIO;
+	}
+	struct fs_dinode *d = (struct fs_dinode *)buf + e->inum % FS_INODES_PER_BLOCK;
+	memset(d, 0, sizeof(*d));
+	d->uid = ip->uid;
+	d->gid = ip->gid;
+	d->mode = ip->mode;
+	d->ctime = ip->ctime;
+	d->mtime = ip->mtime;
+	d->size = ip->size;
+	d->depth = root->depth;
+	d->nextent = root->nextent;
+	memcpy(d->ext, root->ext, sizeof(d->ext));
+	return cache_write(buf, lba, BLOCK_INODE) == 0 ? 0 : -EIO;
+}
+
+/* iwriteback - write a dirty entry to the block cache. Called with
+ * icache_lock held. In the original format the inode fills its block
+ * exactly, so it's written from the entry itself.
+ */
+static int iwriteback(struct icache_entry *e)
+{
+	if (!e->dirty) 
+	{
+		return 0;
+	}
+	if (dense ? iwrite_dense(e) != 0 : cache_write(&e->inode, e->inum, BLOCK_INODE) != 0) 
+	{
+		return -EIO;
+	}
+	e->dirty = 0;
+	return 0;
+}
+
+/* inew - an entry for 'inum', which isn't cached: the least recently
+ * used one without references, written back first if it's dirty.
+ * Returns NULL if there is none or the write fails. Called with
+ * icache_lock held.
+ */
+static struct icache_entry *inew(uint32_t inum)
+{
+	struct icache_entry *e = ilru.prev;
+	while (e != &ilru && e->refs > 0) 
+	{
+		e = e->prev;
+	}
+	if (e == &ilru || iwriteback(e) != 0) 
+	{
+		return NULL;
+	}
+	if (e->inum) 
+	{
+		iunhash(e);
+	}
+	e->inum = inum;
+	e->hnext = ihash[inum % ICACHE_HASH];
+	ihash[inum % ICACHE_HASH] = e;
+	ilru_unlink(e);
+	ilru_front(e);
+	return e;
+}
+
+/* iget - the cached inode 'inum', read in if it isn't cached. The
+ * caller must iput it.
+ *  success - pointer to the inode
+ *  errors - NULL
+ */
+static struct fs_inode *iget(uint32_t inum)
+{
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = ilookup(inum);
+	if (e) 
+	{
+		ilru_unlink(e);
+		ilru_front(e);
+	}
+	else 
+	{
+		e = inew(inum);
+		if (!e || iread(inum, &e->inode) != 0) 
+		{
+			if (e) 
+			{
+				iunhash(e);
+			}
+			pthread_mutex_unlock(&icache_lock);
+			return NULL;
+		}
+	}
+	e->refs++;
+	pthread_mutex_unlock(&icache_lock);
+	return &e->inode;
+}
+
+static void iput(struct fs_inode *ip)
+{
+	pthread_mutex_lock(&icache_lock);
+	((struct icache_entry *)ip)->refs--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+int read_inode(uint32_t inum, struct fs_inode *inode) 
+{
+	struct fs_inode *ip = iget(inum);
+	if (!ip) 
+	{
+		return -1;
+	}  
+	memcpy(inode, ip, sizeof(struct fs_inode));
+	iput(ip);
+	return 0;
+}
+
+/* write_inode - replace the cached copy of inode 'inum' (caching it if
+ * it isn't) and mark it dirty.
+ *  success - return 0
+ *  errors - EIO
+ */
+static int write_inode(uint32_t inum, const struct fs_inode *inode)
+{
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = ilookup(inum);
+	if (e) 
+	{
+		ilru_unlink(e);
+		ilru_front(e);
+	}
+	else if (!(e = inew(inum))) 
+	{
+		pthread_mutex_unlock(&icache_lock);
+		return -EIO;
+	}
+	memcpy(&e->inode, inode, sizeof(struct fs_inode));
+	if (!e->dirty) 
+	{
+		e->dirty = 1;
+		e->dirtied = time(NULL);
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+/* read_dense - read_inodes for a dense image: 'segs[i].lba' is an
+ * inode number and 'segs[i].buf' where to decode it. The table blocks
+ * are read in one batch, each once however many of the inodes it holds.
+ */
+static int read_dense(struct block_seg *segs, int n)
+{
+	struct block_seg *tsegs = malloc(n * sizeof(*tsegs));
+	int *tix = malloc(n * sizeof(int));
+	char *bufs = malloc((size_t)n * FS_BLOCK_SIZE);
+	int nt = 0, rv = -ENOMEM;
+	if (n > 0 && (!tsegs || !tix || !bufs)) 
+	{
+		goto out;
+	}
+	for (int i = 0; i < n; i++) 
+	{
+		int lba = inode_lba(segs[i].lba), t = nt - 1;
+		while (t >= 0 && tsegs[t].lba != lba) 
+		{
+			t--;
+		}
+		if (t < 0) 
+		{
+			t = nt++;
+			tsegs[t].lba = lba;
+			tsegs[t].buf = bufs + (size_t)t * FS_BLOCK_SIZE;
+		}
+		tix[i] = t;
+	}
+	rv = -EIO;
+	if (block_viewv(tsegs, nt, BLOCK_INODE) != 0) 
+	{
+		goto out;
+	}
+	for (int i = 0; i < n; i++) 
+	{
+		struct fs_dinode *d = (struct fs_dinode *)tsegs[tix[i]].buf + segs[i].lba % FS_INODES_PER_BLOCK;
+		struct fs_inode *inode = segs[i].buf;
+		memset(inode, 0, sizeof(*inode));
+		inode->uid = d->uid;
+		inode->gid = d->gid;
+		inode->mode = d->mode;
+		inode->ctime = d->ctime;
+		inode->mtime = d->mtime;
+		inode->size = d->size;
+		if (d->nextent > FS_NEXTENT || d->depth > EXT_MAX_DEPTH) 
+		{
+			goto out;
+		}
+		struct ext_root *root = ext_root(inode);
+		root->depth = d->depth;
+		root->nextent = d->nextent;
+		memcpy(root->ext, d->ext, sizeof(root->ext));
+	}
+	rv = 0;
+out:
+	free(tsegs);
+	free(tix);
+	free(bufs);
+	return rv;
+}
+
+/* read_inodes - read the inodes 'segs[i].lba' into 'segs[i].buf': the
+ * cached ones are copied, the rest are read with one block_viewv (so
+ * with a mapped image 'buf' may be pointed into the mapping; with a
+ * dense image, see read_dense) and added to the cache.
+ *  success - return 0
+ *  errors - ENOMEM, EIO
+ */
+static int read_inodes(struct block_seg *segs, int n)
+{
+	struct block_seg *miss = malloc(n * sizeof(*miss));
+	int *idx = malloc(n * sizeof(int));
+	int nmiss = 0, rv = -ENOMEM;
+	if (n > 0 && (!miss || !idx)) 
+	{
+		goto out;
+	}
+	pthread_mutex_lock(&icache_lock);
+	for (int i = 0; i < n; i++) 
+	{
+		struct icache_entry *e = ilookup(segs[i].lba);
+		if (e) 
+		{
+			memcpy(segs[i].buf, &e->inode, sizeof(struct fs_inode));
+		}
+		else 
+		{
+			miss[nmiss] = segs[i];
+			idx[nmiss++] = i;
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	rv = dense ? read_dense(miss, nmiss) : block_viewv(miss, nmiss, BLOCK_INODE);
+	for (int k = 0; rv == 0 && !dense && k < nmiss; k++) 
+	{
+		rv = inode_ok(miss[k].buf) ? 0 : -EIO;
+	}
+	if (rv != 0) 
+	{
+		goto out;
+	}
+	pthread_mutex_lock(&icache_lock);
+	for (int k = 0; k < nmiss; k++) 
+	{
+		struct icache_entry *e;
+		segs[idx[k]].buf = miss[k].buf;
+		if (!ilookup(miss[k].lba) && (e = inew(miss[k].lba))) 
+		{
+			memcpy(&e->inode, miss[k].buf, sizeof(struct fs_inode));
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+out:
+	free(miss);
+	free(idx);
+	return rv;
+}
+
+/* isync - write inode 'inum' to the block cache if its cached copy is
+ * dirty.
+ */
+static int isync(uint32_t inum)
+{
+	struct fs_inode *ip = iget(inum);
+	if (!ip) 
+	{
+		return -EIO;
+	}
+	struct icache_entry *e = (struct icache_entry *)ip;
+	pthread_mutex_lock(&icache_lock);
+	int rv = iwriteback(e);
+	e->refs--;
+	pthread_mutex_unlock(&icache_lock);
+	return rv;
+}
+
+/* iflush - write every dirty inode to the block cache.
+ */
+static int iflush(void)
+{
+	int rv = 0;
+	pthread_mutex_lock(&icache_lock);
+	for (int i = 0; i < ICACHE_SIZE; i++) 
+	{
+		if (icache[i].inum) 
+		{
+			rv |= iwriteback(&icache[i]);
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return rv;
+}
+
+/* iflush_expired - write the inodes that went dirty at or before
+ * 'cutoff' to the block cache. The block cache's flusher thread calls
+ * this on each pass, so an inode changed and then left alone gets to
+ * the image on the same schedule as a data block, not only when its
+ * entry is reused or the file is synced.
+ */
+static int iflush_expired(time_t cutoff)
+{
+	int rv = 0;
+	pthread_mutex_lock(&icache_lock);
+	for (int i = 0; i < ICACHE_SIZE; i++) 
+	{
+		if (icache[i].inum && icache[i].dirty && icache[i].dirtied <= cutoff) 
+		{
+			rv |= iwriteback(&icache[i]);
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return rv;
+}
+
+/* ifree - free inode 'inum' and drop it from the cache without writing
+ * it. In a dense image its table slot is cleared so it is empty for the
+ * next file to get it; the blocks of its extent tree go with the
+ * file's other blocks (bmap_free). The caller writes out the block
+ * bitmap.
+ */
+static void ifree(uint32_t inum)
+{
+	char buf[FS_BLOCK_SIZE];
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = ilookup(inum);
+	if (e) 
+	{
+		iunhash(e);
+	}
+	int lba = inode_lba(inum);
+	if (dense && cache_read(buf, lba, BLOCK_INODE) == 0) 
+	{
+		memset((struct fs_dinode *)buf + inum % FS_INODES_PER_BLOCK, 0, sizeof(struct fs_dinode));
+		cache_write(buf, lba, BLOCK_INODE);
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	if (!dense) 
+	{
+		mark_free(inum);
+		return;
+	}
+	pthread_mutex_lock(&imap_lock);
+	bit_clear(imap, inum);
+	int b = inum / FS_BITS_PER_BLOCK;
+	cache_write(imap + (size_t)b * FS_BLOCK_SIZE, superblock.inode_map + b, BLOCK_META);
+	pthread_mutex_unlock(&imap_lock);
+}
+
+/* file_size - a file's size, whose high bits are in 'size_hi' */
+static off_t file_size(const struct fs_inode *inode)
+{
+	return (off_t)inode->size_hi << 32 | (uint32_t)inode->size;
+}
+
+static void set_file_size(struct fs_inode *inode, off_t size)
+{
+	inode->size = (int32_t)size;
+	inode->size_hi = (uint64_t)size >> 32;
+}
+
+/* is_inline - whether a file's data is in its inode (FS_INODE_INLINE);
+ * only new regular files in the original format start out that way.
+ */
+static int is_inline(const struct fs_inode *inode)
+{
+	return (inode->flags & FS_INODE_INLINE) != 0;
+}
+
+/* level_span - FS_PTRS_PER_BLOCK^d, the file blocks under an indirect
+ * block 'd' levels above its leaves.
+ */
+static int level_span(int d)
+{
+	int n = 1;
+	while (d-- > 0) 
+	{
+		n *= FS_PTRS_PER_BLOCK;
+	}
+	return n;
+}
+
+/* max_blocks - the most blocks a file can have. A dense inode has no
+ * high bits for its size, and a version 0 one no indirect blocks.
+ */
+static int max_blocks(void)
+{
+	if (dense) 
+	{
+		return INT32_MAX / FS_BLOCK_SIZE;
+	}
+	if (v0) 
+	{
+		return N_PTRS;
+	}
+	int n = N_PTRS;
+	for (int l = 1; l <= INDIRECT_LEVELS && !dense; l++) 
+	{
+		n += level_span(l);
+	}
+	return n;
+}
+
+/* indirect_level - the level of indirect blocks (1 = single, under
+ * indir[0]) that maps file block 'fblk', which is past the direct
+ * ones, and in *idx its index among the blocks of that level. Returns 0
+ * if it's past the last level.
+ */
+static int indirect_level(int fblk, int *idx)
+{
+	int i = fblk - N_PTRS;
+	for (int l = 1; l <= INDIRECT_LEVELS; l++) 
+	{
+		if (i < level_span(l)) 
+		{
+			*idx = i;
+			return l;
+		}
+		i -= level_span(l);
+	}
+	return 0;
+}
+
+/* remember the leaf mapping file blocks first.. of file 'inum' */
+static void map_store(uint32_t inum, int first, const uint32_t *ptrs)
+{
+	struct mapcache *mc = &map_table[inum % MAP_SLOTS];
+	pthread_mutex_lock(&map_lock);
+	mc->inum = inum;
+	mc->first = first;
+	memcpy(mc->ptrs, ptrs, sizeof(mc->ptrs));
+	pthread_mutex_unlock(&map_lock);
+}
+
+static void map_forget(uint32_t inum)
+{
+	pthread_mutex_lock(&map_lock);
+	if (map_table[inum % MAP_SLOTS].inum == inum) 
+	{
+		map_table[inum % MAP_SLOTS].inum = 0;
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+/* get_leaf - the pointers in the leaf that maps file block 'fblk'
+ * (past the direct ones) of file 'inum', all zero if there is no leaf
+ * there yet, from map_table or else read down from the inode. A leaf
+ * read down is only kept if no one is changing the file's map (its
+ * file lock is free) and 'inode' still has the same indirect block, as
+ * a reader's copy may be older than what a writer has stored. Writers
+ * keep the leaves they change themselves, in bmap_set.
+ *  success - return the file block that ptrs[0] maps
+ *  errors - EFBIG (past the last level), EIO
+ */
+static int get_leaf(uint32_t inum, const struct fs_inode *inode, int fblk, uint32_t *ptrs)
+{
+	struct mapcache *mc = &map_table[inum % MAP_SLOTS];
+	int idx, l = indirect_level(fblk, &idx);
+	if (l == 0) 
+	{
+		return -EFBIG;
+	}
+	int first = fblk - idx % FS_PTRS_PER_BLOCK;
+	pthread_mutex_lock(&map_lock);
+	int hit = mc->inum == inum && mc->first == first;
+	if (hit) 
+	{
+		memcpy(ptrs, mc->ptrs, sizeof(mc->ptrs));
+	}
+	pthread_mutex_unlock(&map_lock);
+	if (hit) 
+	{
+		return first;
+	}
+
+	int keep = S_ISREG(inode->mode) && pthread_mutex_trylock(file_lock(inum)) == 0;
+	if (keep) 
+	{
+		struct fs_inode now;
+		if (read_inode(inum, &now) != 0 || now.indir[l - 1] != inode->indir[l - 1]) 
+		{
+			pthread_mutex_unlock(file_lock(inum));
+			keep = 0;
+		}
+	}
+	int rv = first;
+	uint32_t lba = inode->indir[l - 1];
+	for (int d = l - 1; lba != 0; d--) 
+	{
+		if (cache_read(ptrs, lba, BLOCK_INODE) != 0) 
+		{
+			rv = -EIO;
+			break;
+		}
+		if (d == 0) 
+		{
+			break;
+		}
+		lba = ptrs[idx / level_span(d) % FS_PTRS_PER_BLOCK];
+	}
+	if (lba == 0) 
+	{
+		memset(ptrs, 0, FS_BLOCK_SIZE);
+	}
+	if (keep) 
+	{
+		if (rv == first) 
+		{
+			map_store(inum, first, ptrs);
+		}
+		pthread_mutex_unlock(file_lock(inum));
+	}
+	return rv;
+}
+
+/* the file block after the last of the 'n' entries 'ext' */
+static uint32_t ext_end(const struct fs_extent *ext, int n)
+{
+	return ext[n - 1].fblk + ext[n - 1].len;
+}
+
+/* ext_index - the last of the 'n' entries 'ext' (in file order) that
+ * starts at or before file block 'fblk', -1 if there is none.
+ */
+static int ext_index(const struct fs_extent *ext, int n, uint32_t fblk)
+{
+	int lo = 0, hi = n;
+	while (lo < hi) 
+	{
+		int mid = (lo + hi) / 2;
+		if (ext[mid].fblk <= fblk) 
+		{
+			lo = mid + 1;
+		}
+		else 
+		{
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+/* whether 'node' isn't a sane extent tree node at 'depth' */
+static int ext_bad(const struct fs_extent_block *node, int depth)
+{
+	return node->depth != depth || node->count == 0 || node->count > FS_EXTENTS_PER_BLOCK;
+}
+
+/* ext_find - the extent of a dense file that holds file block 'fblk',
+ * in *e. If there is none, *e is the hole from 'fblk' up to the next
+ * extent, with lba 0.
+ *  success - return 0
+ *  errors - EIO
+ */
+static int ext_find(const struct fs_inode *inode, uint32_t fblk, struct fs_extent *e)
+{
+	char buf[FS_BLOCK_SIZE];
+	struct ext_root *root = ext_root(inode);
+	const struct fs_extent *ext = root->ext;
+	uint32_t next = UINT32_MAX;
+	int n = root->nextent;
+	for (int d = root->depth; ; d--) 
+	{
+		int i = ext_index(ext, n, fblk);
+		if (i + 1 < n) 
+		{
+			next = MIN(next, ext[i + 1].fblk);
+		}
+		if (i < 0) 
+		{
+			break;
+		}
+		if (d == 0) 
+		{
+			if (fblk - ext[i].fblk < ext[i].len) 
+			{
+				*e = ext[i];
+				return 0;
+			}
+			break;
+		}
+		struct fs_extent_block *node = block_view(ext[i].lba, buf, BLOCK_INODE);
+		if (!node || ext_bad(node, d - 1)) 
+		{
+			return -EIO;
+		}
+		ext = node->ext;
+		n = node->count;
+	}
+	e->fblk = fblk;
+	e->lba = 0;
+	e->len = next - fblk;
+	return 0;
+}
+
+/* ext_put - put entry 'x' at position 'i' of the '*n' entries 'ext' of
+ * a node at 'depth', which has room for 'cap'. If it is full, it is
+ * split: the entries after 'i' (or, if 'x' goes at the end, as when a
+ * file is appended to, just 'x') move to a new node near 'goal', and
+ * *up is set to the entry for it, for the level above.
+ *  success - return 1 if the node was split, 0 if not
+ *  errors - ENOSPC, EIO
+ */
+static int ext_put(struct fs_extent *ext, int *n, int cap, int depth, int i, struct fs_extent x, uint32_t goal, struct fs_extent *up)
+{
+	if (*n < cap) 
+	{
+		memmove(&ext[i + 1], &ext[i], (*n - i) * sizeof(*ext));
+		ext[i] = x;
+		(*n)++;
+		return 0;
+	}
+	struct fs_extent all[FS_EXTENTS_PER_BLOCK + 1];
+	char buf[FS_BLOCK_SIZE];
+	struct fs_extent_block *node = (struct fs_extent_block *)buf;
+	uint32_t lba;
+	if (alloc_blocks(goal, &lba, 1) != 0) 
+	{
+		return -ENOSPC;
+	}
+	memcpy(all, ext, i * sizeof(*ext));
+	all[i] = x;
+	memcpy(&all[i + 1], &ext[i], (*n - i) * sizeof(*ext));
+	int total = *n + 1, keep = i == *n ? *n : total / 2;
+
+	memset(buf, 0, sizeof(buf));
+	node->depth = depth;
+	node->count = total - keep;
+	memcpy(node->ext, &all[keep], node->count * sizeof(*ext));
+	if (cache_write(buf, lba, BLOCK_INODE) != 0) 
+	{
+		mark_free(lba);
+		return -EIO;
+	}
+	memcpy(ext, all, keep * sizeof(*ext));
+	*n = keep;
+	up->fblk = node->ext[0].fblk;
+	up->lba = lba;
+	up->len = ext_end(node->ext, node->count) - up->fblk;
+	return 1;
+}
+
+/* ext_add - add extent 'x', for file blocks that have no mapping, under
+ * the '*n' entries 'ext' of a node at 'depth' (with room for 'cap'),
+ * joining it to the extent before it if they are contiguous. Nodes it
+ * goes through are written to the cache, with their entries above
+ * updated to the span of file blocks under them.
+ *  success - return 1 if the node was split (see ext_put), 0 if not
+ *  errors - ENOSPC, EIO
+ */
+static int ext_add(struct fs_extent *ext, int *n, int cap, int depth, struct fs_extent x, struct fs_extent *up)
+{
+	int i = ext_index(ext, *n, x.fblk);
+	if (depth == 0) 
+	{
+		if (i >= 0 && ext_end(&ext[i], 1) == x.fblk && ext[i].lba + ext[i].len == x.lba) 
+		{
+			ext[i].len += x.len;
+			return 0;
+		}
+		return ext_put(ext, n, cap, 0, i + 1, x, x.lba, up);
+	}
+
+	/* down into the node it falls in, or the first one */
+	char buf[FS_BLOCK_SIZE];
+	struct fs_extent_block *node = (struct fs_extent_block *)buf;
+	struct fs_extent split;
+	int c = MAX(i, 0);
+	if (cache_read(buf, ext[c].lba, BLOCK_INODE) != 0 || ext_bad(node, depth - 1)) 
+	{
+		return -EIO;
+	}
+	int cnt = node->count;
+	int rv = ext_add(node->ext, &cnt, FS_EXTENTS_PER_BLOCK, depth - 1, x, &split);
+	if (rv < 0) 
+	{
+		return rv;
+	}
+	node->count = cnt;
+	if (cache_write(buf, ext[c].lba, BLOCK_INODE) != 0) 
+	{
+		return -EIO;
+	}
+	ext[c].fblk = node->ext[0].fblk;
+	ext[c].len = ext_end(node->ext, cnt) - ext[c].fblk;
+	return rv == 0 ? 0 : ext_put(ext, n, cap, depth, c + 1, split, split.lba, up);
+}
+
+/* ext_insert - map file blocks x.fblk.. of a dense file, which have no
+ * blocks yet, to disk blocks x.lba.., adding tree nodes (near the data)
+ * as they are needed. When the root in the inode splits, what's left
+ * of it moves down into a node of its own and the tree grows a level.
+ * The caller writes out the inode and the bitmap.
+ *  success - return 0
+ *  errors - ENOSPC, EFBIG, EIO
+ */
+static int ext_insert(struct fs_inode *inode, struct fs_extent x)
+{
+	struct ext_root *root = ext_root(inode);
+	struct fs_extent split;
+	int n = root->nextent;
+
+	/* fail before changing anything if the nodes a split takes, one
+	 * per level and a new root, can't be had
+	 */
+	if (root->depth == EXT_MAX_DEPTH && n == FS_NEXTENT) 
+	{
+		return -EFBIG;
+	}
+	if (free_blocks() < root->depth + 2) 
+	{
+		return -ENOSPC;
+	}
+	int rv = ext_add(root->ext, &n, FS_NEXTENT, root->depth, x, &split);
+	root->nextent = n;
+	if (rv <= 0) 
+	{
+		return rv;
+	}
+
+	char buf[FS_BLOCK_SIZE];
+	struct fs_extent_block *node = (struct fs_extent_block *)buf;
+	uint32_t lba;
+	if (alloc_blocks(x.lba, &lba, 1) != 0) 
+	{
+		return -ENOSPC;
+	}
+	memset(buf, 0, sizeof(buf));
+	node->depth = root->depth;
+	node->count = n;
+	memcpy(node->ext, root->ext, n * sizeof(struct fs_extent));
+	if (cache_write(buf, lba, BLOCK_INODE) != 0) 
+	{
+		mark_free(lba);
+		return -EIO;
+	}
+	root->ext[0].fblk = node->ext[0].fblk;
+	root->ext[0].lba = lba;
+	root->ext[0].len = ext_end(node->ext, n) - node->ext[0].fblk;
+	root->ext[1] = split;
+	root->nextent = 2;
+	root->depth++;
+	return 0;
+}
+
+/* bmap - the disk blocks holding file blocks first..first+n-1 of file
+ * 'inum', in lba[0..n-1]; 0 for the ones that have none.
+ *  success - return 0
+ *  errors - EIO
+ */
+static int bmap(uint32_t inum, const struct fs_inode *inode, int first, int n, uint32_t *lba)
+{
+	uint32_t leaf[FS_PTRS_PER_BLOCK];
+	if (is_inline(inode)) 
+	{
+		memset(lba, 0, n * sizeof(uint32_t));
+		return 0;
+	}
+	if (dense) 
+	{
+		/* an extent (or hole) at a time */
+		for (int i = 0; i < n; ) 
+		{
+			struct fs_extent e;
+			if (ext_find(inode, first + i, &e) != 0) 
+			{
+				return -EIO;
+			}
+			uint32_t skip = first + i - e.fblk;
+			uint32_t k = MIN((uint32_t)(n - i), e.len - skip);
+			for (uint32_t j = 0; j < k; j++) 
+			{
+				lba[i + j] = e.lba ? e.lba + skip + j : 0;
+			}
+			i += k;
+		}
+		return 0;
+	}
+	for (int i = 0; i < n; ) 
+	{
+		if (first + i < N_PTRS) 
+		{
+			lba[i] = inode->ptrs[first + i];
+			i++;
+			continue;
+		}
+		int start = get_leaf(inum, inode, first + i, leaf);
+		if (start == -EFBIG) 
+		{
+			lba[i++] = 0;
+			continue;
+		}
+		if (start < 0) 
+		{
+			return -EIO;
+		}
+		for (; i < n && first + i < start + FS_PTRS_PER_BLOCK; i++) 
+		{
+			lba[i] = leaf[first + i - start];
+		}
+	}
+	return 0;
+}
+
+/* bmap_set - point file blocks first..first+n-1 of file 'inum' at
+ * lba[0..n-1], adding indirect blocks where there are none yet (next
+ * to the data they map). Changed indirect blocks are written to the
+ * cache; the inode is changed in 'inode', for the caller to write, as
+ * is the bitmap. *done is set to how many blocks were mapped. In a
+ * dense image the blocks must have had no mapping, and each run of
+ * consecutive ones becomes an extent (see ext_insert).
+ *  success - return 0
+ *  errors - ENOSPC, EFBIG, EIO
+ */
+static int bmap_set(uint32_t inum, struct fs_inode *inode, int first, int n, const uint32_t *lba, int *done)
+{
+	uint32_t path[INDIRECT_LEVELS][FS_PTRS_PER_BLOCK];
+	uint32_t node[INDIRECT_LEVELS];
+	for (*done = 0; dense && *done < n; ) 
+	{
+		struct fs_extent x = {first + *done, lba[*done], 1};
+		while (*done + x.len < n && lba[*done + x.len] == x.lba + x.len) 
+		{
+			x.len++;
+		}
+		int rv = ext_insert(inode, x);
+		if (rv != 0) 
+		{
+			return rv;
+		}
+		*done += x.len;
+	}
+	for (; *done < n; ) 
+	{
+		int i = *done, fblk = first + i, idx, l;
+		if (fblk < N_PTRS) 
+		{
+			inode->ptrs[fblk] = lba[i];
+			(*done)++;
+			continue;
+		}
+		if ((l = indirect_level(fblk, &idx)) == 0) 
+		{
+			return -EFBIG;
+		}
+
+		/* down from the inode, node[d] being the block at depth d */
+		uint32_t *slot = &inode->indir[l - 1];
+		for (int d = 0; d < l; d++) 
+		{
+			if (*slot != 0) 
+			{
+				if (cache_read(path[d], *slot, BLOCK_INODE) != 0) 
+				{
+					return -EIO;
+				}
+			}
+			else 
+			{
+				if (alloc_blocks(lba[i], slot, 1) != 0) 
+				{
+					return -ENOSPC;
+				}
+				memset(path[d], 0, FS_BLOCK_SIZE);
+				if (d > 0 && cache_write(path[d - 1], node[d - 1], BLOCK_INODE) != 0) 
+				{
+					return -EIO;
+				}
+			}
+			node[d] = *slot;
+			slot = &path[d][idx / level_span(l - 1 - d) % FS_PTRS_PER_BLOCK];
+		}
+
+		uint32_t *leaf = path[l - 1];
+		int start = fblk - idx % FS_PTRS_PER_BLOCK;
+		for (; i < n && first + i < start + FS_PTRS_PER_BLOCK; i++) 
+		{
+			leaf[first + i - start] = lba[i];
+		}
+		if (cache_write(leaf, node[l - 1], BLOCK_INODE) != 0) 
+		{
+			return -EIO;
+		}
+		map_store(inum, start, leaf);
+		*done = i;
+	}
+	return 0;
+}
+
+/* bmap_alloc - allocate blocks for file blocks first..first+n-1 of
+ * file 'inum', which have none: right after block first-1 if they can
+ * go there, else near the inode. Their numbers go in lba[0..n-1]. The
+ * caller writes out the inode and the bitmap.
+ *  success - return 0
+ *  errors - ENOSPC, EFBIG, EIO
+ */
+static int bmap_alloc(uint32_t inum, struct fs_inode *inode, int first, int n, uint32_t *lba)
+{
+	uint32_t goal = data_goal(inum), prev = 0;
+	if (n > max_blocks() - first) 
+	{
+		return -EFBIG;
+	}
+	if (first > 0 && bmap(inum, inode, first - 1, 1, &prev) != 0) 
+	{
+		return -EIO;
+	}
+	if (prev != 0) 
+	{
+		goal = prev + 1;
+	}
+	if (alloc_blocks(goal, lba, n) != 0) 
+	{
+		return -ENOSPC;
+	}
+	int done, rv = bmap_set(inum, inode, first, n, lba, &done);
+	for (int i = done; i < n; i++) 
+	{
+		mark_free(lba[i]);
+	}
+	return rv;
+}
+
+/* a list of blocks, grown as needed */
+struct blk_list {
+	uint32_t *lba;
+	int n, max;
+};
+
+static int blk_add(struct blk_list *list, uint32_t lba)
+{
+	if (list->n == list->max) 
+	{
+		int max = list->max ? 2 * list->max : 64;
+		uint32_t *p = realloc(list->lba, max * sizeof(uint32_t));
+		if (!p) 
+		{
+			return -ENOMEM;
+		}
+		list->lba = p;
+		list->max = max;
+	}
+	list->lba[list->n++] = lba;
+	return 0;
+}
+
+/* list_indirect - add indirect block 'lba', 'depth' levels above its
+ * leaves, and the indirect blocks under it to 'list'.
+ */
+static int list_indirect(uint32_t lba, int depth, struct blk_list *list)
+{
+	uint32_t ptrs[FS_PTRS_PER_BLOCK];
+	int rv = blk_add(list, lba);
+	if (rv != 0 || depth == 0) 
+	{
+		return rv;
+	}
+	if (cache_read(ptrs, lba, BLOCK_INODE) != 0) 
+	{
+		return -EIO;
+	}
+	for (int i = 0; i < FS_PTRS_PER_BLOCK && rv == 0; i++) 
+	{
+		if (ptrs[i]) 
+		{
+			rv = list_indirect(ptrs[i], depth - 1, list);
+		}
+	}
+	return rv;
+}
+
+/* list_nodes - add extent tree node 'lba', at 'depth', and the nodes
+ * under it to 'list'.
+ */
+static int list_nodes(uint32_t lba, int depth, struct blk_list *list)
+{
+	char buf[FS_BLOCK_SIZE];
+	int rv = blk_add(list, lba);
+	if (rv != 0) 
+	{
+		return rv;
+	}
+	struct fs_extent_block *node = block_view(lba, buf, BLOCK_INODE);
+	if (!node || ext_bad(node, depth)) 
+	{
+		return -EIO;
+	}
+	for (int i = 0; i < node->count && depth > 0 && rv == 0; i++) 
+	{
+		rv = list_nodes(node->ext[i].lba, depth - 1, list);
+	}
+	return rv;
+}
+
+/* indirect_blocks - add all of a file's indirect blocks (the nodes of
+ * its extent tree, in a dense image) to 'list'
+ *  success - return 0
+ *  errors - ENOMEM, EIO
+ */
+static int indirect_blocks(const struct fs_inode *inode, struct blk_list *list)
+{
+	int rv = 0;
+	if (dense) 
+	{
+		struct ext_root *root = ext_root(inode);
+		for (int i = 0; i < root->nextent && root->depth > 0 && rv == 0; i++) 
+		{
+			rv = list_nodes(root->ext[i].lba, root->depth - 1, list);
+		}
+		return rv;
+	}
+	for (int l = 1; l <= FS_NINDIR && rv == 0; l++) 
+	{
+		if (inode->indir[l - 1]) 
+		{
+			rv = list_indirect(inode->indir[l - 1], l - 1, list);
+		}
+	}
+	return rv;
+}
+
+/* alloc_count - how many of a file's blocks have been allocated: the
+ * ones holding its data, and any preallocated past the end by
+ * fallocate.
+ */
+static int alloc_count(uint32_t inum, const struct fs_inode *inode)
+{
+	if (is_inline(inode)) 
+	{
+		return 0;
+	}
+	int n = DIV_ROUND_UP(file_size(inode), FS_BLOCK_SIZE);
+	int max = max_blocks();
+	uint32_t lba[64];
+	while (n < max) 
+	{
+		int k = MIN(64, max - n), j = 0;
+		if (bmap(inum, inode, n, k, lba) != 0) 
+		{
+			break;
+		}
+		while (j < k && lba[j] != 0) 
+		{
+			j++;
+		}
+		n += j;
+		if (j < k) 
+		{
+			break;
+		}
+	}
+	return n;
+}
+
+/* bmap_free - free all of a file's blocks, data and indirect, and add
+ * them to 'freed' (for discard_blocks); the inode's pointers are
+ * cleared, and the caller writes it and the bitmap.
+ *  success - return 0
+ *  errors - ENOMEM, EIO
+ */
+static int bmap_free(uint32_t inum, struct fs_inode *inode, struct blk_list *freed)
+{
+	if (is_inline(inode)) 
+	{
+		memset(inode->ptrs, 0, sizeof(inode->ptrs));
+		return 0;
+	}
+	int nblks = alloc_count(inum, inode);
+	uint32_t *lba = malloc(MAX(nblks, 1) * sizeof(uint32_t));
+	int rv = lba ? bmap(inum, inode, 0, nblks, lba) : -ENOMEM;
+	for (int i = 0; i < nblks && rv == 0; i++) 
+	{
+		if (lba[i]) 
+		{
+			rv = blk_add(freed, lba[i]);
+		}
+	}
+	free(lba);
+	if (rv == 0) 
+	{
+		rv = indirect_blocks(inode, freed);
+	}
+	if (rv != 0) 
+	{
+		return rv;
+	}
+	for (int i = 0; i < freed->n; i++) 
+	{
+		mark_free(freed->lba[i]);
+	}
+	memset(inode->ptrs, 0, sizeof(inode->ptrs));
+	memset(inode->indir, 0, sizeof(inode->indir));
+	map_forget(inum);
+	return 0;
+}
+
+/* inline_spill - move an inline file's data out to a block of its
+ * own, as it is about to need blocks. Writes the inode and the bitmap.
+ *  success - return 0
+ *  errors - ENOSPC, EIO
+ */
+static int inline_spill(uint32_t inum, struct fs_inode *inode)
+{
+	char block[FS_BLOCK_SIZE];
+	uint32_t lba = 0;
+	memset(block, 0, sizeof(block));
+	memcpy(block, inode->ptrs, FS_INLINE_MAX);
+	memset(inode->ptrs, 0, sizeof(inode->ptrs));
+	inode->flags &= ~FS_INODE_INLINE;
+
+	int rv = file_size(inode) > 0 ? bmap_alloc(inum, inode, 0, 1, &lba) : 0;
+	if (rv == 0 && lba != 0 && cache_write(block, lba, BLOCK_DATA) != 0) 
+	{
+		mark_free(lba);
+		rv = -EIO;
+	}
+	if (rv != 0) 
+	{
+		memcpy(inode->ptrs, block, FS_INLINE_MAX);
+		inode->flags |= FS_INODE_INLINE;
+		return rv;
+	}
+	if (write_inode(inum, inode) != 0 || write_bitmap() != 0) 
+	{
+		return -EIO;
+	}
+	return 0;
+}
+
+/* da_reserve - blocks to reserve for 'n' buffered blocks starting at
+ * file block 'first': the blocks themselves, and at most one leaf per
+ * FS_PTRS_PER_BLOCK of them (plus one where they straddle two) and a
+ * path of upper indirect blocks above them. In a dense image, the
+ * extent tree nodes that splitting may add: a node splits at most once
+ * per half a node of new extents, and then maybe each level above it.
+ */
+static int da_reserve(int first, int n)
+{
+	if (n == 0 || (!dense && first + n <= N_PTRS)) 
+	{
+		return n;
+	}
+	if (dense) 
+	{
+		return n + DIV_ROUND_UP(n, FS_EXTENTS_PER_BLOCK / 2) + EXT_MAX_DEPTH + 1;
+	}
+	return n + DIV_ROUND_UP(n, FS_PTRS_PER_BLOCK) + INDIRECT_LEVELS;
+}
+
+/* write_delayed - allocate blocks for the data buffered in 'da' (near
+ * the end of the file, or its inode), and write the inode and then the
+ * data to the cache. Frees the slot once all of it is written; if that
+ * fails the slot keeps the data, and its reservation while it has no
+ * blocks, and blocks it did get are reused on the next try. Called
+ * with da_lock held.
+ * Returns -EIO on error.
+ */
+static int write_delayed(struct delalloc *da)
+{
+	struct fs_inode inode;
+	struct block_seg segs[DA_MAX_BLOCKS];
+	uint32_t lba[DA_MAX_BLOCKS];
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+	if (da->inum == 0) 
+	{
+		return 0;
+	}
+	uint32_t inum = da->inum;
+	if (read_inode(inum, &inode) != 0 || bmap(inum, &inode, da->first, da->nblks, lba) != 0) 
+	{
+		return -EIO;
+	}
 
-/* bitmap functions
+	/* normally none of them has a block yet, but a failed try may
+	 * have left them allocated. The reservation makes room for the
+	 * allocation, so it is given up first.
+	 */
+	int n = 0;
+	while (n < da->nblks && lba[n] != 0) 
+	{
+		n++;
+	}
+	if (n < da->nblks) 
+	{
+		__atomic_sub_fetch(&reserved_blocks, da->reserved, __ATOMIC_RELAXED);
+		if (bmap_alloc(inum, &inode, da->first + n, da->nblks - n, lba + n) != 0) 
+		{
+			/* whatever did get mapped stays, for the next try */
+			__atomic_add_fetch(&reserved_blocks, da->reserved, __ATOMIC_RELAXED);
+			write_inode(inum, &inode);
+			write_bitmap();
+			return -EIO;
+		}
+		da->reserved = 0;
+		if (write_inode(inum, &inode) != 0 || write_bitmap() != 0) 
+		{
+			return -EIO;
+		}
+	}
+	for (int i = 0; i < da->nblks; i++) 
+	{
+		segs[i].lba = lba[i];
+		segs[i].buf = da->data + (size_t)i * FS_BLOCK_SIZE;
+	}
+	if (cache_writev(segs, da->nblks, BLOCK_DATA) != 0) 
+	{
+		return -EIO;
+	}
+	da->inum = 0;
+	return 0;
+}
+
+/* flush_delayed - write out the buffered data of file 'inum', if any.
+ * Returns 1 if there was some, 0 if not, -EIO on error.
  */
-void bit_set(unsigned char *map, int i)
+static int flush_delayed(uint32_t inum)
 {
-	map[i/8] |= (1 << (i%8));
+	struct delalloc *da = &da_table[inum % DA_SLOTS];
+	int rv = 0;
+	pthread_mutex_lock(&da_lock);
+	if (da->inum == inum) 
+	{
+		rv = write_delayed(da) == 0 ? 1 : -EIO;
+	}
+	pthread_mutex_unlock(&da_lock);
+	return rv;
 }
-void bit_clear(unsigned char *map, int i)
+
+/* drop_delayed - forget the buffered data of file 'inum' (it is being
+ * truncated or deleted).
+ */
+static void drop_delayed(uint32_t inum)
 {
-	map[i/8] &= ~(1 << (i%8));
+	struct delalloc *da = &da_table[inum % DA_SLOTS];
+	pthread_mutex_lock(&da_lock);
+	if (da->inum == inum) 
+	{
+		da->inum = 0;
+		__atomic_sub_fetch(&reserved_blocks, da->reserved, __ATOMIC_RELAXED);
+		da->reserved = 0;
+	}
+	pthread_mutex_unlock(&da_lock);
 }
-int bit_test(unsigned char *map, int i)
+
+/* delay_write - buffer a write of 'len' bytes at 'offset' to file
+ * 'inum' instead of allocating blocks for it, if it lies entirely past
+ * the file's allocated blocks and fits in the buffer. If the slot is
+ * held by another file whose data can't be written out - or whose file
+ * lock is taken, as writing it out changes that file - the write is
+ * done in place instead. Called with the file lock of 'inum' held.
+ * Returns 1 if buffered, 0 if the caller has to write it in place,
+ * -ENOSPC if there is no room for it.
+ */
+static int delay_write(uint32_t inum, const struct fs_inode *inode, const char *buf, size_t len, off_t offset)
 {
-	return map[i/8] & (1 << (i%8));
+	struct delalloc *da = &da_table[inum % DA_SLOTS];
+
+	pthread_mutex_lock(&da_lock);
+	int mine = da->inum == inum;
+	int start = mine ? da->first : alloc_count(inum, inode);
+	int have = mine ? da->first + da->nblks : start;
+	int end = DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE);
+
+	if (offset / FS_BLOCK_SIZE < start || end - start > DA_MAX_BLOCKS) 
+	{
+		pthread_mutex_unlock(&da_lock);
+		return 0;
+	}
+	int nblks = MAX(end, have) - start;
+	int more = da_reserve(start, nblks) - (mine ? da->reserved : 0);
+	if (more > free_blocks()) 
+	{
+		pthread_mutex_unlock(&da_lock);
+		return -ENOSPC;
+	}
+	uint32_t other = mine ? 0 : da->inum;
+	if (other && pthread_mutex_trylock(file_lock(other)) != 0) 
+	{
+		pthread_mutex_unlock(&da_lock);
+		return 0;
+	}
+	int rv = mine ? 0 : write_delayed(da);
+	if (other) 
+	{
+		pthread_mutex_unlock(file_lock(other));
+	}
+	if (rv != 0 || (!da->data && !(da->data = malloc((size_t)DA_MAX_BLOCKS * FS_BLOCK_SIZE)))) 
+	{
+		pthread_mutex_unlock(&da_lock);
+		return 0;
+	}
+	if (!mine) 
+	{
+		da->inum = inum;
+		da->first = start;
+		da->nblks = 0;
+		da->reserved = 0;
+	}
+	if (nblks > da->nblks) 
+	{
+		memset(da->data + (size_t)da->nblks * FS_BLOCK_SIZE, 0, (size_t)(nblks - da->nblks) * FS_BLOCK_SIZE);
+		da->nblks = nblks;
+	}
+	if (more > 0) 
+	{
+		da->reserved += more;
+		__atomic_add_fetch(&reserved_blocks, more, __ATOMIC_RELAXED);
+	}
+	memcpy(da->data + (offset - (off_t)start * FS_BLOCK_SIZE), buf, len);
+	pthread_mutex_unlock(&da_lock);
+	return 1;
 }
 
-/* init - this is called once by the FUSE framework at startup. Ignore
- * the 'conn' argument.
- * recommended actions:
- *   - read superblock
- *   - allocate memory, read bitmaps and inodes
+/* The dentry cache: the inode that name 'name' in directory 'parent'
+ * refers to, or 0 if there is no such name, so that translate doesn't
+ * have to search the directory again. The operations that change a
+ * directory update its entries here as they change it (dcache_set).
+ * At most DCACHE_SIZE entries; the least recently used one is reused.
  */
-void* fs_init(struct fuse_conn_info *conn)
+#define DCACHE_SIZE 1024
+#define DCACHE_HASH 2039
+
+struct dentry {
+	uint32_t parent;		/* 0 if unused */
+	char name[MAX_NAME_LEN + 1];
+	uint32_t inum;			/* 0 = no such name */
+	struct dentry *hnext;
+	struct dentry *prev, *next;	/* LRU order, most recent first */
+};
+
+static struct dentry dcache[DCACHE_SIZE];
+static struct dentry *dhash[DCACHE_HASH];
+static struct dentry dlru;
+static uint64_t dgen;		/* counts changes, see dcache_add */
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dlru_unlink(struct dentry *d)
 {
-	char buffer[FS_BLOCK_SIZE];
-	if (block_read(buffer, 0, 1) != 0) 
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+}
+
+static void dlru_front(struct dentry *d)
+{
+	d->next = dlru.next;
+	d->prev = &dlru;
+	dlru.next->prev = d;
+	dlru.next = d;
+}
+
+static void dcache_reset(void)
+{
+	pthread_mutex_lock(&dcache_lock);
+	memset(dhash, 0, sizeof(dhash));
+	dlru.next = dlru.prev = &dlru;
+	for (int i = 0; i < DCACHE_SIZE; i++) 
 	{
-		fprintf(stderr, "[fs_init]: superblock read failed\n");
-		return NULL;
+		memset(&dcache[i], 0, sizeof(dcache[i]));
+		dlru_front(&dcache[i]);
 	}
-	memcpy(&superblock, buffer, sizeof(struct fs_super));
+	dgen++;
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-	if (superblock.magic != FS_MAGIC) {
-		fprintf(stderr, "[fs_init]: invalid magic number\n");
-		return NULL;
+static struct dentry **dbucket(uint32_t parent, const char *name)
+{
+	uint32_t h = parent;
+	while (*name) 
+	{
+		h = h * 31 + (unsigned char)*name++;
 	}
+	return &dhash[h % DCACHE_HASH];
+}
 
-	bitmap = malloc(FS_BLOCK_SIZE); // Allocate memory for block bitmap
-	if (!bitmap) {
-		fprintf(stderr, "[fs_init]: bitmap malloc failed\n");
-		return NULL;
+/* the entry for 'name' in 'parent', or NULL. Called with dcache_lock held. */
+static struct dentry *dfind(uint32_t parent, const char *name)
+{
+	struct dentry *d = *dbucket(parent, name);
+	while (d && (d->parent != parent || strcmp(d->name, name) != 0)) 
+	{
+		d = d->hnext;
 	}
+	return d;
+}
 
-	if (block_read(bitmap, 1, 1) != 0) {
-		fprintf(stderr, "[fs_init]: bitmap read failed\n");
-		free(bitmap);
-		bitmap = NULL;
-		return NULL;
+static void dunhash(struct dentry *d)
+{
+	struct dentry **pp = dbucket(d->parent, d->name);
+	while (*pp != d) 
+	{
+		pp = &(*pp)->hnext;
 	}
+	*pp = d->hnext;
+	d->parent = 0;
+}
 
-	return NULL;
+/* set the entry for 'name' in 'parent', reusing the least recently
+ * used one if it isn't there. Called with dcache_lock held.
+ */
+static void dstore(uint32_t parent, const char *name, uint32_t inum)
+{
+	struct dentry *d = dfind(parent, name);
+	if (!d) 
+	{
+		d = dlru.prev;
+		if (d->parent) 
+		{
+			dunhash(d);
+		}
+		d->parent = parent;
+		strcpy(d->name, name);
+		struct dentry **pp = dbucket(parent, name);
+		d->hnext = *pp;
+		*pp = d;
+	}
+	d->inum = inum;
+	dlru_unlink(d);
+	dlru_front(d);
 }
 
-/* Note on path translation errors:
- * In addition to the method-specific errors listed below, almost
- * every method can return one of the following errors if it fails to
- * locate a file or directory corresponding to a specified path.
- *
- * ENOENT - a component of the path doesn't exist.
- * ENOTDIR - an intermediate component of the path (e.g. 'b' in
- *           /a/b/c) is not a directory
+/* dcache_lookup - look up 'name' in directory 'parent'.
+ *  success - return 1, with the inode in *inum (0 if there is no such name)
+ *  not cached - return 0
+ */
+static int dcache_lookup(uint32_t parent, const char *name, uint32_t *inum)
+{
+	pthread_mutex_lock(&dcache_lock);
+	struct dentry *d = dfind(parent, name);
+	if (d) 
+	{
+		*inum = d->inum;
+		dlru_unlink(d);
+		dlru_front(d);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return d != NULL;
+}
+
+static uint64_t dcache_gen(void)
+{
+	pthread_mutex_lock(&dcache_lock);
+	uint64_t gen = dgen;
+	pthread_mutex_unlock(&dcache_lock);
+	return gen;
+}
+
+/* dcache_add - remember what a search of directory 'parent' for 'name'
+ * found, unless a directory changed since the search began (at 'gen',
+ * from dcache_gen): the result could be out of date already.
  */
+static void dcache_add(uint32_t parent, const char *name, uint32_t inum, uint64_t gen)
+{
+	if (strlen(name) > MAX_NAME_LEN) 
+	{
+		return;
+	}
+	pthread_mutex_lock(&dcache_lock);
+	if (gen == dgen) 
+	{
+		dstore(parent, name, inum);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-/* note on splitting the 'path' variable:
- * the value passed in by the FUSE framework is declared as 'const',
- * which means you can't modify it. The standard mechanisms for
- * splitting strings in C (strtok, strsep) modify the string in place,
- * so you have to copy the string and then free the copy when you're
- * done. One way of doing this:
- *
- *    char *_path = strdup(path);
- *    int inum = translate(_path);
- *    free(_path);
+/* dcache_set - 'name' in directory 'parent' has just been made to
+ * refer to 'inum', or removed (inum 0).
  */
+static void dcache_set(uint32_t parent, const char *name, uint32_t inum)
+{
+	pthread_mutex_lock(&dcache_lock);
+	dgen++;
+	if (strlen(name) <= MAX_NAME_LEN) 
+	{
+		dstore(parent, name, inum);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
 
-int read_inode(uint32_t inum, struct fs_inode *inode) 
+/* dcache_purge - forget the entries of directory 'parent', which has
+ * been removed, so its inode can be reused.
+ */
+static void dcache_purge(uint32_t parent)
 {
-	char buffer[FS_BLOCK_SIZE];
-	if (block_read(buffer, inum, 1) != 0) 
+	pthread_mutex_lock(&dcache_lock);
+	dgen++;
+	for (int i = 0; i < DCACHE_SIZE; i++) 
 	{
-		return -1;
-	}  
-	memcpy(inode, buffer, sizeof(struct fs_inode));
-	return 0;
+		if (dcache[i].parent == parent) 
+		{
+			dunhash(&dcache[i]);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* dir_find - look up 'name' in directory 'dir', in the dentry cache
+ * or else in the directory's blocks.
+ *  success - return 0, with the inode in *inum
+ *  errors - ENOENT, ENOTDIR, EIO
+ */
+static int dir_find(uint32_t dir, const char *name, uint32_t *inum)
+{
+	if (dcache_lookup(dir, name, inum)) 
+	{
+		return *inum ? 0 : -ENOENT;
+	}
+
+	uint64_t gen = dcache_gen();
+	struct fs_inode *dir_inode = iget(dir);
+	if (!dir_inode) 
+	{
+		fprintf(stderr, "[translate]: read_inode failed\n");
+		return -EIO;
+	}
+	if (!S_ISDIR(dir_inode->mode)) 
+	{
+		fprintf(stderr, "[translate]: not a directory\n");
+		iput(dir_inode);
+		return -ENOTDIR;
+	}
+	*inum = 0;
+	for (int j = 0; j < dir_inode->size / FS_BLOCK_SIZE && *inum == 0; j++) 
+	{
+		char block[FS_BLOCK_SIZE];
+		uint32_t lba;
+		struct fs_dirent *entries = bmap(dir, dir_inode, j, 1, &lba) == 0 ?
+			block_view(lba, block, BLOCK_DIR) : NULL;
+		if (!entries) 
+		{
+			fprintf(stderr, "[translate]: block read failed\n");
+			iput(dir_inode);
+			return -EIO;
+		}
+		for (int k = 0; k < FS_BLOCK_SIZE / sizeof(struct fs_dirent); k++) 
+		{
+			if (entries[k].valid && strcmp(entries[k].name, name) == 0) 
+			{
+				*inum = entries[k].inode;
+				break;
+			}
+		}
+	}
+	iput(dir_inode);
+	dcache_add(dir, name, *inum, gen);
+	return *inum ? 0 : -ENOENT;
 }
 
 /* splits the path in components.
@@ -139,7 +2581,7 @@ int read_inode(uint32_t inum, struct fs_inode *inode)
  */
 int pathparse(const char *path, char **components) 
 {
-	char *token;
+	char *token, *save;	/* strtok_r: lookups run in parallel */
 	int i = 0;
 	char *path_copy = strdup(path);
 	if (!path_copy) 
@@ -147,17 +2589,19 @@ int pathparse(const char *path, char **components)
 		return -1;
 	}
 
-	token = strtok(path_copy, "/");
+	token = strtok_r(path_copy, "/", &save);
 	while (token != NULL && i < MAX_PATH_LEN) 
 	{
 		components[i] = strdup(token);
 		i++;
-		token = strtok(NULL, "/");
+		token = strtok_r(NULL, "/", &save);
 	}
 	free(path_copy);
 	return i;
 }
 
+void free_components(char **components, int num_components);
+
 /* translate - translate a path into an inode number.
  *  success - return 0
  *  errors - ENOENT, ENOTDIR, EIO
@@ -166,11 +2610,11 @@ int translate(const char *path, uint32_t *inum, struct fs_inode *inode)
 {
 	char *components[MAX_PATH_LEN];
 	int num_components = pathparse(path, components);
-	uint32_t current_inum = 2;
+	uint32_t current_inum = root_inum;
 
 	uint32_t parent_stack[MAX_PATH_LEN]; // Stack to keep track of parent inodes
 	int stack_pos = 0;
-	parent_stack[0] = 2; // Root's parent is itself
+	parent_stack[0] = root_inum; // Root's parent is itself
 
 	// Handle the case where the path is empty ("") or path is ("/")
 	if (num_components == 0) {
@@ -196,49 +2640,17 @@ int translate(const char *path, uint32_t *inum, struct fs_inode *inode)
 			continue;
 		}
 
-		struct fs_inode current_inode;
-		if (read_inode(current_inum, &current_inode) != 0) 
-		{
-			fprintf(stderr, "[translate]: read_inode failed\n");
-			return -EIO;
-		}
-
-		if (!S_ISDIR(current_inode.mode)) 
+		uint32_t child;
+		int res = dir_find(current_inum, components[i], &child);
+		if (res != 0) 
 		{
-			fprintf(stderr, "[translate]: not a directory\n");
-			return -ENOTDIR;
-		}
-		int found = 0;
-		for (int j = 0; j < current_inode.size / FS_BLOCK_SIZE; j++) 
-		{
-			char block[FS_BLOCK_SIZE];
-			if (block_read(block, current_inode.ptrs[j], 1) != 0) 
-			{
-				fprintf(stderr, "[translate]: block read failed\n");
-				return -EIO;
-			}
-			struct fs_dirent *entries = (struct fs_dirent *)block;
-			for (int k = 0; k < FS_BLOCK_SIZE / sizeof(struct fs_dirent); k++) 
-			{
-				if (entries[k].valid && strcmp(entries[k].name, components[i]) == 0) 
-				{
-					parent_stack[stack_pos + 1] = current_inum;
-					stack_pos++;
-					current_inum = entries[k].inode;
-					found = 1;
-					break;
-				}
-			}
-			if (found) 
-			{
-				break;
-			}
-		}
-		if (!found) 
-		{
-			return -ENOENT;
+			free_components(components, num_components);
+			return res;
 		}
+		parent_stack[++stack_pos] = current_inum;
+		current_inum = child;
 	}
+	free_components(components, num_components);
 
 	if (read_inode(current_inum, inode) != 0) 
 	{
@@ -307,19 +2719,142 @@ void free_components(char **components, int num_components)
 	}
 }
 
-/* setstat - set the fields of 'struct stat' from the inode.
+/* The result of lookup: where the last name of a path is in its
+ * directory, or where it would go.
+ */
+struct lookup {
+	uint32_t parent;		/* the directory */
+	struct fs_inode parent_inode;
+	char name[MAX_NAME_LEN + 1];
+	uint32_t inum;			/* 0 if there is no such name */
+	struct fs_inode inode;		/* its inode, if there is */
+	uint32_t lba;			/* directory block with its entry, or else
+					 * with the first free one (0 = full) */
+	int slot;			/* which entry in that block */
+	char block[FS_BLOCK_SIZE];	/* a copy of the block */
+};
+
+/* lookup - find the directory holding the last name of 'path' and, in
+ * one pass over the directory's blocks, the name's entry or else the
+ * first free entry.
+ *  success - return 0; lk->inum is 0 if the name doesn't exist
+ *  errors - EINVAL (no last name, as in "/", or one that is too long),
+ *           ENOENT (for the directory), ENOTDIR, EIO
+ */
+static int lookup(const char *path, struct lookup *lk)
+{
+	char *components[MAX_PATH_LEN], *resolved[MAX_PATH_LEN];
+	int num_components = pathparse(path, components);
+	int n = resolve_path(components, num_components, resolved);
+	free_components(components, num_components);
+	if (n <= 0) 
+	{
+		return n < 0 ? -ENOMEM : -EINVAL;
+	}
+
+	uint32_t dir = root_inum;
+	int res = 0;
+	for (int i = 0; i < n - 1 && res == 0; i++) 
+	{
+		res = dir_find(dir, resolved[i], &dir);
+	}
+	if (res == 0 && strlen(resolved[n - 1]) > MAX_NAME_LEN) 
+	{
+		res = -EINVAL;
+	}
+	if (res == 0) 
+	{
+		strcpy(lk->name, resolved[n - 1]);
+	}
+	free_components(resolved, n);
+	if (res != 0) 
+	{
+		return res;
+	}
+
+	lk->parent = dir;
+	lk->inum = 0;
+	lk->lba = 0;
+	lk->slot = -1;
+	if (read_inode(dir, &lk->parent_inode) != 0) 
+	{
+		return -EIO;
+	}
+	if (!S_ISDIR(lk->parent_inode.mode)) 
+	{
+		return -ENOTDIR;
+	}
+	uint64_t gen = dcache_gen();
+	for (int i = 0; i < lk->parent_inode.size / FS_BLOCK_SIZE && lk->inum == 0; i++) 
+	{
+		char block[FS_BLOCK_SIZE];
+		uint32_t lba;
+		struct fs_dirent *entries = bmap(dir, &lk->parent_inode, i, 1, &lba) == 0 ?
+			block_view(lba, block, BLOCK_DIR) : NULL;
+		if (!entries) 
+		{
+			return -EIO;
+		}
+		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
+		{
+			int match = entries[j].valid && strcmp(entries[j].name, lk->name) == 0;
+			if (match || (!entries[j].valid && lk->lba == 0)) 
+			{
+				lk->inum = match ? entries[j].inode : 0;
+				lk->lba = lba;
+				lk->slot = j;
+				memcpy(lk->block, entries, FS_BLOCK_SIZE);
+			}
+			if (match) 
+			{
+				break;
+			}
+		}
+	}
+	dcache_add(dir, lk->name, lk->inum, gen);
+	if (lk->inum && read_inode(lk->inum, &lk->inode) != 0) 
+	{
+		return -EIO;
+	}
+	return 0;
+}
+
+/* dir_set - point the entry lookup found (or the free one) at 'inum',
+ * or clear it if 'inum' is 0, and write the directory block.
+ *  success - return 0
+ *  errors - EIO
+ */
+static int dir_set(struct lookup *lk, uint32_t inum)
+{
+	struct fs_dirent *de = (struct fs_dirent *)lk->block + lk->slot;
+	de->valid = inum != 0;
+	if (inum) 
+	{
+		de->inode = inum;
+		memset(de->name, 0, sizeof(de->name));
+		strcpy(de->name, lk->name);
+	}
+	if (cache_write(lk->block, lk->lba, BLOCK_DIR) != 0) 
+	{
+		return -EIO;
+	}
+	dcache_set(lk->parent, lk->name, inum);
+	return 0;
+}
+
+/* setstat - set the fields of 'struct stat' from inode 'inum'.
  *  success - return 0
  */
-void setstat(struct fs_inode inode, struct stat *sb) {	
-	sb->st_uid = inode.uid;
-	sb->st_gid = inode.gid;
-	sb->st_mode = inode.mode;
-	sb->st_size = inode.size;
+void setstat(uint32_t inum, const struct fs_inode *inode, struct stat *sb) {	
+	sb->st_uid = inode->uid;
+	sb->st_gid = inode->gid;
+	sb->st_mode = inode->mode;
+	sb->st_size = file_size(inode);
 	sb->st_nlink = 1;
-	sb->st_atime = inode.mtime;
-	sb->st_mtime = inode.mtime;
-	sb->st_ctime = inode.ctime;
-	sb->st_blocks = ceil((double)(inode.size) / FS_BLOCK_SIZE);
+	sb->st_atime = inode->mtime;
+	sb->st_mtime = inode->mtime;
+	sb->st_ctime = inode->ctime;
+	sb->st_blocks = (blkcnt_t)alloc_count(inum, inode) * (FS_BLOCK_SIZE / 512);	// in 512-byte units
 }
 
 /* getattr - get file or directory attributes. For a description of
@@ -345,7 +2880,7 @@ int fs_getattr(const char *path, struct stat *sb)
 		return res;
 	}
 
-	setstat(inode, sb);
+	setstat(inum, &inode, sb);
 
 	return 0;
 }
@@ -378,35 +2913,89 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset
 		return -ENOTDIR;
 	}
 
-	for (int i = 0; i < inode.size / FS_BLOCK_SIZE; i++) 
+	/* Read the whole directory in one batch, then the inodes of all
+	 * its entries that aren't in the inode cache in a second one,
+	 * instead of one read per entry. With a mapped image both are just
+	 * pointers into the mapping.
+	 */
+	int nblocks = inode.size / FS_BLOCK_SIZE;
+	int per_block = FS_BLOCK_SIZE / sizeof(struct fs_dirent);
+	char *dirblocks = malloc(nblocks * FS_BLOCK_SIZE);
+	struct block_seg *dsegs = malloc(nblocks * sizeof(*dsegs));
+	struct block_seg *isegs = malloc(nblocks * per_block * sizeof(*isegs));
+	char *inodes = NULL;
+	int res_io = -ENOMEM;
+	if (!dirblocks || !dsegs || !isegs) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, inode.ptrs[i], 1) != 0) 
+		goto out;
+	}
+
+	int rv_map = 0;
+	for (int i = 0; i < nblocks && rv_map == 0; i++) 
+	{
+		uint32_t lba;
+		rv_map = bmap(inum, &inode, i, 1, &lba);
+		dsegs[i].lba = lba;
+		dsegs[i].buf = dirblocks + i * FS_BLOCK_SIZE;
+	}
+	if (rv_map != 0 || block_viewv(dsegs, nblocks, BLOCK_DIR) != 0) 
+	{
+		fprintf(stderr, "[fs_readdir]: block read failed\n");
+		res_io = -EIO;
+		goto out;
+	}
+
+	int nvalid = 0;
+	for (int i = 0; i < nblocks; i++) 
+	{
+		struct fs_dirent *entries = dsegs[i].buf;
+		for (int j = 0; j < per_block; j++) 
 		{
-			fprintf(stderr, "[fs_readdir]: block read failed\n");
-			return -EIO;
+			if (entries[j].valid) 
+			{
+				isegs[nvalid++].lba = entries[j].inode;
+			}
 		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
+	}
+	inodes = malloc(nvalid * FS_BLOCK_SIZE);
+	if (nvalid > 0 && !inodes) 
+	{
+		goto out;
+	}
+	for (int k = 0; k < nvalid; k++) 
+	{
+		isegs[k].buf = inodes + k * FS_BLOCK_SIZE;
+	}
+	if ((res_io = read_inodes(isegs, nvalid)) != 0) 
+	{
+		fprintf(stderr, "[fs_readdir]: inode read failed\n");
+		goto out;
+	}
+
+	for (int i = 0, k = 0; i < nblocks; i++) 
+	{
+		struct fs_dirent *entries = dsegs[i].buf;
+		for (int j = 0; j < per_block; j++) 
 		{
 			if (entries[j].valid) {
 				struct stat st;
 				memset(&st, 0, sizeof(st));
 
-				struct fs_inode entry_inode;
-				if (read_inode(entries[j].inode, &entry_inode) != 0) 
-				{
-					continue;
-				}
-
-				setstat(entry_inode, &st);
+				setstat(isegs[k].lba, isegs[k].buf, &st);
+				k++;
 
 				filler(ptr, entries[j].name, &st, 0);
 			}
-
 		}
 	}
-	return 0;
+	res_io = 0;
+
+out:
+	free(dirblocks);
+	free(dsegs);
+	free(isegs);
+	free(inodes);
+	return res_io;
 }
 
 /* create - create a new file with specified permissions
@@ -425,72 +3014,27 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset
  */
 int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	char *components[MAX_PATH_LEN];
-	int num_components = pathparse(path, components);
-
-	char *resolved_components[MAX_PATH_LEN];
-	int resolved_count = resolve_path(components, num_components, resolved_components);
-
-	char *filename = resolved_components[resolved_count - 1];
-
-	char parent_path[256] = "/";
-	for (int i = 0; i < resolved_count - 1; i++) 
-	{
-		strcat(parent_path, resolved_components[i]);
-		if (i < resolved_count - 2) {
-			strcat(parent_path, "/");
-		}
-	}
-
-	uint32_t parent_inum;
-	struct fs_inode parent_inode;
-	int res = translate(parent_path, &parent_inum, &parent_inode);
+	struct lookup lk;
+	int res = lookup(path, &lk);
 	if (res != 0) 
 	{
 		return res;
 	}
-
-	if (!S_ISDIR(parent_inode.mode)) 
+	if (lk.inum) 
 	{
-		return -ENOTDIR;
+		return -EEXIST;
 	}
-
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	if (lk.lba == 0) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
-		{
-			return -EIO;
-		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
-		{
-			if (entries[j].valid && strcmp(entries[j].name, filename) == 0)
-			{
-				free_components(components, num_components);
-				free_components(resolved_components, resolved_count);
-				return -EEXIST;
-			}
-		}
+		return -ENOSPC;
 	}
 
-	uint32_t inum = 0;
-	for (int i = 2; i < superblock.disk_size; i++) 
-	{
-		if (!bit_test(bitmap, i)) 
-		{ 
-			inum = i; 
-			break; 
-		}
-	}
-	if (!inum) 
+	uint32_t inum;
+	if ((res = ialloc(lk.parent, &inum)) != 0) 
 	{
-		free_components(components, num_components);
-		free_components(resolved_components, resolved_count);
-		return -ENOSPC;
+		return res;
 	}
-	bit_set(bitmap, inum);
-	if (block_write(bitmap, 1, 1) != 0) 
+	if (write_bitmap() != 0) 
 	{
 		return -EIO;
 	}
@@ -505,46 +3049,18 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	new_inode.ctime = time(NULL);
 	new_inode.mtime = new_inode.ctime;
 	new_inode.size = 0;
+	new_inode.flags = dense || v0 ? 0 : FS_INODE_INLINE; // data goes in the inode until it outgrows it
 
 	// setting file inode
-	char inode_block[FS_BLOCK_SIZE];
-	memset(inode_block, 0, FS_BLOCK_SIZE);
-	memcpy(inode_block, &new_inode, sizeof(new_inode));
-	if (block_write(inode_block, inum, 1) != 0) 
+	if (write_inode(inum, &new_inode) != 0) 
 	{
-		bit_clear(bitmap, inum);
-		block_write(bitmap, 1, 1);
+		ifree(inum);
+		write_bitmap();
 		return -EIO;
 	}
 
 	// add the new file to the parent directory
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
-	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
-		{
-			return -EIO;
-		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
-		{
-			if (!entries[j].valid) 
-			{
-				entries[j].valid = 1;
-				entries[j].inode = inum;
-				strncpy(entries[j].name, filename, MAX_NAME_LEN);
-				entries[j].name[MAX_NAME_LEN - 1] = '\0';
-				if (block_write(block, parent_inode.ptrs[i], 1) != 0) 
-				{
-					return -EIO;
-				}
-				return 0;
-			}
-		}
-	}
-	free_components(components, num_components);
-	free_components(resolved_components, resolved_count);
-	return -ENOSPC;
+	return dir_set(&lk, inum);
 }
 
 /* mkdir - create a directory with the given mode.
@@ -558,770 +3074,1212 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */ 
 int fs_mkdir(const char *path, mode_t mode)
 {
-	char *components[MAX_PATH_LEN];
-	int num_components = pathparse(path, components);
+	struct lookup lk;
+	int res = lookup(path, &lk);
+	if (res != 0) 
+	{
+		return res;
+	}
+	if (lk.inum) 
+	{
+		return -EEXIST;
+	}
+	if (lk.lba == 0) 
+	{
+		return -EOPNOTSUPP;
+	}
+
+	uint32_t dir_inum, data_block;
+	if ((res = ialloc(lk.parent, &dir_inum)) != 0) 
+	{
+		return res;
+	}
+	if (alloc_blocks(data_goal(dir_inum), &data_block, 1) != 0) 
+	{
+		ifree(dir_inum);
+		write_bitmap();
+		return -ENOSPC;
+	}
+	if (write_bitmap() != 0) 
+	{
+		return -EIO;
+	}
+
+	struct fs_inode dir_inode;
+	memset(&dir_inode, 0, sizeof(struct fs_inode));
+
+	struct fuse_context *ctx = fuse_get_context();
+	dir_inode.uid = ctx->uid;
+	dir_inode.gid = ctx->gid;
+	dir_inode.mode = S_IFDIR | mode;
+	dir_inode.ctime = time(NULL);
+	dir_inode.mtime = dir_inode.ctime;
+	dir_inode.size = FS_BLOCK_SIZE;
+
+	int done;
+	if (bmap_set(dir_inum, &dir_inode, 0, 1, &data_block, &done) != 0 ||
+	    write_inode(dir_inum, &dir_inode) != 0) 
+	{
+		ifree(dir_inum);
+		mark_free(data_block);
+		write_bitmap();
+		return -EIO;
+	}
 
-	char *resolved_components[MAX_PATH_LEN];
-	int resolved_count = resolve_path(components, num_components, resolved_components);
+	char dirents[FS_BLOCK_SIZE];
+	memset(dirents, 0, FS_BLOCK_SIZE);
+	if (cache_write(dirents, data_block, BLOCK_DIR) != 0)  
+	{
+		ifree(dir_inum);
+		mark_free(data_block);
+		write_bitmap();
+		return -EIO;
+	}
 
-	char *dirname = resolved_components[resolved_count - 1];
+	return dir_set(&lk, dir_inum);
+}
 
-	char parent_path[256] = "/";
-	for (int i = 0; i < resolved_count - 1; i++) 
+/* blocks that were just freed: the data and indirect blocks in
+ * 'ptrs[0..nptrs-1]' (0 = none) and the inode 'inum' (0 = none; a
+ * dense image's inode shares its block, which is left alone). Their
+ * cached copies are dropped without being written, and the device is
+ * told they're free once the block cache has written back what freed
+ * them - so the inode, directory and bitmap changes must be in the
+ * block cache, not just the inode cache, by now. This is only an
+ * optimization, so errors are ignored.
+ */
+static void discard_blocks(const uint32_t *ptrs, int nptrs, uint32_t inum)
+{
+	int *lba = malloc((nptrs + 1) * sizeof(int));
+	int n = 0;
+	if (!lba) 
+	{
+		return;
+	}
+	for (int i = 0; i < nptrs; i++) 
 	{
-		strcat(parent_path, resolved_components[i]);
-		if (i < resolved_count - 2) {
-			strcat(parent_path, "/");
+		if (ptrs[i]) 
+		{
+			lba[n++] = ptrs[i];
 		}
 	}
+	if (inum && !dense) 
+	{
+		lba[n++] = inum;
+	}
+	cache_discard(lba, n);
+	free(lba);
+}
 
-	uint32_t parent_inum;
-	struct fs_inode parent_inode;
-	int res = translate(parent_path, &parent_inum, &parent_inode);
+/* unlink - delete a file
+ *  success - return 0
+ *  errors - path resolution, ENOENT, EISDIR
+ */
+int fs_unlink(const char *path)
+{
+	struct lookup lk;
+	int res = lookup(path, &lk);
 	if (res != 0) 
 	{
 		return res;
 	}
+	if (!lk.inum) 
+	{
+		return -ENOENT;
+	}
+	if (S_ISDIR(lk.inode.mode)) 
+	{
+		return -EISDIR;
+	}
+	if (dir_set(&lk, 0) != 0) 
+	{
+		return -EIO;
+	}
+
+	uint32_t inum = lk.inum;
+	drop_delayed(inum);
+	struct blk_list freed = {0};
+	if (bmap_free(inum, &lk.inode, &freed) != 0) 
+	{
+		free(freed.lba);
+		return -EIO;
+	}
+	ifree(inum);
+	if (write_bitmap() != 0) 
+	{
+		free(freed.lba);
+		return -EIO;
+	}
+	discard_blocks(freed.lba, freed.n, inum);
+	free(freed.lba);
+	return 0;
+}
 
-	if (!S_ISDIR(parent_inode.mode)) 
+/* rmdir - remove a directory
+ *  success - return 0
+ *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+ */
+int fs_rmdir(const char *path)
+{
+	struct lookup lk;
+	int res = lookup(path, &lk);
+	if (res != 0) 
+	{
+		return res;
+	}
+	if (!lk.inum) 
+	{
+		return -ENOENT;
+	}
+	if (!S_ISDIR(lk.inode.mode)) 
 	{
 		return -ENOTDIR;
 	}
 
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	char block[FS_BLOCK_SIZE];
+	uint32_t lba;
+	struct fs_dirent *entries = bmap(lk.inum, &lk.inode, 0, 1, &lba) == 0 ?
+		block_view(lba, block, BLOCK_DIR) : NULL; // directory will have only one block
+	if (!entries) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
-		{
-			return -EIO;
-		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
+		return -EIO;
+	}
+	for (int i = 0; i < FS_BLOCK_SIZE / sizeof(struct fs_dirent); i++) 
+	{
+		if (entries[i].valid) 
 		{
-			if (entries[j].valid && strcmp(entries[j].name, dirname) == 0)
-			{
-				return -EEXIST;
-			}
+			return -ENOTEMPTY;
 		}
 	}
 
-	uint32_t dir_inum = 0, data_block = 0;
-	for (int i = 2; i < superblock.disk_size; i++) 
+	if (dir_set(&lk, 0) != 0) 
 	{
-		if (!dir_inum && !bit_test(bitmap, i)) 
-		{
-			dir_inum = i;
-		} else if (!data_block && !bit_test(bitmap, i)) 
-		{
-			data_block = i;
-			break;
-		}
+		return -EIO;
 	}
-	if (!dir_inum || !data_block) 
+	dcache_purge(lk.inum);
+	mark_free(lba);
+	ifree(lk.inum);
+	if (write_bitmap() != 0) 
 	{
-		return -ENOSPC;
+		return -EIO;
+	}
+	discard_blocks(&lba, 1, lk.inum);
+	return 0;
+}
+
+/* rename - rename a file or directory
+ * success - return 0
+ * Errors - path resolution, ENOENT, EINVAL, EEXIST
+ *
+ * ENOENT - source does not exist
+ * EEXIST - destination already exists
+ * EINVAL - source and destination are not in the same directory
+ *
+ * Note that this is a simplified version of the UNIX rename
+ * functionality - see 'man 2 rename' for full semantics. In
+ * particular, the full version can move across directories, replace a
+ * destination file, and replace an empty directory with a full one.
+ */
+int fs_rename(const char *src_path, const char *dst_path)
+{
+	struct lookup src, dst;
+	int res = lookup(src_path, &src);
+	if (res == 0 && !src.inum) 
+	{
+		res = -ENOENT;
+	}
+	if (res == 0) 
+	{
+		res = lookup(dst_path, &dst);
+	}
+	if (res != 0) 
+	{
+		return res;
 	}
 
-	bit_set(bitmap, dir_inum);
-	bit_set(bitmap, data_block);
-	if (block_write(bitmap, 1, 1) != 0) 
+	if (src.parent != dst.parent) 
 	{
-		return -EIO;
+		return -EINVAL;
+	}
+	if (dst.inum == src.inum) 
+	{
+		return 0;	/* to itself */
+	}
+	if (dst.inum) 
+	{
+		return -EEXIST;
 	}
 
-	struct fs_inode dir_inode;
-	memset(&dir_inode, 0, sizeof(struct fs_inode));
+	/* rename the source entry in place, with the file's lock held as
+	 * its name changes (see lock_file)
+	 */
+	struct fs_dirent *de = (struct fs_dirent *)src.block + src.slot;
+	memset(de->name, 0, sizeof(de->name));
+	strcpy(de->name, dst.name);
+	pthread_mutex_lock(file_lock(src.inum));
+	res = cache_write(src.block, src.lba, BLOCK_DIR);
+	if (res == 0) 
+	{
+		dcache_set(src.parent, src.name, 0);
+		dcache_set(dst.parent, dst.name, src.inum);
+	}
+	pthread_mutex_unlock(file_lock(src.inum));
+	if (res != 0) 
+	{
+		fprintf(stderr, "[fs_rename]: block write failed\n");
+		return -EIO;
+	}
+	return 0;
+}
 
-	struct fuse_context *ctx = fuse_get_context();
-	dir_inode.uid = ctx->uid;
-	dir_inode.gid = ctx->gid;
-	dir_inode.mode = S_IFDIR | mode;
-	dir_inode.ctime = time(NULL);
-	dir_inode.mtime = dir_inode.ctime;
-	dir_inode.size = FS_BLOCK_SIZE;
-	dir_inode.ptrs[0] = data_block;  
+/* chmod - change file permissions
+ * utime - change access and modification times
+ *         (for definition of 'struct utimebuf', see 'man utime')
+ *
+ * success - return 0
+ * Errors - path resolution, ENOENT.
+ */
+int fs_chmod(const char *path, mode_t mode)
+{
+	uint32_t inum;
+	struct fs_inode inode;
+	int res = translate(path, &inum, &inode);
+	if (res != 0) 
+	{
+		perror("In fs_chmod: translate failed");
+		return res;
+	}
+	inode.mode = (inode.mode & S_IFMT) | (mode & 0777);
 
-	char inode_block[FS_BLOCK_SIZE];
-	memset(inode_block, 0, FS_BLOCK_SIZE);
-	memcpy(inode_block, &dir_inode, sizeof(dir_inode));
-	if (block_write(inode_block, dir_inum, 1) != 0) 
+	if (write_inode(inum, &inode) != 0) 
 	{
-		bit_clear(bitmap, dir_inum);
-		bit_clear(bitmap, data_block);
-		block_write(bitmap, 1, 1);
+		perror("In fs_chmod: block write failed");
 		return -EIO;
 	}
+	return 0;
+}
 
-	char dirents[FS_BLOCK_SIZE];
-	memset(dirents, 0, FS_BLOCK_SIZE);
-	if (block_write(dirents, data_block, 1) != 0)  
+int fs_utime(const char *path, struct utimbuf *ut)
+{
+	uint32_t inum;
+	struct fs_inode inode;
+	int res = translate(path, &inum, &inode);
+	if (res != 0) 
 	{
-		bit_clear(bitmap, dir_inum);
-		bit_clear(bitmap, data_block);
-		block_write(bitmap, 1, 1);
-		return -EIO;
+		perror("In fs_utime: translate failed");
+		return res;
 	}
+	inode.mtime = ut->modtime;
+	// there is no access time in the inode
 
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	if (write_inode(inum, &inode) != 0) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
-		{
-			return -EIO;
-		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
-		{
-			if (!entries[j].valid) 
-			{
-				entries[j].valid = 1;
-				entries[j].inode = dir_inum;
-				strncpy(entries[j].name, dirname, MAX_NAME_LEN);
-				entries[j].name[MAX_NAME_LEN - 1] = '\0';
-				if (block_write(block, parent_inode.ptrs[i], 1) != 0) 
-				{
-					return -EIO;
-				}
-				return 0;
-			}
-		}
+		perror("In fs_chmod: block write failed");
+		return -EIO;
 	}
-	free_components(components, num_components);
-	free_components(resolved_components, resolved_count);
-	return -EOPNOTSUPP;
+	return 0;
 }
 
-/* unlink - delete a file
- *  success - return 0
- *  errors - path resolution, ENOENT, EISDIR
+/* truncate - truncate file to exactly 'len' bytes
+ * success - return 0
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL
+ *    return EINVAL if len > 0.
  */
-int fs_unlink(const char *path)
+int fs_truncate(const char *path, off_t len)
 {
+	/* you can cheat by only implementing this for the case of len==0,
+	 * and an error otherwise.
+	 */
+	if (len != 0)
+	{
+		return -EINVAL;		/* invalid argument */
+	}
 	uint32_t inum;
 	struct fs_inode inode;
-	int inoderes = translate(path, &inum, &inode);
-	if (inoderes != 0) 
+	int res = translate(path, &inum, &inode);
+	if (res != 0) 
 	{
-		return inoderes;
+		return res;
 	}
 	if (S_ISDIR(inode.mode)) 
 	{
 		return -EISDIR;
 	}
 
-	char *components[MAX_PATH_LEN];
-	int num_components = pathparse(path, components);
-
-	char *resolved_components[MAX_PATH_LEN];
-	int resolved_count = resolve_path(components, num_components, resolved_components);
-
-	char *filename = resolved_components[resolved_count - 1];
-
-	char parent_path[256] = "/";
-	for (int i = 0; i < resolved_count - 1; i++) 
+	drop_delayed(inum);
+	struct blk_list freed = {0};
+	if (bmap_free(inum, &inode, &freed) != 0) // free the blocks used by the file, and preallocated ones
 	{
-		strcat(parent_path, resolved_components[i]);
-		if (i < resolved_count - 2) {
-			strcat(parent_path, "/");
-		}
-
+		free(freed.lba);
+		return -EIO;
 	}
+	set_file_size(&inode, 0);
+	inode.mtime = time(NULL);	
 
-	uint32_t parent_inum;
-	struct fs_inode parent_inode;
-	int res = translate(parent_path, &parent_inum, &parent_inode);
-	if (res != 0) 
+	// write the inode and the bitmap back, to the block cache before the discard
+	if (write_inode(inum, &inode) != 0 || isync(inum) != 0 || write_bitmap() != 0) 
 	{
-		return res;
+		free(freed.lba);
+		return -EIO;
 	}
+	discard_blocks(freed.lba, freed.n, 0);
+	free(freed.lba);
+	return 0;
+}
 
-	if (!S_ISDIR(parent_inode.mode)) 
+/* note a read of blocks [first, first+nblks) of file 'inum', and start
+ * readahead if it continues the previous one.
+ */
+static void readahead(uint32_t inum, const struct fs_inode *inode, int first, int nblks)
+{
+	int file_blocks = DIV_ROUND_UP(file_size(inode), FS_BLOCK_SIZE);
+	uint32_t ptrs[RA_MAX_BLOCKS];
+	int lba[RA_MAX_BLOCKS];
+	int n = 0, from = 0, to = 0;
+
+	pthread_mutex_lock(&ra_lock);
+	struct readahead *ra = &ra_table[inum % RA_SLOTS];
+	if (ra->inum != inum) 
 	{
-		return -ENOTDIR;
+		ra->inum = inum;
+		ra->next = -1;
+		ra->window = 0;
+		ra->end = 0;
 	}
 
-	int found = 0;
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	if (first == ra->next) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
-		{
-			return -EIO;
-		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
-		{
-			if (entries[j].valid && strcmp(entries[j].name, filename) == 0)
-			{
-				entries[j].valid = 0;
-				if (block_write(block, parent_inode.ptrs[i], 1) != 0) 
-				{
-					return -EIO;
-				}
-				found = 1;
-				break;
-			}
-		}
-		if (found) 
+		ra->window = ra->window ? MIN(ra->window * 2, RA_MAX_BLOCKS) : RA_MIN_BLOCKS;
+		if (ra->end - (first + nblks) < ra->window / 2) 
 		{
-			break;
+			from = MAX(first + nblks, ra->end);
+			to = MIN(first + nblks + ra->window, file_blocks);
+			ra->end = MAX(ra->end, to);
 		}
+	} 
+	else 
+	{
+		ra->window /= 2;
+		ra->end = 0;
 	}
+	ra->next = first + nblks;
+	pthread_mutex_unlock(&ra_lock);
 
-	int num_blocks = ceil((double)inode.size / FS_BLOCK_SIZE);
-	for (int i = 0; i < num_blocks; i++) 
+	if (to > from && bmap(inum, inode, from, to - from, ptrs) == 0) 
 	{
-		if (inode.ptrs[i]) 
+		for (int i = 0; i < to - from; i++) 
 		{
-			bit_clear(bitmap, inode.ptrs[i]);
+			if (ptrs[i]) 
+			{
+				lba[n++] = ptrs[i];
+			}
 		}
 	}
-	bit_clear(bitmap, inum);
-	if (block_write(bitmap, 1, 1) != 0) 
+	if (n > 0) 
 	{
-		return -EIO;
+		cache_prefetch(lba, n);
 	}
-
-	free_components(components, num_components);
-	free_components(resolved_components, resolved_count);
-	return 0;
 }
 
-/* rmdir - remove a directory
- *  success - return 0
- *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+/* read - read data from an open file.
+ * success: should return exactly the number of bytes requested, except:
+ *   - if offset >= file len, return 0
+ *   - if offset+len > file len, return #bytes from offset to end
+ *   - on error, return <0
+ * Errors - path resolution, ENOENT, EISDIR
  */
-int fs_rmdir(const char *path)
+int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
 	uint32_t inum;
 	struct fs_inode inode;
-	int inode_res = translate(path, &inum, &inode);
-	if (inode_res != 0) 
+	int res = translate(path, &inum, &inode);
+	if (res != 0) 
 	{
-		return inode_res;
+		return res;
 	}
-	if (!S_ISDIR(inode.mode)) 
+	if (!S_ISREG(inode.mode)) 
 	{
-		return -ENOTDIR;
+		return -EISDIR;
 	}
-
-	char block[FS_BLOCK_SIZE];
-	if (block_read(block, inode.ptrs[0], 1) != 0) // directory will have only one block
+	off_t size = file_size(&inode);
+	if (offset >= size) 
 	{
-		return -EIO;
+		return 0;
 	}
-	struct fs_dirent *entries = (struct fs_dirent *)block;
-	for (int i = 0; i < FS_BLOCK_SIZE / sizeof(struct fs_dirent); i++) 
+	if (offset + len > size) 
 	{
-		if (entries[i].valid) 
-		{
-			return -ENOTEMPTY;
-		}
+		len = size - offset;
 	}
-
-	char *components[MAX_PATH_LEN];
-	int num_components = pathparse(path, components);
-
-	char *resolved_components[MAX_PATH_LEN];
-	int resolved_count = resolve_path(components, num_components, resolved_components);
-
-	char *filename = resolved_components[resolved_count - 1];
-
-	char parent_path[256] = "/";
-	for (int i = 0; i < resolved_count - 1; i++) 
+	if (len == 0) 
 	{
-		strcat(parent_path, resolved_components[i]);
-		if (i < resolved_count - 2) {
-			strcat(parent_path, "/");
-		}
+		return 0;
 	}
-
-	uint32_t parent_inum;
-	struct fs_inode parent_inode;
-	int res = translate(parent_path, &parent_inum, &parent_inode);
-	if (res != 0) 
+	if (is_inline(&inode)) 
 	{
-		return res;
+		memcpy(buf, (char *)inode.ptrs + offset, len);
+		return len;
 	}
 
-	if (!S_ISDIR(parent_inode.mode)) 
+	/* Blocks entirely inside the request are read straight into 'buf';
+	 * only a partial first or last block goes through a bounce buffer.
+	 * Blocks without an address yet come from the delayed allocation
+	 * buffer, or are zero if they aren't there either.
+	 */
+	int first = offset / FS_BLOCK_SIZE;
+	int nblks = (offset + len - 1) / FS_BLOCK_SIZE - first + 1;
+	char head[FS_BLOCK_SIZE], tail[FS_BLOCK_SIZE];
+	struct delalloc *da = &da_table[inum % DA_SLOTS];
+	struct block_seg *segs = malloc(2 * nblks * sizeof(*segs));
+	uint32_t *lba = malloc(nblks * sizeof(uint32_t));
+	if (!segs || !lba || bmap(inum, &inode, first, nblks, lba) != 0) 
 	{
-		return -ENOTDIR;
+		free(segs);
+		free(lba);
+		return segs && lba ? -EIO : -ENOMEM;
+	}
+	struct block_seg *rd = segs + nblks;
+	int nrd = 0;
+	for (int i = 0; i < nblks; i++) 
+	{
+		off_t pos = (off_t)(first + i) * FS_BLOCK_SIZE;
+		segs[i].lba = lba[i];
+		if (pos < offset) 
+		{
+			segs[i].buf = head;
+		} 
+		else if (pos + FS_BLOCK_SIZE > offset + len) 
+		{
+			segs[i].buf = tail;
+		} 
+		else 
+		{
+			segs[i].buf = buf + (pos - offset);
+		}
 	}
 
-	int found = 0;
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	/* a hole may have been buffered data that another file's write
+	 * pushed out of the slot since bmap (and this file may even have
+	 * buffered more since): holes the slot doesn't hold are looked up
+	 * again.
+	 */
+	pthread_mutex_lock(&da_lock);
+	int mine = da->inum == inum;
+	int holes = 0;
+	for (int i = 0; i < nblks; i++) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
+		int blk = first + i;
+		int buffered = mine && blk >= da->first && blk < da->first + da->nblks;
+		holes += segs[i].lba == 0 && !buffered;
+	}
+	if (holes) 
+	{
+		if (read_inode(inum, &inode) != 0 || bmap(inum, &inode, first, nblks, lba) != 0) 
 		{
+			pthread_mutex_unlock(&da_lock);
+			free(segs);
+			free(lba);
 			return -EIO;
 		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
+		for (int i = 0; i < nblks; i++) 
 		{
-			if (entries[j].valid && strcmp(entries[j].name, filename) == 0)
-			{
-				entries[j].valid = 0;
-				if (block_write(block, parent_inode.ptrs[i], 1) != 0) 
-				{
-					return -EIO;
-				}
-				found = 1;
-				break;
-			}
+			segs[i].lba = lba[i];
 		}
-		if (found) 
+	}
+	free(lba);
+	for (int i = 0; i < nblks; i++) 
+	{
+		int blk = first + i;
+		if (mine && blk >= da->first && blk < da->first + da->nblks) 
 		{
-			break;
+			memcpy(segs[i].buf, da->data + (size_t)(blk - da->first) * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+		} 
+		else if (segs[i].lba == 0) 
+		{
+			memset(segs[i].buf, 0, FS_BLOCK_SIZE);
+		} 
+		else 
+		{
+			rd[nrd++] = segs[i];
 		}
 	}
+	pthread_mutex_unlock(&da_lock);
 
-	bit_clear(bitmap, inode.ptrs[0]);
-	bit_clear(bitmap, inum);
-	if (block_write(bitmap, 1, 1) != 0) 
+	readahead(inum, &inode, first, nblks);
+	if (cache_readv(rd, nrd, BLOCK_DATA) != 0) 
 	{
+		fprintf(stderr, "[fs_read]: block read failed\n");
+		free(segs);
 		return -EIO;
 	}
-	free_components(components, num_components);
-	free_components(resolved_components, resolved_count);
-	return 0;
+
+	if (segs[0].buf == head) 
+	{
+		int block_offset = offset % FS_BLOCK_SIZE;
+		memcpy(buf, head + block_offset, MIN(len, FS_BLOCK_SIZE - block_offset));
+	}
+	if (segs[nblks - 1].buf == tail) 
+	{
+		off_t pos = (off_t)(first + nblks - 1) * FS_BLOCK_SIZE;
+		memcpy(buf + (pos - offset), tail, offset + len - pos);
+	}
+	free(segs);
+	return len;
 }
 
-/* rename - rename a file or directory
- * success - return 0
- * Errors - path resolution, ENOENT, EINVAL, EEXIST
- *
- * ENOENT - source does not exist
- * EEXIST - destination already exists
- * EINVAL - source and destination are not in the same directory
- *
- * Note that this is a simplified version of the UNIX rename
- * functionality - see 'man 2 rename' for full semantics. In
- * particular, the full version can move across directories, replace a
- * destination file, and replace an empty directory with a full one.
+/* write - write data to a file
+ * success - return number of bytes written. (this will be the same as
+ *           the number requested, or else it's an error)
+ * Errors - path resolution, ENOENT, EISDIR
+ *  return EINVAL if 'offset' is greater than current file length.
+ *  (POSIX semantics support the creation of files with "holes" in them, 
+ *   but we don't)
  */
-int fs_rename(const char *src_path, const char *dst_path)
+int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
-	uint32_t src_inum;
-	struct fs_inode src_inode;
-	if (translate(src_path, &src_inum, &src_inode) != 0)
+	uint32_t inum;
+	struct fs_inode inode;
+	int inode_res = translate(path, &inum, &inode);
+	if (inode_res != 0) 
 	{
-		return -ENOENT;
+		return inode_res;
+	}
+	if (S_ISDIR(inode.mode)) 
+	{
+		return -EISDIR;
+	}
+	if (offset > file_size(&inode)) 
+	{
+		return -EINVAL;
+	}
+	if (DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE) > max_blocks()) 
+	{
+		return -EFBIG;
 	}
 
-	char *src_components[MAX_PATH_LEN], *dst_components[MAX_PATH_LEN];
-	int src_count = pathparse(src_path, src_components);
-	int dst_count = pathparse(dst_path, dst_components);
-
-	char *resolved_srcpath[MAX_PATH_LEN], *resolved_dstpath[MAX_PATH_LEN];
-	int resolved_count_src = resolve_path(src_components, src_count, resolved_srcpath);
-	int resolved_count_dst = resolve_path(dst_components, dst_count, resolved_dstpath);
-
-	char *src_name = resolved_srcpath[resolved_count_src - 1];
-	char *dst_name = resolved_dstpath[resolved_count_dst - 1];
-
-	char parent_src_path[256] = "/";
-	char parent_dst_path[256] = "/";
-
-	for (int i = 0; i < resolved_count_src - 1; i++) 
+	/* an inline file is written in its inode, as long as it fits */
+	if (is_inline(&inode) && offset + len <= FS_INLINE_MAX) 
 	{
-		strcat(parent_src_path, resolved_srcpath[i]);
-		if (i < resolved_count_src - 2) {
-			strcat(parent_src_path, "/");
+		memcpy((char *)inode.ptrs + offset, buf, len);
+		set_file_size(&inode, MAX(file_size(&inode), (off_t)(offset + len)));
+		inode.mtime = time(NULL);
+		if (write_inode(inum, &inode) != 0) 
+		{
+			return -EIO;
 		}
+		return len;
 	}
-	for (int i = 0; i < resolved_count_dst - 1; i++) 
+	if (is_inline(&inode)) 
 	{
-		strcat(parent_dst_path, resolved_dstpath[i]);
-		if (i < resolved_count_dst - 2) {
-			strcat(parent_dst_path, "/");
+		int rv = inline_spill(inum, &inode);
+		if (rv != 0) 
+		{
+			return rv;
 		}
 	}
 
-	uint32_t src_parent_inum, dst_parent_inum;
-	struct fs_inode parent_inode;
-
-	if (translate(parent_src_path, &src_parent_inum, &parent_inode) != 0 ||
-			translate(parent_dst_path, &dst_parent_inum, &parent_inode) != 0) {
-		return -ENOENT;
+	/* appends past the allocated blocks are only buffered (see
+	 * da_table); anything else is written in place, once the file's
+	 * buffered data has blocks of its own.
+	 */
+	int buffered = len > 0 ? delay_write(inum, &inode, buf, len, offset) : 0;
+	if (buffered < 0) 
+	{
+		return buffered;
 	}
-
-	if (src_parent_inum != dst_parent_inum) {
-		return -EINVAL;
+	if (!buffered) 
+	{
+		int res = flush_delayed(inum);
+		if (res < 0 || (res > 0 && read_inode(inum, &inode) != 0)) 
+		{
+			return -EIO;
+		}
 	}
 
-	if (!S_ISDIR(parent_inode.mode)) 
+	size_t new_size = offset + len;
+	uint32_t new_blocks = (uint32_t)ceil((double)new_size / FS_BLOCK_SIZE); // how many blocks are needed for the new size
+	uint32_t current_blocks = (uint32_t)ceil((double)file_size(&inode) / FS_BLOCK_SIZE); // how many blocks are currently used by the file
+	uint32_t allocated = alloc_count(inum, &inode); // ... and how many it has, counting preallocated ones
+	uint32_t new_blocks_needed = 0; // unsigned - don't let an overwrite go negative
+	if (new_blocks > allocated) 
 	{
-		return -ENOTDIR;
+		new_blocks_needed = new_blocks - allocated;
 	}
 
-	struct fs_dirent *src_entry = NULL;
-	struct fs_dirent *dst_entry = NULL;
+	/* the new blocks go right after the file's last block if they can,
+	 * or after its inode for the first ones (see bmap_alloc)
+	 */
+	if (!buffered && new_blocks_needed > 0) 
+	{
+		uint32_t *lba = malloc(new_blocks_needed * sizeof(uint32_t));
+		int rv = lba ? bmap_alloc(inum, &inode, allocated, new_blocks_needed, lba) : -ENOMEM;
+		free(lba);
+		if (rv != 0) 
+		{
+			/* whatever did get mapped stays, as preallocated blocks */
+			write_inode(inum, &inode);
+			write_bitmap();
+			return rv;
+		}
+	}
 
-	for (int i = 0; i < parent_inode.size / FS_BLOCK_SIZE; i++) 
+	/* As in fs_read: whole blocks are written straight from 'buf'. A
+	 * partial first or last block that already holds data is read in
+	 * first (one vectored read for both), a new one starts out zeroed.
+	 */
+	size_t bytes_written = len;
+	int filled = 0;		/* blocks inside the file were allocated */
+	if (len > 0 && !buffered) 
 	{
-		char block[FS_BLOCK_SIZE];
-		if (block_read(block, parent_inode.ptrs[i], 1) != 0) 
+		int first = offset / FS_BLOCK_SIZE;
+		int nblks = (offset + len - 1) / FS_BLOCK_SIZE - first + 1;
+		char head[FS_BLOCK_SIZE], tail[FS_BLOCK_SIZE];
+		struct block_seg rmw[2];
+		int nrmw = 0;
+		struct block_seg *segs = malloc(nblks * sizeof(*segs));
+		uint32_t *lba = malloc(nblks * sizeof(uint32_t));
+		if (!segs || !lba || bmap(inum, &inode, first, nblks, lba) != 0) 
 		{
-			fprintf(stderr, "[fs_rename]: block read failed\n");
-			return -EIO;
+			free(segs);
+			free(lba);
+			return segs && lba ? -EIO : -ENOMEM;
 		}
-		struct fs_dirent *entries = (struct fs_dirent *)block;
-		for (int j = 0; j < FS_BLOCK_SIZE / sizeof(struct fs_dirent); j++) 
+		for (int i = 0; i < nblks; i++) 
 		{
-			if (!entries[j].valid) 
+			off_t pos = (off_t)(first + i) * FS_BLOCK_SIZE;
+			segs[i].lba = lba[i];
+			if (pos >= offset && pos + FS_BLOCK_SIZE <= offset + len) 
 			{
+				segs[i].buf = (char *)buf + (pos - offset);
 				continue;
 			}
-			if (strcmp(entries[j].name, src_name) == 0) 
+			segs[i].buf = (pos < offset) ? head : tail;
+			if (first + i < current_blocks && lba[i] != 0) 
 			{
-				src_entry = &entries[j];
+				rmw[nrmw++] = segs[i];
 			} 
-			else if (strcmp(entries[j].name, dst_name) == 0) 
+			else 
 			{
-				dst_entry = &entries[j];
+				memset(segs[i].buf, 0, FS_BLOCK_SIZE);
 			}
 		}
 
-		if (src_entry && dst_entry) 
+		/* a block inside the file may still have no address (if its
+		 * delayed allocation failed): it is allocated now, as block 0
+		 * must never be written
+		 */
+		for (int i = 0; i < nblks; ) 
 		{
-			return -EEXIST;
+			int j = i;
+			while (j < nblks && lba[j] == 0) 
+			{
+				j++;
+			}
+			if (j == i) 
+			{
+				i++;
+				continue;
+			}
+			int rv = bmap_alloc(inum, &inode, first + i, j - i, lba + i);
+			if (rv != 0) 
+			{
+				write_inode(inum, &inode);
+				write_bitmap();
+				free(segs);
+				free(lba);
+				return rv;
+			}
+			for (; i < j; i++) 
+			{
+				segs[i].lba = lba[i];
+			}
+			filled = 1;
 		}
+		free(lba);
 
-		if (src_entry && !dst_entry) 
+		if (nrmw > 0 && cache_readv(rmw, nrmw, BLOCK_DATA) != 0) 
 		{
-			strncpy(src_entry->name, dst_name, MAX_NAME_LEN); // Rename source entry
-			src_entry->name[MAX_NAME_LEN - 1] = '\0'; // Ensure null termination
-
-			if (block_write(block, parent_inode.ptrs[i], 1) != 0) 
-			{
-				fprintf(stderr, "[fs_rename]: block write failed\n");
-				return -EIO;
-			}
+			free(segs);
+			return -EIO;
+		}
+		if (segs[0].buf == head) 
+		{
+			int block_offset = offset % FS_BLOCK_SIZE;
+			memcpy(head + block_offset, buf, MIN(len, FS_BLOCK_SIZE - block_offset));
+		}
+		if (segs[nblks - 1].buf == tail) 
+		{
+			off_t pos = (off_t)(first + nblks - 1) * FS_BLOCK_SIZE;
+			memcpy(tail, buf + (pos - offset), offset + len - pos);
+		}
 
-			free_components(src_components, src_count);
-			free_components(dst_components, dst_count);
-			free_components(resolved_srcpath, resolved_count_src); 
-			free_components(resolved_dstpath, resolved_count_dst);
-			return 0;
+		int rv = cache_writev(segs, nblks, BLOCK_DATA);
+		free(segs);
+		if (rv != 0) 
+		{
+			return -EIO;
 		}
 	}
 
-	return -EOPNOTSUPP;
+	set_file_size(&inode, MAX(file_size(&inode), (off_t)new_size));
+	inode.mtime = time(NULL);
+	if (write_inode(inum, &inode) != 0) 
+	{
+		return -EIO;
+	}
+
+	if ((new_blocks_needed > 0 && !buffered) || filled) {
+		if (write_bitmap() != 0) return -EIO;
+	}
+	return bytes_written;
 }
 
-/* chmod - change file permissions
- * utime - change access and modification times
- *         (for definition of 'struct utimebuf', see 'man utime')
- *
- * success - return 0
- * Errors - path resolution, ENOENT.
+/* statfs - get file system statistics
+ * see 'man 2 statfs' for description of 'struct statvfs'.
+ * Errors - none. Needs to work.
  */
-int fs_chmod(const char *path, mode_t mode)
+int fs_statfs(const char *path, struct statvfs *st)
 {
-	uint32_t inum;
-	struct fs_inode inode;
-	int res = translate(path, &inum, &inode);
-	if (res != 0) 
-	{
-		perror("In fs_chmod: translate failed");
-		return res;
-	}
-	inode.mode = (inode.mode & S_IFMT) | (mode & 0777);
-	char block[FS_BLOCK_SIZE];
-	memcpy(block, &inode, sizeof(inode));
-
-	inode.mtime = time(NULL);
+	/* needs to return the following fields (set others to zero):
+	 *   f_bsize = BLOCK_SIZE
+	 *   f_blocks = total image - (superblock + block map)
+	 *   f_bfree = f_blocks - blocks used
+	 *   f_bavail = f_bfree
+	 *   f_namemax = <whatever your max namelength is>
+	 *
+	 * The count of blocks in use is kept up to date by set_used and
+	 * set_free; build with -DFS_DEBUG to check it against a recount.
+	 * Blocks reserved for delayed allocation aren't free either.
+	 */
+	memset(st, 0, sizeof(struct statvfs)); // To zero the structure's other values
+	st->f_bsize = FS_BLOCK_SIZE;
+	int total_blocks = superblock.disk_size;
+	int metadata_blocks = 1 + bitmap_nblks; // superblock + bitmap blocks
+	st->f_blocks = total_blocks - metadata_blocks;
 
-	if (block_write(block, inum, 1) != 0) 
-	{
-		perror("In fs_chmod: block write failed");
-		return -EIO;
-	}
+#ifdef FS_DEBUG
+	assert(__atomic_load_n(&used_blocks, __ATOMIC_RELAXED) == count_used());
+#endif
+	st->f_bfree = st->f_blocks - __atomic_load_n(&used_blocks, __ATOMIC_RELAXED) -
+		__atomic_load_n(&reserved_blocks, __ATOMIC_RELAXED);
+	st->f_bavail = st->f_bfree;
+	st->f_namemax = MAX_NAME_LEN;
 	return 0;
 }
 
-int fs_utime(const char *path, struct utimbuf *ut)
+/* write back the cached blocks of one file: its inode (and extent tree),
+ * its data blocks and the bitmap blocks that record them as allocated.
+ * Buffered data gets its blocks first.
+ */
+static int sync_file(const char *path)
 {
 	uint32_t inum;
 	struct fs_inode inode;
 	int res = translate(path, &inum, &inode);
 	if (res != 0) 
 	{
-		perror("In fs_utime: translate failed");
 		return res;
 	}
-	inode.mtime = ut->modtime;
-	// there is no access time in the inode
-	char block[FS_BLOCK_SIZE];
-	memcpy(block, &inode, sizeof(inode));
-
-	if (block_write(block, inum, 1) != 0) 
+	res = flush_delayed(inum);
+	if (res < 0 || (res > 0 && read_inode(inum, &inode) != 0)) 
 	{
-		perror("In fs_chmod: block write failed");
 		return -EIO;
 	}
-	return 0;
-}
 
-/* truncate - truncate file to exactly 'len' bytes
- * success - return 0
- * Errors - path resolution, ENOENT, EISDIR, EINVAL
- *    return EINVAL if len > 0.
- */
-int fs_truncate(const char *path, off_t len)
-{
-	/* you can cheat by only implementing this for the case of len==0,
-	 * and an error otherwise.
-	 */
-	if (len != 0)
+	if (isync(inum) != 0) 
 	{
-		return -EINVAL;		/* invalid argument */
+		return -EIO;
 	}
-	uint32_t inum;
-	struct fs_inode inode;
-	int res = translate(path, &inum, &inode);
-	if (res != 0) 
+
+	/* the file's data blocks, then its indirect blocks (or extent tree) */
+	int nblks = alloc_count(inum, &inode);
+	struct blk_list blks = {malloc(MAX(nblks, 1) * sizeof(uint32_t)), nblks, nblks};
+	res = blks.lba ? bmap(inum, &inode, 0, nblks, blks.lba) : -ENOMEM;
+	if (res == 0) 
 	{
-		return res;
+		res = indirect_blocks(&inode, &blks);
 	}
-	if (S_ISDIR(inode.mode)) 
+	int *lba = res == 0 ? malloc((2 * (blks.n + 1) + 1) * sizeof(int)) : NULL;
+	int n = 0;
+	if (!lba) 
 	{
-		return -EISDIR;
+		free(blks.lba);
+		return res ? res : -ENOMEM;
 	}
-
-	int num_blocks = (int)ceil((double)inode.size / FS_BLOCK_SIZE); // find number of blocks used by the file
-	for (int i = 0; i < num_blocks; i++) // clear the blocks used by the file
+	lba[n++] = inode_lba(inum);
+	for (int i = 0; i < blks.n; i++) 
 	{
-		if (inode.ptrs[i]) 
-		{
-			bit_clear(bitmap, inode.ptrs[i]);
-		}
+		lba[n++] = blks.lba[i];
 	}
-	memset(inode.ptrs, 0, sizeof(inode.ptrs)); // clear the pointers to the blocks
-	inode.size = 0;
-	inode.mtime = time(NULL);	
-
-	char inode_block[FS_BLOCK_SIZE];
-	memcpy(inode_block, &inode, sizeof(inode));
-	if (block_write(inode_block, inum, 1) != 0) // write the inode back
+	free(blks.lba);
+	for (int i = 0, nb = n; i < nb; i++) 
 	{
-		return -EIO;
+		lba[n++] = 1 + lba[i] / FS_BITS_PER_BLOCK;
 	}
-	if (block_write(bitmap, 1, 1) != 0)  // write the bitmap back
+	if (dense) 
 	{
-		return -EIO;
+		lba[n++] = superblock.inode_map + inum / FS_BITS_PER_BLOCK;
 	}
+	res = cache_sync(lba, n);
+	free(lba);
+	return res;
+}
 
-	return 0;
+/* flush - called on each close() of a file. Hands the file's dirty
+ * blocks to the block layer, so other processes reading the image see
+ * them.
+ * Errors - path resolution, EIO
+ */
+int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	return sync_file(path);
 }
 
-/* read - read data from an open file.
- * success: should return exactly the number of bytes requested, except:
- *   - if offset >= file len, return 0
- *   - if offset+len > file len, return #bytes from offset to end
- *   - on error, return <0
- * Errors - path resolution, ENOENT, EISDIR
+/* fsync - make a file's contents durable: write back its blocks, then
+ * flush the image to stable storage. Blocks of other files stay in the
+ * cache. 'datasync' makes no difference, since the inode has to be
+ * written anyway to find the data.
+ * Errors - path resolution, EIO
  */
-int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-	uint32_t inum;
-	struct fs_inode inode;
-	int res = translate(path, &inum, &inode);
+	int res = sync_file(path);
 	if (res != 0) 
 	{
 		return res;
 	}
-	if (!S_ISREG(inode.mode)) 
-	{
-		return -EISDIR;
-	}
-	if (offset >= inode.size) 
-	{
-		return 0;
-	}
-	if (offset + len > inode.size) 
-	{
-		len = inode.size - offset;
-	}
+	return block_flush() == 0 ? 0 : -EIO;
+}
 
-	size_t bytes_read = 0;
-	while (bytes_read < len) 
+/* release - last close of a file. Allocate blocks for any data still
+ * buffered and forget its readahead state.
+ * Errors - EIO
+ */
+int fs_release(const char *path, struct fuse_file_info *fi)
+{
+	uint32_t inum;
+	struct fs_inode inode;
+	if (translate(path, &inum, &inode) == 0) 
 	{
-		int block_index = (offset + bytes_read) / FS_BLOCK_SIZE;
-		int block_offset = (offset + bytes_read) % FS_BLOCK_SIZE;
-		uint32_t block = inode.ptrs[block_index];
-		char block_data[FS_BLOCK_SIZE];
-		if (block_read(block_data, block, 1) != 0) 
+		if (flush_delayed(inum) < 0) 
 		{
-			fprintf(stderr, "[fs_read]: block read failed\n");
 			return -EIO;
 		}
-
-		size_t copy_len = FS_BLOCK_SIZE - block_offset;
-		if (copy_len > len - bytes_read) 
+		pthread_mutex_lock(&ra_lock);
+		if (ra_table[inum % RA_SLOTS].inum == inum) 
 		{
-			copy_len = len - bytes_read;
+			ra_table[inum % RA_SLOTS].inum = 0;
 		}
-		memcpy(buf + bytes_read, block_data + block_offset, copy_len);
-		bytes_read += copy_len;
+		pthread_mutex_unlock(&ra_lock);
 	}
-	return bytes_read;
+	return 0;
 }
 
-/* write - write data to a file
- * success - return number of bytes written. (this will be the same as
- *           the number requested, or else it's an error)
- * Errors - path resolution, ENOENT, EISDIR
- *  return EINVAL if 'offset' is greater than current file length.
- *  (POSIX semantics support the creation of files with "holes" in them, 
- *   but we don't)
+/* fallocate - allocate the blocks for bytes [offset, offset+len) of a
+ * file ahead of time, in as few extents as possible, so that writes
+ * there don't have to. Unless 'mode' is FALLOC_FL_KEEP_SIZE the file
+ * is extended to offset+len if it is shorter, and the new part reads
+ * as zeros; with it, blocks past the end of the file are kept for later
+ * appends.
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EOPNOTSUPP (any
+ *   other mode), EFBIG, ENOSPC, EIO
  */
-int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+int fs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
 {
+	if (mode & ~FALLOC_FL_KEEP_SIZE) 
+	{
+		return -EOPNOTSUPP;
+	}
+	if (offset < 0 || len <= 0) 
+	{
+		return -EINVAL;
+	}
 	uint32_t inum;
 	struct fs_inode inode;
-	int inode_res = translate(path, &inum, &inode);
-	if (inode_res != 0) 
+	int res = translate(path, &inum, &inode);
+	if (res != 0) 
 	{
-		return inode_res;
+		return res;
 	}
 	if (S_ISDIR(inode.mode)) 
 	{
 		return -EISDIR;
 	}
-	if (offset > inode.size) 
+	if (DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE) > max_blocks()) 
 	{
-		return -EINVAL;
+		return -EFBIG;
 	}
 
-	size_t new_size = offset + len;
-	uint32_t new_blocks = (uint32_t)ceil((double)new_size / FS_BLOCK_SIZE); // how many blocks are needed for the new size
-	uint32_t current_blocks = (uint32_t)ceil((double)inode.size / FS_BLOCK_SIZE); // how many blocks are currently used by the file
-	uint32_t new_blocks_needed = new_blocks - current_blocks;
-	if (new_blocks_needed < 0) 
+	/* buffered data needs its blocks first, so the new ones follow them */
+	res = flush_delayed(inum);
+	if (res < 0 || (res > 0 && read_inode(inum, &inode) != 0)) 
 	{
-		new_blocks_needed = 0;
+		return -EIO;
 	}
 
-	if (new_blocks_needed > 0) // if new allocation needed
+	if (is_inline(&inode) && offset + len <= FS_INLINE_MAX) 
 	{
-		for (int i = 0; i < new_blocks_needed; i++) 
+		if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > file_size(&inode)) 
 		{
-			uint32_t new_block = 0;
-			for (uint32_t j = 2; j < superblock.disk_size; j++)  // start from 2 to skip superblock and bitmap
-			{
-				if (!bit_test(bitmap, j)) 
-				{
-					new_block = j;
-					break;
-				}
-			}
-
-			if (new_block == 0) {
-				return -ENOSPC;
-			}
-
-			bit_set(bitmap, new_block);
-			inode.ptrs[current_blocks + i] = new_block; // assign new block to inode
+			set_file_size(&inode, offset + len);	/* the rest of ptrs[] is zeros */
+			inode.mtime = time(NULL);
 		}
+		return write_inode(inum, &inode) != 0 ? -EIO : 0;
 	}
-
-	size_t bytes_written = 0;
-	while (bytes_written < len) 
+	if (is_inline(&inode) && (res = inline_spill(inum, &inode)) != 0) 
 	{
-		int block_index = (offset + bytes_written) / FS_BLOCK_SIZE;
-		int block_offset = (offset + bytes_written) % FS_BLOCK_SIZE;
-		uint32_t block = inode.ptrs[block_index];
-		char block_data[FS_BLOCK_SIZE];
-		uint32_t block_len = MIN(len - bytes_written, FS_BLOCK_SIZE - block_offset); // minimum of remaining bytes to write and space remaining in current block
+		return res;
+	}
 
-		if (block_offset > 0 || block_len < FS_BLOCK_SIZE) 
+	int end = DIV_ROUND_UP(offset + len, FS_BLOCK_SIZE);
+	int allocated = alloc_count(inum, &inode);
+	if (end > allocated) 
+	{
+		uint32_t *lba = malloc((end - allocated) * sizeof(uint32_t));
+		res = lba ? bmap_alloc(inum, &inode, allocated, end - allocated, lba) : -ENOMEM;
+		free(lba);
+		if (res != 0) 
 		{
-			if (block_read(block_data, block, 1) != 0) 
-			{
-				return -EIO;
-			}
+			write_inode(inum, &inode);
+			write_bitmap();
+			return res;
 		}
+	}
 
-		memcpy(block_data + block_offset, buf + bytes_written, block_len); // copy data to the block
-		if (block_write(block_data, inode.ptrs[block_index], 1) != 0) 
+	/* blocks that become part of the file may hold anything: zero them */
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > file_size(&inode)) 
+	{
+		static char zeros[FS_BLOCK_SIZE];
+		int first = DIV_ROUND_UP(file_size(&inode), FS_BLOCK_SIZE);
+		struct block_seg *segs = malloc((end - first) * sizeof(*segs));
+		uint32_t *lba = malloc((end - first) * sizeof(uint32_t));
+		if (!segs || !lba || bmap(inum, &inode, first, end - first, lba) != 0) 
+		{
+			free(segs);
+			free(lba);
+			return segs && lba ? -EIO : -ENOMEM;
+		}
+		for (int i = first; i < end; i++) 
+		{
+			segs[i - first].lba = lba[i - first];
+			segs[i - first].buf = zeros;
+		}
+		res = cache_writev(segs, end - first, BLOCK_DATA);
+		free(segs);
+		free(lba);
+		if (res != 0) 
 		{
 			return -EIO;
 		}
-
-		bytes_written += block_len;
+		set_file_size(&inode, offset + len);
+		inode.mtime = time(NULL);
 	}
 
-	inode.size = MAX(inode.size, new_size);
-	inode.mtime = time(NULL);
-	char inode_block[FS_BLOCK_SIZE];
-	memcpy(inode_block, &inode, sizeof(inode));
-	if (block_write(inode_block, inum, 1) != 0) 
+	if (write_inode(inum, &inode) != 0 || write_bitmap() != 0) 
 	{
 		return -EIO;
 	}
-
-	if (new_blocks > current_blocks) {
-		if (block_write(bitmap, 1, 1) != 0) return -EIO;
-	}
-	return bytes_written;
+	return 0;
 }
 
-/* statfs - get file system statistics
- * see 'man 2 statfs' for description of 'struct statvfs'.
- * Errors - none. Needs to work.
+/* The operations as FUSE sees them: each one is timed and counted, and
+ * STATS_FILE - a read-only file that isn't in any directory - is
+ * handled here before the path ever reaches translate().
  */
-int fs_statfs(const char *path, struct statvfs *st)
+#define TIMED(op, call) ({						\
+	struct stat_timer t_;						\
+	stats_begin(&t_, op);						\
+	int rv_ = (call);						\
+	stats_end(&t_, rv_, ((op) == OP_READ || (op) == OP_WRITE) && rv_ > 0 ? rv_ : 0); \
+	rv_; })
+
+/* lock_file - take the file lock of the file 'path' names, and set
+ * *inum to it. The lookup is repeated with the lock held: a file's name
+ * is only taken away by operations that hold its lock, so if both
+ * agree the fs_ function called next finds the same file.
+ *  success - return 0
+ *  errors - path resolution
+ */
+static int lock_file(const char *path, uint32_t *inum)
 {
-	/* needs to return the following fields (set others to zero):
-	 *   f_bsize = BLOCK_SIZE
-	 *   f_blocks = total image - (superblock + block map)
-	 *   f_bfree = f_blocks - blocks used
-	 *   f_bavail = f_bfree
-	 *   f_namemax = <whatever your max namelength is>
-	 *
-	 * it's OK to calculate this dynamically on the rare occasions
-	 * when this function is called.
-	 */
-	memset(st, 0, sizeof(struct statvfs)); // To zero the structure's other values
-	st->f_bsize = FS_BLOCK_SIZE;
-	int total_blocks = superblock.disk_size;
-	int metadata_blocks = 1 + 1; // 1 for superblock + 1 bitmap block
-	st->f_blocks = total_blocks - metadata_blocks;
-
-	int used_blocks = 0;
-	for (int i = 0; i < superblock.disk_size; i++) 
+	struct fs_inode inode;
+	for (;;) 
 	{
-		if (bit_test(bitmap, i)) 
+		uint32_t again;
+		int rv = translate(path, inum, &inode);
+		if (rv != 0) 
 		{
-			used_blocks++;
+			return rv;
 		}
+		pthread_mutex_lock(file_lock(*inum));
+		if (translate(path, &again, &inode) == 0 && again == *inum) 
+		{
+			return 0;
+		}
+		pthread_mutex_unlock(file_lock(*inum));
 	}
-	st->f_bfree = st->f_blocks - used_blocks;
-	st->f_bavail = st->f_bfree;
-	st->f_namemax = MAX_NAME_LEN;
+}
+
+/* 'call', with the file lock of 'path' held, or the error finding it */
+#define FILE_LOCKED(path, call) ({					\
+	uint32_t inum_;							\
+	int lrv_ = lock_file(path, &inum_);				\
+	if (lrv_ == 0)							\
+	{								\
+		lrv_ = (call);						\
+		pthread_mutex_unlock(file_lock(inum_));			\
+	}								\
+	lrv_; })
+
+/* 'call', with ns_lock held */
+#define NS_LOCKED(call) ({						\
+	pthread_mutex_lock(&ns_lock);					\
+	int nrv_ = (call);						\
+	pthread_mutex_unlock(&ns_lock);					\
+	nrv_; })
+
+static int is_stats(const char *path)
+{
+	return strcmp(path, STATS_FILE) == 0;
+}
+
+static int stats_getattr(struct stat *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->st_mode = S_IFREG | 0444;
+	sb->st_nlink = 1;
+	sb->st_size = stats_report(NULL, 0);
+	sb->st_atime = sb->st_mtime = sb->st_ctime = time(NULL);
 	return 0;
 }
 
+static int stats_read(char *buf, size_t len, off_t offset)
+{
+	int size = stats_report(NULL, 0) + 1;
+	char *text = malloc(size);
+	if (!text) 
+	{
+		return -ENOMEM;
+	}
+	size = MIN(stats_report(text, size), size - 1);
+	int n = offset >= size ? 0 : MIN(len, size - offset);
+	memcpy(buf, text + offset, n);
+	free(text);
+	return n;
+}
+
+static int op_getattr(const char *path, struct stat *sb)
+{
+	return TIMED(OP_GETATTR, is_stats(path) ? stats_getattr(sb) : fs_getattr(path, sb));
+}
+
+static int op_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	return TIMED(OP_READDIR, is_stats(path) ? -ENOTDIR : fs_readdir(path, ptr, filler, offset, fi));
+}
+
+static int op_rename(const char *src_path, const char *dst_path)
+{
+	return TIMED(OP_RENAME, is_stats(src_path) || is_stats(dst_path) ? -EACCES : NS_LOCKED(fs_rename(src_path, dst_path)));
+}
+
+static int op_chmod(const char *path, mode_t mode)
+{
+	return TIMED(OP_CHMOD, is_stats(path) ? -EACCES : NS_LOCKED(FILE_LOCKED(path, fs_chmod(path, mode))));
+}
+
+static int op_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	return TIMED(OP_READ, is_stats(path) ? stats_read(buf, len, offset) : fs_read(path, buf, len, offset, fi));
+}
+
+static int op_statfs(const char *path, struct statvfs *st)
+{
+	return TIMED(OP_STATFS, fs_statfs(path, st));
+}
+
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	return TIMED(OP_CREATE, is_stats(path) ? -EEXIST : NS_LOCKED(fs_create(path, mode, fi)));
+}
+
+static int op_mkdir(const char *path, mode_t mode)
+{
+	return TIMED(OP_MKDIR, is_stats(path) ? -EEXIST : NS_LOCKED(fs_mkdir(path, mode)));
+}
+
+static int op_unlink(const char *path)
+{
+	return TIMED(OP_UNLINK, is_stats(path) ? -EACCES : NS_LOCKED(FILE_LOCKED(path, fs_unlink(path))));
+}
+
+static int op_rmdir(const char *path)
+{
+	return TIMED(OP_RMDIR, is_stats(path) ? -ENOTDIR : NS_LOCKED(FILE_LOCKED(path, fs_rmdir(path))));
+}
+
+static int op_utime(const char *path, struct utimbuf *ut)
+{
+	return TIMED(OP_UTIME, is_stats(path) ? -EACCES : NS_LOCKED(FILE_LOCKED(path, fs_utime(path, ut))));
+}
+
+static int op_truncate(const char *path, off_t len)
+{
+	return TIMED(OP_TRUNCATE, is_stats(path) ? -EACCES : FILE_LOCKED(path, fs_truncate(path, len)));
+}
+
+static int op_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	return TIMED(OP_WRITE, is_stats(path) ? -EACCES : FILE_LOCKED(path, fs_write(path, buf, len, offset, fi)));
+}
+
+static int op_flush(const char *path, struct fuse_file_info *fi)
+{
+	return TIMED(OP_FLUSH, is_stats(path) ? 0 : FILE_LOCKED(path, fs_flush(path, fi)));
+}
+
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return TIMED(OP_FSYNC, is_stats(path) ? 0 : FILE_LOCKED(path, fs_fsync(path, datasync, fi)));
+}
+
+/* like fs_release, a file that can't be found is no error */
+static int release_locked(const char *path, struct fuse_file_info *fi)
+{
+	int rv = FILE_LOCKED(path, fs_release(path, fi));
+	return rv == -EIO ? rv : 0;
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi)
+{
+	return TIMED(OP_RELEASE, is_stats(path) ? 0 : release_locked(path, fi));
+}
+
+static int op_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+	return TIMED(OP_FALLOCATE, is_stats(path) ? -EACCES : FILE_LOCKED(path, fs_fallocate(path, mode, offset, len, fi)));
+}
+
 /* operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
 	.init = fs_init,            /* read-mostly operations */
-	.getattr = fs_getattr,
-	.readdir = fs_readdir,
-	.rename = fs_rename,
-	.chmod = fs_chmod,
-	.read = fs_read,
-	.statfs = fs_statfs,
-
-	.create = fs_create,        /* write operations */
-	.mkdir = fs_mkdir,
-	.unlink = fs_unlink,
-	.rmdir = fs_rmdir,
-	.utime = fs_utime,
-	.truncate = fs_truncate,
-	.write = fs_write,
+	.destroy = fs_destroy,
+	.getattr = op_getattr,
+	.readdir = op_readdir,
+	.rename = op_rename,
+	.chmod = op_chmod,
+	.read = op_read,
+	.statfs = op_statfs,
+
+	.create = op_create,        /* write operations */
+	.mkdir = op_mkdir,
+	.unlink = op_unlink,
+	.rmdir = op_rmdir,
+	.utime = op_utime,
+	.truncate = op_truncate,
+	.write = op_write,
+	.flush = op_flush,
+	.fsync = op_fsync,
+	.release = op_release,
+	.fallocate = op_fallocate,
 };
-
@@ -8,11 +8,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <fuse.h>
 
 #include "fs5600.h"
 
-extern void block_init(char *file);
+extern void block_init_backend(char *file, const char *backend);
+extern void block_counts(uint64_t *reads, uint64_t *writes, uint64_t *syscalls);
+extern void cache_set_size(int nblocks);
+extern int cache_set_policy(const char *name);
+extern void cache_counts(uint64_t *hits, uint64_t *misses, uint64_t *writebacks);
+extern void cache_ra_counts(uint64_t *prefetched, uint64_t *used);
+extern void stats_dump(FILE *fp);
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -21,6 +28,9 @@ extern struct fuse_operations fs_ops;
 
 struct data {
     char *image_name;
+    char *backend;
+    int   cache_blocks;
+    char *cache_policy;
     int   part;
     int   cmd_mode;
 } _data;
@@ -31,12 +41,24 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [-backend name] [-cache N]
+ *                    [-cache-policy P] directory
  *              disk.img  - name of the image file to mount
+ *              name      - block device backend: file (default),
+ *                          uring (io_uring), mmap (image mapped, blocks
+ *                          read in place) or ram (image loaded into
+ *                          memory, changes are lost at unmount)
+ *              N         - block cache size in 4 KB blocks (0 = none)
+ *              P         - cache replacement policy: 2q (default; file
+ *                          data has to be reused to displace metadata)
+ *                          or lru
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-backend %s", offsetof(struct data, backend), 0},
+    {"-cache %d", offsetof(struct data, cache_blocks), 0},
+    {"-cache-policy %s", offsetof(struct data, cache_policy), 0},
     FUSE_OPT_END
 };
 
@@ -45,10 +67,33 @@ int main(int argc, char **argv)
     /* Argument processing and checking
      */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.cache_blocks = -1;
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
 	exit(1);
 
-    block_init(_data.image_name);
+    block_init_backend(_data.image_name, _data.backend);
+    if (_data.cache_blocks >= 0)
+        cache_set_size(_data.cache_blocks);
+    if (_data.cache_policy && cache_set_policy(_data.cache_policy) < 0) {
+        fprintf(stderr, "unknown cache policy: %s\n", _data.cache_policy);
+        exit(1);
+    }
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int rv = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+
+    uint64_t reads, writes, syscalls, hits, misses, writebacks, ra, ra_used;
+    block_counts(&reads, &writes, &syscalls);
+    cache_counts(&hits, &misses, &writebacks);
+    cache_ra_counts(&ra, &ra_used);
+    fprintf(stderr, "block I/O: %llu reads, %llu writes, %llu syscalls\n",
+            (unsigned long long)reads, (unsigned long long)writes,
+            (unsigned long long)syscalls);
+    fprintf(stderr, "block cache: %llu hits, %llu misses, %llu written back\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)writebacks);
+    fprintf(stderr, "readahead: %llu blocks prefetched, %llu used (%.1f%%)\n",
+            (unsigned long long)ra, (unsigned long long)ra_used,
+            ra ? 100.0 * ra_used / ra : 0.0);
+    stats_dump(stderr);
+    return rv;
 }
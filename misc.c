@@ -6,7 +6,7 @@
  * CS 5600, Computer Systems, Northeastern
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
@@ -17,57 +17,734 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
-#include "fs5600.h"		/* only for FS_BLOCK_SIZE */
+#include "fs5600.h"		/* FS_BLOCK_SIZE, struct block_seg */
 
-/*********** DO NOT MODIFY THIS FILE *************/
+extern void stats_begin(struct stat_timer *t, int op);
+extern void stats_end(struct stat_timer *t, int rv, uint64_t bytes);
 
-/* All disk I/O is accessed through these functions
+/* All disk I/O is accessed through these functions. Transfers use
+ * pread/pwrite, which carry their own offset, so there is no shared
+ * file position and any number of threads may call in at once.
+ *
+ * The device behind them is one of several backends, chosen at
+ * block_init time (see 'struct backend' below):
+ *   file  - one pread/pwrite/preadv/pwritev per run of adjacent blocks
+ *           ("sync" is the old name for it)
+ *   uring - every run in a request is queued on an io_uring and
+ *           submitted with a single io_uring_enter, so scattered blocks
+ *           are in flight together instead of one after another.
+ *   mmap  - the whole image is mapped; transfers are memcpy and
+ *           block_ptr() hands out pointers into the mapping, so callers
+ *           can read blocks in place. Written blocks reach the file
+ *           when block_flush() calls msync.
+ *   ram   - the image is loaded into memory and used from there, like
+ *           mmap; nothing is ever written back to the file.
  */
-static int disk_fd;
+static int disk_fd = -1;
+static int disk_blocks;		/* image size, in blocks */
+static char *disk_mem;		/* mmap, ram: the whole image */
 
-/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+/* I/O accounting: calls into the block layer and the system calls
+ * they turned into. Updated atomically, read with block_counts().
  */
-int block_read(char *buf, int lba, int nblks)
+static uint64_t n_reads, n_writes, n_syscalls;
+static uint64_t n_uring;	/* runs completed through the io_uring */
+
+#define COUNT(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+void block_counts(uint64_t *reads, uint64_t *writes, uint64_t *syscalls)
+{
+    *reads = __atomic_load_n(&n_reads, __ATOMIC_RELAXED);
+    *writes = __atomic_load_n(&n_writes, __ATOMIC_RELAXED);
+    *syscalls = __atomic_load_n(&n_syscalls, __ATOMIC_RELAXED);
+}
+
+/* move exactly 'len' bytes at byte offset 'start'. That is a single
+ * pread/pwrite unless the kernel returns a short count or EINTR.
+ */
+static int do_io(int is_write, char *buf, size_t len, off_t start)
+{
+    while (len > 0) {
+        ssize_t n;
+        COUNT(n_syscalls, 1);
+        if (is_write)
+            n = pwrite(disk_fd, buf, len, start);
+        else
+            n = pread(disk_fd, buf, len, start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        buf += n;
+        start += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* a run of adjacent blocks scattered across memory: one preadv or
+ * pwritev, or one io_uring request.
+ */
+struct run {
+    off_t         start;
+    struct iovec *iov;
+    int           cnt;
+};
+
+/* finish a run of which the first 'done' bytes have been transferred,
+ * with one preadv/pwritev per attempt.
+ */
+static int finish_run(int is_write, struct run *r, size_t done)
+{
+    struct iovec *iov = r->iov;
+    int cnt = r->cnt;
+    off_t start = r->start + done;
+
+    while (cnt > 0) {
+        while (cnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt == 0)
+            break;
+        if (done > 0) {
+            size_t rest = iov->iov_len - done;
+            int rv = do_io(is_write, (char*)iov->iov_base + done, rest, start);
+            if (rv != 0)
+                return rv;
+            start += rest;
+            done = 0;
+            iov++;
+            cnt--;
+            continue;
+        }
+        ssize_t n;
+        COUNT(n_syscalls, 1);
+        if (cnt == 1)
+            n = is_write ? pwrite(disk_fd, iov->iov_base, iov->iov_len, start) :
+                pread(disk_fd, iov->iov_base, iov->iov_len, start);
+        else
+            n = is_write ? pwritev(disk_fd, iov, cnt, start) :
+                preadv(disk_fd, iov, cnt, start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        start += n;
+        done = n;
+    }
+    return 0;
+}
+
+static int sync_runs(int is_write, struct run *runs, int nruns)
+{
+    for (int i = 0; i < nruns; i++) {
+        int rv = finish_run(is_write, &runs[i], 0);
+        if (rv != 0)
+            return rv;
+    }
+    return 0;
+}
+
+/* io_uring engine. liburing isn't needed for this little: the rings
+ * are set up and driven with the raw system calls. One ring is shared
+ * by all threads; a request holds the lock from submission until its
+ * last completion is reaped.
+ */
+#define URING_DEPTH 64
+
+static struct {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr, *cq_ptr;
+    size_t               sq_len, cq_len, sqes_len;
+    pthread_mutex_t      lock;
+} ring = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void uring_exit(void)
+{
+    if (ring.fd < 0)
+        return;
+    munmap(ring.sqes, ring.sqes_len);
+    if (ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_len);
+    munmap(ring.sq_ptr, ring.sq_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+static int uring_init(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (ring.fd < 0)
+        return -errno;
+
+    ring.entries = p.sq_entries;
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_len = ring.cq_len = (ring.sq_len > ring.cq_len) ?
+            ring.sq_len : ring.cq_len;
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ptr = mmap(0, ring.sq_len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        goto fail;
+    ring.cq_ptr = ring.sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring.cq_ptr = mmap(0, ring.cq_len, PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            munmap(ring.sq_ptr, ring.sq_len);
+            goto fail;
+        }
+    }
+    ring.sqes = mmap(0, ring.sqes_len, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        if (ring.cq_ptr != ring.sq_ptr)
+            munmap(ring.cq_ptr, ring.cq_len);
+        munmap(ring.sq_ptr, ring.sq_len);
+        goto fail;
+    }
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring.fd);
+    ring.fd = -1;
+    return -ENOMEM;
+}
+
+static size_t run_len(struct run *r)
+{
+    return (size_t)r->cnt * FS_BLOCK_SIZE;
+}
+
+/* queue up to a ring's worth of runs at a time, submit them with one
+ * io_uring_enter and wait for all of them. A short completion is
+ * finished synchronously. If the ring itself fails we drop back to
+ * plain file I/O for good - repeating a block transfer is harmless.
+ */
+static int uring_runs(int is_write, struct run *runs, int nruns)
+{
+    int rv = 0, done = 0;
+
+    pthread_mutex_lock(&ring.lock);
+    while (done < nruns && ring.fd >= 0) {
+        int batch = MIN(nruns - done, (int)ring.entries);
+        unsigned tail = *ring.sq_tail;
+
+        for (int i = 0; i < batch; i++) {
+            unsigned idx = (tail + i) & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[idx];
+            struct run *r = &runs[done + i];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = disk_fd;
+            sqe->addr = (uintptr_t)r->iov;
+            sqe->len = r->cnt;
+            sqe->off = r->start;
+            sqe->user_data = done + i;
+            ring.sq_array[idx] = idx;
+        }
+        __atomic_store_n(ring.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        int submitted = 0, reaped = 0;
+        while (reaped < batch) {
+            COUNT(n_syscalls, 1);
+            int n = syscall(__NR_io_uring_enter, ring.fd, batch - submitted,
+                            batch - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                fprintf(stderr, "io_uring_enter: %s, using sync I/O\n",
+                        strerror(errno));
+                uring_exit();
+                break;
+            }
+            submitted += n;
+
+            unsigned head = *ring.cq_head;
+            while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                struct run *r = &runs[cqe->user_data];
+                if (cqe->res < 0)
+                    rv = -EIO;
+                else if ((size_t)cqe->res < run_len(r) && rv == 0)
+                    rv = finish_run(is_write, r, cqe->res);
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        if (reaped == batch) {
+            COUNT(n_uring, batch);
+            done += batch;
+        }
+    }
+    pthread_mutex_unlock(&ring.lock);
+
+    if (done < nruns && rv == 0)
+        rv = sync_runs(is_write, runs + done, nruns - done);
+    return rv;
+}
+
+static int uring_read(struct run *runs, int nruns)
+{
+    return uring_runs(0, runs, nruns);
+}
+
+static int uring_write(struct run *runs, int nruns)
+{
+    return uring_runs(1, runs, nruns);
+}
+
+/* the file backend, and the parts of it the others share */
+
+static int file_read(struct run *runs, int nruns)
+{
+    return sync_runs(0, runs, nruns);
+}
+
+static int file_write(struct run *runs, int nruns)
+{
+    return sync_runs(1, runs, nruns);
+}
+
+static int file_flush(void)
+{
+    COUNT(n_syscalls, 1);
+    return fdatasync(disk_fd) == 0 ? 0 : -EIO;
+}
+
+/* punch a hole where the blocks were, if the file system under the
+ * image can; if not, discarding just does nothing.
+ */
+static int file_discard(int lba, int nblks)
+{
+    COUNT(n_syscalls, 1);
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)lba * FS_BLOCK_SIZE, (off_t)nblks * FS_BLOCK_SIZE) == 0 ||
+        errno == EOPNOTSUPP)
+        return 0;
+    return -EIO;
+}
+
+/* works for block devices too, where st_size is 0 */
+static int file_size(void)
+{
+    off_t len = lseek(disk_fd, 0, SEEK_END);
+    return len < 0 ? 0 : len / FS_BLOCK_SIZE;
+}
+
+static int file_open(const char *file)
+{
+    if ((disk_fd = open(file, O_RDWR)) < 0)
+        return -errno;
+    return 0;
+}
+
+static void file_close(void)
+{
+    if (disk_fd >= 0)
+        close(disk_fd);
+    disk_fd = -1;
+}
+
+static int uring_open(const char *file)
+{
+    int rv = file_open(file);
+    if (rv == 0 && (rv = uring_init()) != 0)
+        file_close();
+    return rv;
+}
+
+static void uring_close(void)
+{
+    uring_exit();
+    file_close();
+}
+
+/* mmap and ram: the image is in memory at disk_mem */
+
+static int mem_runs(int is_write, struct run *runs, int nruns)
+{
+    for (int i = 0; i < nruns; i++) {
+        char *p = disk_mem + runs[i].start;
+        for (int j = 0; j < runs[i].cnt; j++) {
+            struct iovec *iov = &runs[i].iov[j];
+            if (is_write)
+                memcpy(p, iov->iov_base, iov->iov_len);
+            else
+                memcpy(iov->iov_base, p, iov->iov_len);
+            p += iov->iov_len;
+        }
+    }
+    return 0;
+}
+
+static int mem_read(struct run *runs, int nruns)
+{
+    return mem_runs(0, runs, nruns);
+}
+
+static int mem_write(struct run *runs, int nruns)
+{
+    return mem_runs(1, runs, nruns);
+}
+
+static void *mem_ptr(int lba)
+{
+    return disk_mem + (size_t)lba * FS_BLOCK_SIZE;
+}
+
+static int mmap_flush(void)
+{
+    COUNT(n_syscalls, 1);
+    return msync(disk_mem, (size_t)disk_blocks * FS_BLOCK_SIZE, MS_SYNC) == 0 ?
+        0 : -EIO;
+}
+
+static int mmap_open(const char *file)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    int rv = file_open(file);
+    if (rv != 0)
+        return rv;
+    disk_blocks = file_size();
+    disk_mem = mmap(NULL, (size_t)disk_blocks * FS_BLOCK_SIZE,
+                    PROT_READ|PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (disk_mem == MAP_FAILED) {
+        rv = -errno;
+        disk_mem = NULL;
+        file_close();
+    }
+    return rv;
+}
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+static void mmap_close(void)
+{
+    if (disk_mem) {
+        mmap_flush();
+        munmap(disk_mem, (size_t)disk_blocks * FS_BLOCK_SIZE);
+        disk_mem = NULL;
+    }
+    file_close();
+}
+
+static int mem_size(void)
+{
+    return disk_blocks;
+}
+
+static int ram_flush(void)
+{
+    return 0;
+}
+
+static int ram_discard(int lba, int nblks)
+{
+    memset(mem_ptr(lba), 0, (size_t)nblks * FS_BLOCK_SIZE);
+    return 0;
+}
+
+/* load the whole image; the file isn't touched again */
+static int ram_open(const char *file)
+{
+    int rv = file_open(file);
+    if (rv != 0)
+        return rv;
+    disk_blocks = file_size();
+    disk_mem = malloc((size_t)disk_blocks * FS_BLOCK_SIZE);
+    if (!disk_mem)
+        rv = -ENOMEM;
+    else if (do_io(0, disk_mem, (size_t)disk_blocks * FS_BLOCK_SIZE, 0) != 0)
+        rv = -EIO;
+    if (rv != 0) {
+        free(disk_mem);
+        disk_mem = NULL;
+    }
+    file_close();
+    return rv;
+}
+
+static void ram_close(void)
+{
+    free(disk_mem);
+    disk_mem = NULL;
+}
+
+/* A backend: the device blocks are read from and written to. 'read'
+ * and 'write' transfer whole runs of blocks, which the block layer has
+ * checked against 'size' (in blocks). 'discard' says blocks are no
+ * longer in use, so their contents may be dropped. 'ptr', if not NULL,
+ * gives in-place access to a block (see block_ptr).
+ */
+struct backend {
+    const char *name;
+    int   (*open)(const char *file);
+    void  (*close)(void);
+    int   (*read)(struct run *runs, int nruns);
+    int   (*write)(struct run *runs, int nruns);
+    int   (*flush)(void);
+    int   (*discard)(int lba, int nblks);
+    int   (*size)(void);
+    void *(*ptr)(int lba);
+};
+
+static const struct backend backends[] = {
+    {"file", file_open, file_close, file_read, file_write, file_flush,
+     file_discard, file_size, NULL},
+    {"sync", file_open, file_close, file_read, file_write, file_flush,
+     file_discard, file_size, NULL},
+    {"uring", uring_open, uring_close, uring_read, uring_write, file_flush,
+     file_discard, file_size, NULL},
+    {"mmap", mmap_open, mmap_close, mem_read, mem_write, mmap_flush,
+     file_discard, mem_size, mem_ptr},
+    {"ram", ram_open, ram_close, mem_read, mem_write, ram_flush,
+     ram_discard, mem_size, mem_ptr},
+};
+#define N_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+static const struct backend *be = &backends[0];
+
+static int do_runs(int is_write, struct run *runs, int nruns)
+{
+    if (is_write)
+        return be->write(runs, nruns);
+    return be->read(runs, nruns);
+}
+
+/* zero-copy access: pointer to block 'lba' inside the image, if the
+ * backend keeps it in memory (mmap, ram), or NULL (or if 'lba' is out
+ * of range), in which case the caller has to use block_read. Stores
+ * through the pointer are not allowed - writes go through block_write.
+ */
+void *block_ptr(int lba)
+{
+    if (!be->ptr || lba < 0 || lba >= disk_blocks)
+        return NULL;
+    return be->ptr(lba);
+}
+
+/* make everything written so far durable: msync for a mapped image,
+ * fdatasync for a file, nothing for a RAM disk.
+ * Returns -EIO if error, 0 otherwise
+ */
+int block_flush(void)
+{
+    return be->flush();
+}
+
+/* blocks [lba, lba+nblks) are free; the backend may drop what they
+ * hold, so reading them afterwards gives undefined (usually zero)
+ * contents. Returns -EIO if error, 0 otherwise
+ */
+int block_discard(int lba, int nblks)
+{
+    if (lba <= 0 || nblks < 0 || lba + nblks > disk_blocks)
         return -EIO;
-    if (read(disk_fd, buf, len) != len)
+    return nblks == 0 ? 0 : be->discard(lba, nblks);
+}
+
+static int read_blocks(char *buf, int lba, int nblks)
+{
+    if (lba < 0 || nblks < 0 || lba + nblks > disk_blocks)
         return -EIO;
-    return 0;
+
+    struct iovec iov = {buf, (size_t)nblks * FS_BLOCK_SIZE};
+    struct run r = {(off_t)lba * FS_BLOCK_SIZE, &iov, 1};
+    return do_runs(0, &r, 1);
+}
+
+static int write_blocks(char *buf, int lba, int nblks)
+{
+    /* make sure it all fits on the disk image - we never extend it
+     */
+    if (nblks < 0 || lba + nblks > disk_blocks)
+        return -EIO;
+
+    struct iovec iov = {buf, (size_t)nblks * FS_BLOCK_SIZE};
+    struct run r = {(off_t)lba * FS_BLOCK_SIZE, &iov, 1};
+    return do_runs(1, &r, 1);
+}
+
+/* vectored I/O - transfer 'nsegs' single-block segments. Segments
+ * whose LBAs follow each other are merged into one run, so a
+ * contiguous stretch costs one system call however many blocks it
+ * has; with the uring engine all the runs go out in one submission.
+ * Returns -EIO if error, 0 otherwise
+ */
+static int block_iov(int is_write, struct block_seg *segs, int nsegs)
+{
+    struct iovec *iov = malloc(nsegs * sizeof(*iov));
+    struct run *runs = malloc(nsegs * sizeof(*runs));
+    int nruns = 0, rv = -EIO;
+
+    if (!iov || !runs)
+        goto out;
+    for (int i = 0; i < nsegs; ) {
+        int lba = segs[i].lba, n = 0;
+        if (lba < 0 || lba + 1 > disk_blocks)
+            goto out;
+        runs[nruns].start = (off_t)lba * FS_BLOCK_SIZE;
+        runs[nruns].iov = &iov[i];
+        while (i < nsegs && n < IOV_MAX && segs[i].lba == lba + n &&
+               lba + n < disk_blocks) {
+            iov[i].iov_base = segs[i].buf;
+            iov[i].iov_len = FS_BLOCK_SIZE;
+            n++, i++;
+        }
+        runs[nruns++].cnt = n;
+    }
+    rv = do_runs(is_write, runs, nruns);
+
+out:
+    free(iov);
+    free(runs);
+    return rv;
+}
+
+/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_read(char *buf, int lba, int nblks)
+{
+    struct stat_timer t;
+    int rv;
+
+    COUNT(n_reads, 1);
+    stats_begin(&t, OP_BLOCK_READ);
+    rv = read_blocks(buf, lba, nblks);
+    stats_end(&t, rv, (uint64_t)nblks * FS_BLOCK_SIZE);
+    return rv;
 }
 
 /* write blocks from disk image. Returns -EIO if error, 0 otherwise
  */
 int block_write(char *buf, int lba, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    struct stat_timer t;
+    int rv;
 
     assert(lba > 0);		/* write to 0 is *always* an error */
-    
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
-        return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
-        return -EIO;
-    if (write(disk_fd, buf, len) != len)
-        return -EIO;
-    return 0;
+
+    COUNT(n_writes, 1);
+    stats_begin(&t, OP_BLOCK_WRITE);
+    rv = write_blocks(buf, lba, nblks);
+    stats_end(&t, rv, (uint64_t)nblks * FS_BLOCK_SIZE);
+    return rv;
 }
 
-void block_init(char *file)
+int block_readv(struct block_seg *segs, int nsegs)
 {
-    if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
-        printf("bad image file (must end in .img): %s\n", file);
-        exit(1);
+    struct stat_timer t;
+    int rv;
+
+    COUNT(n_reads, 1);
+    stats_begin(&t, OP_BLOCK_READ);
+    rv = block_iov(0, segs, nsegs);
+    stats_end(&t, rv, (uint64_t)nsegs * FS_BLOCK_SIZE);
+    return rv;
+}
+
+int block_writev(struct block_seg *segs, int nsegs)
+{
+    struct stat_timer t;
+    int rv;
+
+    for (int i = 0; i < nsegs; i++)
+        assert(segs[i].lba > 0);
+    COUNT(n_writes, 1);
+    stats_begin(&t, OP_BLOCK_WRITE);
+    rv = block_iov(1, segs, nsegs);
+    stats_end(&t, rv, (uint64_t)nsegs * FS_BLOCK_SIZE);
+    return rv;
+}
+
+/* open the image with the named backend ("file", "uring", "mmap" or
+ * "ram"; NULL or "sync" mean file). If uring or mmap can't be set up
+ * the image is used as a plain file. May be called again to switch
+ * images or backends.
+ */
+void block_init_backend(char *file, const char *backend)
+{
+    const struct backend *b = &backends[0];
+    int rv;
+
+    be->close();
+    be = &backends[0];
+
+    if (backend != NULL) {
+        for (b = backends; b < backends + N_BACKENDS; b++)
+            if (strcmp(b->name, backend) == 0)
+                break;
+        if (b == backends + N_BACKENDS) {
+            printf("unknown backend '%s' (file, uring, mmap, ram)\n", backend);
+            exit(1);
+        }
     }
-    if ((disk_fd = open(file, O_RDWR)) < 0) {
-        printf("cannot open image file '%s': %s\n", file, strerror(errno));
+
+    if ((rv = b->open(file)) != 0 && b->open != file_open &&
+        b->open != ram_open) {
+        fprintf(stderr, "%s backend unavailable (%s), using file I/O\n",
+                b->name, strerror(-rv));
+        b = &backends[0];
+        rv = b->open(file);
+    }
+    if (rv != 0) {
+        printf("cannot open image file '%s': %s\n", file, strerror(-rv));
         exit(1);
     }
+    be = b;
+    disk_blocks = be->size();
+}
+
+/* name of the backend in use, which may not be the one asked for:
+ * uring and mmap fall back to file I/O when they can't be set up, and
+ * uring also does so for good if the ring fails later on.
+ */
+const char *block_backend(void)
+{
+    if (be->open == uring_open && ring.fd < 0)
+        return backends[0].name;
+    return be->name;
+}
+
+/* runs of blocks the uring backend has transferred */
+uint64_t block_uring_runs(void)
+{
+    return __atomic_load_n(&n_uring, __ATOMIC_RELAXED);
+}
+
+void block_init(char *file)
+{
+    block_init_backend(file, NULL);
 }
 
@@ -16,6 +16,9 @@ print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+if sb.version not in (0, fs.VERSION_INDIRECT):
+    print ('dense image (version %d): not handled here' % sb.version)
+    sys.exit(1)
 print
 
 blkmap = fs.bitmap.from_buffer_copy(blks[1])
@@ -44,19 +47,25 @@ def iter(name, inum, v):
     alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
     s = '/' if name == '' else name
 
+    size = _in.size_hi << 32 | (_in.size & 0xffffffff)
     if v:
         print ('inode %d:' % inum)
         print ('  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode,
-                                                 _in.size, alloc))
+                                                 size, alloc))
     
-    xblks = (_in.size + 4095) // 4096
-    if fs.S_ISREG(_in.mode):
+    xblks = (size + 4095) // 4096
+    if fs.S_ISREG(_in.mode) and _in.flags & fs.INODE_INLINE:
+        if v:
+            print ('  inline data\n')
+    elif fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
-        for i in range(xblks):
+        for i in range(min(xblks, fs.NDIRECT)):
             alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
             if v:
                 print (str(_in.ptrs[i]) + alloc, end=' '),
+        if v and xblks > fs.NDIRECT:
+            print ('(+%d through indirect blocks)' % (xblks - fs.NDIRECT), end=' ')
         print("\n")
         if v:
             print
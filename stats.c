@@ -0,0 +1,139 @@
+/*
+ * file:        stats.c
+ * description: per-operation statistics for the CS 5600 file system:
+ *              call and error counts, bytes, blocks read and written
+ *              on behalf of each operation, and latency histograms.
+ *              Reported through /.fs5600-stats and at unmount.
+ *
+ * CS 5600, Computer Systems, Northeastern
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs5600.h"
+
+/* latency bucket i counts calls taking [2^(i-1), 2^i) microseconds;
+ * bucket 0 is under 1 us, the last one everything longer.
+ */
+#define N_BUCKETS 24
+
+static const char *op_names[N_STAT_OPS] = {
+    "getattr", "readdir", "create", "mkdir", "unlink", "rmdir",
+    "rename", "chmod", "utime", "truncate", "read", "write",
+    "statfs", "fsync", "flush", "release", "fallocate",
+    "block_read", "block_write",
+};
+
+static struct {
+    uint64_t calls, errors, bytes;
+    uint64_t blocks_read, blocks_written;
+    uint64_t total_ns;
+    uint64_t hist[N_BUCKETS];
+} stats[N_STAT_OPS];
+
+/* blocks moved by the block layer for this thread, so a FUSE operation
+ * can be charged with the I/O done while it ran.
+ */
+static __thread uint64_t my_blocks_read, my_blocks_written;
+
+#define ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_begin(struct stat_timer *t, int op)
+{
+    t->op = op;
+    t->blocks_read = my_blocks_read;
+    t->blocks_written = my_blocks_written;
+    t->start_ns = now_ns();
+}
+
+/* finish a call that returned 'rv' (< 0 is an error) and moved 'bytes'
+ * bytes of data. For the block layer operations the bytes are also
+ * blocks this thread read or wrote.
+ */
+void stats_end(struct stat_timer *t, int rv, uint64_t bytes)
+{
+    uint64_t ns = now_ns() - t->start_ns;
+    uint64_t us = ns / 1000;
+    int b = 0;
+
+    while (us != 0 && b < N_BUCKETS - 1)
+        b++, us >>= 1;
+
+    if (rv >= 0 && t->op == OP_BLOCK_READ)
+        my_blocks_read += bytes / FS_BLOCK_SIZE;
+    if (rv >= 0 && t->op == OP_BLOCK_WRITE)
+        my_blocks_written += bytes / FS_BLOCK_SIZE;
+
+    ADD(stats[t->op].calls, 1);
+    if (rv < 0)
+        ADD(stats[t->op].errors, 1);
+    else
+        ADD(stats[t->op].bytes, bytes);
+    ADD(stats[t->op].blocks_read, my_blocks_read - t->blocks_read);
+    ADD(stats[t->op].blocks_written, my_blocks_written - t->blocks_written);
+    ADD(stats[t->op].total_ns, ns);
+    ADD(stats[t->op].hist[b], 1);
+}
+
+/* format the statistics as text into 'buf'. Like snprintf, returns the
+ * full length even if it didn't fit.
+ */
+int stats_report(char *buf, int size)
+{
+    int len = 0;
+
+#define OUT(...) len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+    OUT("%-12s %10s %8s %14s %10s %10s %10s\n", "op", "calls", "errors",
+        "bytes", "blk_read", "blk_write", "avg_us");
+    for (int i = 0; i < N_STAT_OPS; i++) {
+        uint64_t calls = GET(stats[i].calls);
+        if (calls == 0)
+            continue;
+        OUT("%-12s %10llu %8llu %14llu %10llu %10llu %10.1f\n", op_names[i],
+            (unsigned long long)calls,
+            (unsigned long long)GET(stats[i].errors),
+            (unsigned long long)GET(stats[i].bytes),
+            (unsigned long long)GET(stats[i].blocks_read),
+            (unsigned long long)GET(stats[i].blocks_written),
+            GET(stats[i].total_ns) / 1e3 / calls);
+    }
+
+    OUT("\nlatency, us (bucket upper bound:calls)\n");
+    for (int i = 0; i < N_STAT_OPS; i++) {
+        if (GET(stats[i].calls) == 0)
+            continue;
+        OUT("%-12s", op_names[i]);
+        for (int b = 0; b < N_BUCKETS; b++) {
+            uint64_t n = GET(stats[i].hist[b]);
+            if (n == 0)
+                continue;
+            if (b == N_BUCKETS - 1)
+                OUT(" inf:%llu", (unsigned long long)n);
+            else
+                OUT(" %llu:%llu", 1ULL << b, (unsigned long long)n);
+        }
+        OUT("\n");
+    }
+#undef OUT
+    return len;
+}
+
+void stats_dump(FILE *fp)
+{
+    char buf[16384];
+    int len = stats_report(buf, sizeof(buf));
+    fwrite(buf, 1, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1, fp);
+}
@@ -19,6 +19,13 @@
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern void block_init_backend(char *file, const char *backend);
+extern void cache_counts(uint64_t *hits, uint64_t *misses, uint64_t *writebacks);
+extern void cache_set_size(int nblocks);
+extern int cache_set_policy(const char *name);
+extern void block_counts(uint64_t *reads, uint64_t *writes, uint64_t *syscalls);
+extern const char *block_backend(void);
+extern uint64_t block_uring_runs(void);
 
 START_TEST(test_getattr_all)
 {
@@ -195,6 +202,269 @@ START_TEST(test_statfs_values)
 }
 END_TEST
 
+START_TEST(test_block_io_syscalls)
+{
+    uint64_t r0, w0, s0, r1, w1, s1, r2, w2, s2;
+    char buf[20000];
+    struct stat st;
+
+    // getattr costs the path lookup only; read adds the data blocks
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &st), 0);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(s1 - s0, r1 - r0); // one syscall per block read
+
+    int rv = fs_ops.read("/dir3/subdir/file.12k", buf, 12288, 0, NULL);
+    ck_assert_int_eq(rv, 12288);
+    block_counts(&r2, &w2, &s2);
+
+    ck_assert_int_eq(w2, w0);
+    ck_assert_int_eq((s2 - s1) - (s1 - s0), 3); // blocks 332,151,283 - no two adjacent
+}
+END_TEST
+
+
+START_TEST(test_block_cache)
+{
+    uint64_t r0, w0, s0, r1, w1, s1;
+    uint64_t h0, m0, wb0, h1, m1, wb1;
+    struct stat st;
+
+    // first read may go to disk, a repeat is served from the cache
+    char buf[100];
+    ck_assert_int_eq(fs_ops.read("/dir3/subdir/file.4k-", buf, sizeof(buf), 0, NULL), 100);
+    block_counts(&r0, &w0, &s0);
+    cache_counts(&h0, &m0, &wb0);
+    ck_assert_int_eq(fs_ops.read("/dir3/subdir/file.4k-", buf, sizeof(buf), 0, NULL), 100);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &st), 0);
+    ck_assert_int_eq(st.st_size, 4095);
+    block_counts(&r1, &w1, &s1);
+    cache_counts(&h1, &m1, &wb1);
+
+    ck_assert_int_eq(r1, r0);
+    ck_assert_int_eq(s1, s0);
+    ck_assert_int_eq(m1, m0);
+    ck_assert(h1 > h0);
+}
+END_TEST
+
+
+START_TEST(test_inode_cache)
+{
+    uint64_t h0, m0, wb0, h1, m1, wb1;
+    struct stat st;
+
+    // a repeated lookup doesn't go to the block cache at all: the
+    // names come from the dentry cache, the four inodes from the inode
+    // cache
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &st), 0);
+    cache_counts(&h0, &m0, &wb0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &st), 0);
+    cache_counts(&h1, &m1, &wb1);
+    ck_assert_int_eq((h1 + m1) - (h0 + m0), 0);
+
+    // a change made in the cached inode is written back at unmount
+    ck_assert_int_eq(fs_ops.chmod("/file.1k", 0700), 0);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/file.1k", &st), 0);
+    ck_assert_int_eq(st.st_mode & 0777, 0700);
+    ck_assert_int_eq(fs_ops.chmod("/file.1k", 0666), 0);
+}
+END_TEST
+
+
+/* look up /dir3/subdir/file.4k- in an 8-block cache, read every file
+ * under /dir3 (more data blocks than the cache holds), and return the
+ * cache misses for listing /dir3/subdir. (A second lookup would need
+ * no blocks at all, thanks to the dentry cache.)
+ */
+static uint64_t lookup_after_scan(const char *policy)
+{
+    const char *scan[] = {"/dir3/subdir/file.4k-", "/dir3/subdir/file.8k-",
+                          "/dir3/subdir/file.12k", "/dir3/file.12k-", NULL};
+    uint64_t h0, m0, wb0, h1, m1, wb1;
+    struct stat st;
+    char buf[16384];
+
+    fs_ops.destroy(NULL);
+    cache_set_size(8);
+    ck_assert_int_eq(cache_set_policy(policy), 0);
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &st), 0);
+    for (int i = 0; scan[i] != NULL; i++)
+        ck_assert(fs_ops.read(scan[i], buf, sizeof(buf), 0, NULL) > 0);
+
+    cache_counts(&h0, &m0, &wb0);
+    ck_assert_int_eq(fs_ops.readdir("/dir3/subdir", NULL, readdir_filler_check, 0, NULL), 0);
+    cache_counts(&h1, &m1, &wb1);
+    return m1 - m0;
+}
+
+START_TEST(test_cache_scan_resistance)
+{
+    // under 2Q the scan only cycles through the data queue and the
+    // directory blocks stay cached
+    ck_assert_int_eq(lookup_after_scan("2q"), 0);
+    ck_assert(lookup_after_scan("lru") > 0);
+    ck_assert_int_eq(cache_set_policy("mru"), -EINVAL);
+
+    fs_ops.destroy(NULL);
+    cache_set_size(1024);
+    cache_set_policy("2q");
+    fs_ops.init(NULL);
+}
+END_TEST
+
+
+/* one operation's line in the stats file: its counters, and the sum
+ * of its latency histogram buckets. Zero if it has no line yet.
+ */
+struct op_stats {
+    unsigned long long calls, errors, bytes, blk_read, blk_write, hist;
+    int len;            /* length of the stats text read */
+};
+
+static void read_op_stats(const char *op, struct op_stats *s)
+{
+    static char buf[16384];
+    char key[32];
+
+    memset(s, 0, sizeof(*s));
+    s->len = fs_ops.read("/.fs5600-stats", buf, sizeof(buf) - 1, 0, NULL);
+    ck_assert(s->len > 0);
+    buf[s->len] = 0;
+
+    sprintf(key, "\n%s ", op);
+    char *line = strstr(buf, key);
+    if (line == NULL)
+        return;
+    ck_assert_int_eq(sscanf(line + strlen(key), "%llu %llu %llu %llu %llu", &s->calls,
+                            &s->errors, &s->bytes, &s->blk_read, &s->blk_write), 5);
+
+    char *hist = strstr(buf, "\nlatency");
+    ck_assert(hist != NULL);
+    line = strstr(hist, key);
+    ck_assert(line != NULL);
+    char *p = line + strlen(key), *eol = strchr(p, '\n');
+    unsigned long long n;
+    int used;
+    while (p < eol && sscanf(p, " %*[0-9inf]:%llu%n", &n, &used) == 1) {
+        s->hist += n;
+        p += used;
+    }
+}
+
+START_TEST(test_stats_file)
+{
+    struct stat st;
+    struct statvfs sv;
+    struct op_stats a_get, a_read, a_statfs, b_get, b_read, b_statfs;
+    char buf[16384];
+
+    // a read-only regular file, not listed in any directory
+    ck_assert_int_eq(fs_ops.getattr("/.fs5600-stats", &st), 0);
+    ck_assert_int_eq(st.st_mode, S_IFREG | 0444);
+    ck_assert(st.st_size > 0);
+    ck_assert_int_eq(fs_ops.write("/.fs5600-stats", "x", 1, 0, NULL), -EACCES);
+    ck_assert_int_eq(fs_ops.unlink("/.fs5600-stats"), -EACCES);
+    ck_assert_int_eq(fs_ops.create("/.fs5600-stats", 0100666, NULL), -EEXIST);
+
+    // earlier tests did block reads, and looked up missing paths
+    read_op_stats("block_read", &a_read);
+    ck_assert(a_read.calls > 0 && a_read.blk_read > 0);
+    read_op_stats("getattr", &a_get);
+    ck_assert(a_get.calls > 0 && a_get.errors > 0);
+    ck_assert_int_eq(a_get.hist, a_get.calls);
+
+    // each snapshot below is itself a read, counted in the next one
+    read_op_stats("getattr", &a_get);
+    read_op_stats("statfs", &a_statfs);
+    read_op_stats("read", &a_read);
+
+    ck_assert_int_eq(fs_ops.getattr("/file.1k", &st), 0);
+    ck_assert_int_eq(fs_ops.getattr("/not-a-file", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/file.1k/x", &st), -ENOTDIR);
+    for (int i = 0; i < 3; i++)
+        ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(fs_ops.read("/file.1k", buf, 1000, 0, NULL), 1000);
+    ck_assert_int_eq(fs_ops.read("/file.1k", buf, 1000, 500, NULL), 500);
+
+    read_op_stats("getattr", &b_get);
+    read_op_stats("statfs", &b_statfs);
+    read_op_stats("read", &b_read);
+
+    ck_assert_int_eq(b_get.calls - a_get.calls, 3);
+    ck_assert_int_eq(b_get.errors - a_get.errors, 2);
+    ck_assert_int_eq(b_get.hist - a_get.hist, 3);
+
+    ck_assert_int_eq(b_statfs.calls - a_statfs.calls, 3);
+    ck_assert_int_eq(b_statfs.errors - a_statfs.errors, 0);
+    ck_assert_int_eq(b_statfs.hist, b_statfs.calls);
+
+    // two file reads, 'a_read' itself and the two snapshots before 'b_read'
+    ck_assert_int_eq(b_read.calls - a_read.calls, 5);
+    ck_assert_int_eq(b_read.errors - a_read.errors, 0);
+    ck_assert_int_eq(b_read.bytes - a_read.bytes,
+                     1500 + a_read.len + b_get.len + b_statfs.len);
+    ck_assert_int_eq(b_read.hist - a_read.hist, 5);
+
+    // reads at an offset continue the same text (the header line,
+    // which doesn't change from one read to the next)
+    char part[64];
+    int rv = fs_ops.read("/.fs5600-stats", buf, sizeof(buf) - 1, 0, NULL);
+    ck_assert(rv > 74);
+    rv = fs_ops.read("/.fs5600-stats", part, sizeof(part), 10, NULL);
+    ck_assert_int_eq(rv, sizeof(part));
+    ck_assert(memcmp(part, buf + 10, sizeof(part)) == 0);
+}
+END_TEST
+
+START_TEST(test_uring_backend)
+{
+    // same reads and directory listings through the io_uring engine,
+    // starting from an empty cache so they really reach it
+    fs_ops.destroy(NULL);
+    block_init_backend("test.img", "uring");
+    fs_ops.init(NULL);
+    if (strcmp(block_backend(), "uring") != 0) {
+        fprintf(stderr, "test_uring_backend: io_uring unavailable, skipped\n");
+        fs_ops.destroy(NULL);
+        block_init_backend("test.img", "sync");
+        fs_ops.init(NULL);
+        return;
+    }
+    uint64_t runs0 = block_uring_runs();
+
+    unsigned cksum = read_file_in_chunks("/file.1k", 1000, 1000);
+    ck_assert_int_eq(cksum, 1726121896);
+
+    char buf[20000];
+    int rv = fs_ops.read("/dir-with-long-name/file.12k+", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, 12289);
+    ck_assert_int_eq(crc32(0, (unsigned char *)buf, rv), 2781093465u);
+
+    int i;
+    for (i = 0; dir_contents[0].entries[i] != NULL; i++) {
+        entry_table[i].name = dir_contents[0].entries[i];
+        entry_table[i].seen = 0;
+    }
+    entry_table[i].name = NULL;
+    rv = fs_ops.readdir("/", NULL, readdir_filler_check, 0, NULL);
+    ck_assert_int_eq(rv, 0);
+    for (i = 0; entry_table[i].name != NULL; i++) {
+        ck_assert_msg(entry_table[i].seen, "entry '%s' missing", entry_table[i].name);
+    }
+    ck_assert_str_eq(block_backend(), "uring");
+    ck_assert(block_uring_runs() > runs0);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test.img", "sync");
+    fs_ops.init(NULL);
+}
+END_TEST
+
 
 START_TEST(test_chmod_file_and_dir)
 {
@@ -318,6 +588,12 @@ int main(int argc, char **argv)
     tcase_add_test(tc, test_read_file_1k_big);
     tcase_add_test(tc, test_read_file_1k_chunks);
     tcase_add_test(tc, test_statfs_values);
+    tcase_add_test(tc, test_block_io_syscalls);
+    tcase_add_test(tc, test_block_cache);
+    tcase_add_test(tc, test_inode_cache);
+    tcase_add_test(tc, test_cache_scan_resistance);
+    tcase_add_test(tc, test_uring_backend);
+    tcase_add_test(tc, test_stats_file);
     tcase_add_test(tc, test_chmod_file_and_dir);
     tcase_add_test(tc, test_rename_file_and_directory);
 
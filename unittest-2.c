@@ -14,11 +14,29 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "fs5600.h"
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern void block_counts(uint64_t *reads, uint64_t *writes, uint64_t *syscalls);
+extern void block_init_backend(char *file, const char *backend);
+extern int block_read(void *buf, int lba, int nblks);
+extern void cache_counts(uint64_t *hits, uint64_t *misses, uint64_t *writebacks);
+extern void cache_ra_counts(uint64_t *prefetched, uint64_t *used);
+extern void cache_prefetch_wait(void);
+extern void cache_set_size(int nblocks);
+extern void cache_set_expire(int secs);
+extern int cache_read(void *buf, int lba, int type);
+extern int cache_write(void *buf, int lba, int type);
+extern int cache_discard(const int *lba, int n);
+extern int find_free_run(const unsigned char *map, int nbits, int start, int max, int *len);
+extern int find_free_summary(const unsigned char *map, unsigned char *const *full, int nlevels,
+                             int nbits, int start, int max, int *len);
 
 /* mockup for fuse_get_context. you can change ctx.uid, ctx.gid in 
  * tests if you want to test setting UIDs in mknod/mkdir
@@ -749,6 +767,1544 @@ START_TEST(test_utime)
 }
 END_TEST
 
+START_TEST(test_write_read_multiblock)
+{
+    int len = 16 * FS_BLOCK_SIZE;
+    char *data = malloc(len), *back = malloc(len);
+    for (int i = 0; i < len; i++) {
+        data[i] = 'a' + (i * 7) % 26;
+    }
+
+    int rv = fs_ops.create("/multiblock.bin", 0100666, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write("/multiblock.bin", data, len, 0, NULL);
+    ck_assert_int_eq(rv, len);
+
+    // a read spanning all 16 blocks is merged into a few vectored
+    // transfers, not one system call per block
+    uint64_t r0, w0, s0, r1, w1, s1, r2, w2, s2;
+    struct stat st;
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.getattr("/multiblock.bin", &st), 0);
+    block_counts(&r1, &w1, &s1);
+    rv = fs_ops.read("/multiblock.bin", back, len, 0, NULL);
+    ck_assert_int_eq(rv, len);
+    block_counts(&r2, &w2, &s2);
+    ck_assert_int_lt((s2 - s1) - (s1 - s0), 8);
+    ck_assert(memcmp(data, back, len) == 0);
+
+    // unaligned overwrite across block boundaries
+    memset(data + 4000, 'Z', 5000);
+    rv = fs_ops.write("/multiblock.bin", data + 4000, 5000, 4000, NULL);
+    ck_assert_int_eq(rv, 5000);
+    rv = fs_ops.read("/multiblock.bin", back, len, 0, NULL);
+    ck_assert_int_eq(rv, len);
+    ck_assert(memcmp(data, back, len) == 0);
+
+    free(data);
+    free(back);
+}
+END_TEST
+
+START_TEST(test_readahead)
+{
+    int len = 32 * FS_BLOCK_SIZE, chunk = 2 * FS_BLOCK_SIZE;
+    char *data = malloc(len), *back = malloc(len);
+    for (int i = 0; i < len; i++) {
+        data[i] = 'A' + (i * 11) % 26;
+    }
+    ck_assert_int_eq(fs_ops.create("/stream.bin", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/stream.bin", data, len, 0, NULL), len);
+
+    // remount so nothing is cached, then stream the file in 8 KB reads;
+    // after the first two, each read finds its blocks already prefetched
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    uint64_t prefetched, used;
+    for (int off = 0; off < len; off += chunk) {
+        int rv = fs_ops.read("/stream.bin", back + off, chunk, off, NULL);
+        ck_assert_int_eq(rv, chunk);
+        cache_prefetch_wait();
+    }
+    ck_assert(memcmp(data, back, len) == 0);
+    cache_ra_counts(&prefetched, &used);
+    ck_assert_int_ge(prefetched, 32 - 4);
+    ck_assert_int_eq(used, prefetched);
+
+    free(data);
+    free(back);
+}
+END_TEST
+
+START_TEST(test_fsync)
+{
+    // writes stay in the cache until something asks for them
+    uint64_t r0, w0, s0, r1, w1, s1, h, m, wb0, wb1, wb2;
+    char buf[100];
+    ck_assert_int_eq(fs_ops.create("/sync-a.txt", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/sync-b.txt", 0100666, NULL), 0);
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.write("/sync-a.txt", "aaaa", 4, 0, NULL), 4);
+    ck_assert_int_eq(fs_ops.write("/sync-b.txt", "bbbb", 4, 0, NULL), 4);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(w1, w0);
+
+    // the data is inline: fsync of a writes back its inode and the
+    // bitmap (changed by the creates), flushing b only b's inode
+    cache_counts(&h, &m, &wb0);
+    ck_assert_int_eq(fs_ops.fsync("/sync-a.txt", 0, NULL), 0);
+    cache_counts(&h, &m, &wb1);
+    ck_assert_int_eq(wb1 - wb0, 2);
+    ck_assert_int_eq(fs_ops.flush("/sync-b.txt", NULL), 0);
+    cache_counts(&h, &m, &wb2);
+    ck_assert_int_eq(wb2 - wb1, 1);
+
+    // nothing left to write for either
+    ck_assert_int_eq(fs_ops.fsync("/sync-a.txt", 1, NULL), 0);
+    ck_assert_int_eq(fs_ops.release("/sync-b.txt", NULL), 0);
+    cache_counts(&h, &m, &wb1);
+    ck_assert_int_eq(wb1, wb2);
+    ck_assert_int_eq(fs_ops.fsync("/not-there", 0, NULL), -ENOENT);
+
+    ck_assert_int_eq(fs_ops.read("/sync-b.txt", buf, sizeof(buf), 0, NULL), 4);
+    ck_assert(memcmp(buf, "bbbb", 4) == 0);
+}
+END_TEST
+
+START_TEST(test_writeback_error)
+{
+    // a background writeback that fails is reported by the next fsync,
+    // once. Blocks past the end of the image can't be written; three
+    // dirty blocks in an 8-block cache wake the flusher at once.
+    char block[FS_BLOCK_SIZE];
+    int bad[3] = {1000, 1001, 1002};
+    memset(block, 'e', sizeof(block));
+    fs_ops.destroy(NULL);
+    cache_set_size(8);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/wb-error", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.fsync("/wb-error", 0, NULL), 0);
+
+    for (int i = 0; i < 3; i++) {
+        ck_assert_int_eq(cache_write(block, bad[i], BLOCK_DATA), 0);
+    }
+    usleep(1500 * 1000);
+    ck_assert_int_eq(fs_ops.fsync("/wb-error", 0, NULL), -EIO);
+    cache_discard(bad, 3);
+    ck_assert_int_eq(fs_ops.fsync("/wb-error", 0, NULL), 0);
+
+    ck_assert_int_eq(fs_ops.unlink("/wb-error"), 0);
+    fs_ops.destroy(NULL);
+    cache_set_size(1024);
+    fs_ops.init(NULL);
+}
+END_TEST
+
+static int race_lba, race_written;
+static pthread_mutex_t race_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *write_block_thread(void *arg)
+{
+    // sleeps so the reader is mid-read, then writes the block
+    usleep(1000);
+    pthread_mutex_lock(&race_lock);
+    ck_assert_int_eq(cache_write(arg, race_lba, BLOCK_DATA), 0);
+    race_written = 1;
+    pthread_mutex_unlock(&race_lock);
+    return NULL;
+}
+
+START_TEST(test_cache_read_write_race)
+{
+    // a miss is read in without the cache lock; a write to the block
+    // meanwhile must not be replaced by what was read. The reader drops
+    // the block before each read, until the write is in.
+    char saved[FS_BLOCK_SIZE], block[FS_BLOCK_SIZE], back[FS_BLOCK_SIZE];
+    struct statvfs sv;
+    pthread_t t;
+
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    race_lba = sv.f_blocks - 1;
+    ck_assert_int_eq(cache_read(saved, race_lba, BLOCK_DATA), 0);
+    for (int r = 0; r < 50; r++) {
+        memset(block, 'A' + r % 26, sizeof(block));
+        race_written = 0;
+        pthread_create(&t, NULL, write_block_thread, block);
+        for (int done = 0; !done; ) {
+            pthread_mutex_lock(&race_lock);
+            if (!(done = race_written))
+                cache_discard(&race_lba, 1);
+            pthread_mutex_unlock(&race_lock);
+            ck_assert_int_eq(cache_read(back, race_lba, BLOCK_DATA), 0);
+        }
+        pthread_join(t, NULL);
+        ck_assert_int_eq(cache_read(back, race_lba, BLOCK_DATA), 0);
+        ck_assert_int_eq(back[0], block[0]);
+    }
+    ck_assert_int_eq(cache_write(saved, race_lba, BLOCK_DATA), 0);
+}
+END_TEST
+
+START_TEST(test_inode_expire)
+{
+    // a change to just an inode is written back by the flusher once it
+    // has been dirty long enough, with no fsync: the first pass moves it
+    // from the inode cache to the block cache, the same or the next one
+    // writes the block. Remounting first leaves nothing else dirty.
+    uint64_t h, m, wb0, wb1;
+    struct stat st;
+    ck_assert_int_eq(fs_ops.create("/expire", 0100666, NULL), 0);
+    fs_ops.destroy(NULL);
+    cache_set_expire(0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/expire", &st), 0);
+
+    cache_counts(&h, &m, &wb0);
+    ck_assert_int_eq(fs_ops.chmod("/expire", 0100600), 0);
+    usleep(2500 * 1000);
+    cache_counts(&h, &m, &wb1);
+    ck_assert(wb1 > wb0);
+
+    // still there after a remount
+    fs_ops.destroy(NULL);
+    cache_set_expire(5);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/expire", &st), 0);
+    ck_assert_int_eq(st.st_mode, 0100600);
+    ck_assert_int_eq(fs_ops.unlink("/expire"), 0);
+}
+END_TEST
+
+START_TEST(test_find_free_run)
+{
+    unsigned char map[64];
+    int len;
+
+    // blocks 0-69 used, 70-199 free (across two word boundaries), rest used
+    memset(map, 0xff, sizeof(map));
+    for (int i = 70; i < 200; i++) {
+        map[i / 8] &= ~(1 << (i % 8));
+    }
+    ck_assert_int_eq(find_free_run(map, 512, 2, 1000, &len), 70);
+    ck_assert_int_eq(len, 130);
+    ck_assert_int_eq(find_free_run(map, 512, 100, 1000, &len), 100);
+    ck_assert_int_eq(len, 100);
+    ck_assert_int_eq(find_free_run(map, 512, 2, 10, &len), 70);
+    ck_assert_int_eq(len, 10);
+    ck_assert_int_eq(find_free_run(map, 150, 2, 1000, &len), 70);
+    ck_assert_int_eq(len, 80);
+    ck_assert_int_eq(find_free_run(map, 512, 200, 1000, &len), -1);
+
+    // a single free bit in the last word
+    map[63] = 0x7f;
+    ck_assert_int_eq(find_free_run(map, 512, 200, 1000, &len), 511);
+    ck_assert_int_eq(len, 1);
+    ck_assert_int_eq(find_free_run(map, 511, 200, 1000, &len), -1);
+}
+END_TEST
+
+START_TEST(test_find_free_summary)
+{
+    // 192 words of map, all full but for bits 10000-10002; the summary
+    // levels say so: 192 bits, then 3
+    unsigned char map[192 * 8], l0[3 * 8], l1[8];
+    unsigned char *levels[] = {l0, l1};
+    int len;
+
+    memset(map, 0xff, sizeof(map));
+    memset(l0, 0xff, sizeof(l0));
+    memset(l1, 0, sizeof(l1));
+    for (int i = 10000; i < 10003; i++) {
+        map[i / 8] &= ~(1 << (i % 8));
+    }
+    l0[10000 / 64 / 8] &= ~(1 << (10000 / 64 % 8));
+    l1[0] = 0x03;		// level 0 words 0 and 1 are full, word 2 isn't
+
+    ck_assert_int_eq(find_free_summary(map, levels, 2, 192 * 64, 2, 100, &len), 10000);
+    ck_assert_int_eq(len, 3);
+    ck_assert_int_eq(find_free_summary(map, levels, 1, 192 * 64, 2, 100, &len), 10000);
+    ck_assert_int_eq(find_free_summary(map, levels, 2, 192 * 64, 10001, 100, &len), 10001);
+    ck_assert_int_eq(len, 2);
+    ck_assert_int_eq(find_free_summary(map, levels, 2, 192 * 64, 10003, 100, &len), -1);
+}
+END_TEST
+
+START_TEST(test_write_enospc)
+{
+    // a write that can't get all its blocks allocates none of them
+    struct statvfs sv0, sv1;
+    int len = 512 * FS_BLOCK_SIZE;
+    char *data = calloc(len, 1);
+    ck_assert_int_eq(fs_ops.create("/too-big", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.write("/too-big", data, len, 0, NULL), -ENOSPC);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+    ck_assert_int_eq(fs_ops.write("/too-big", data, 3 * FS_BLOCK_SIZE, 0, NULL),
+                     3 * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.unlink("/too-big"), 0);
+    free(data);
+}
+END_TEST
+
+START_TEST(test_contiguous_append)
+{
+    char block[FS_BLOCK_SIZE], path[32];
+    memset(block, 'c', sizeof(block));
+
+    // leave one-block holes behind: small files, every other one deleted
+    for (int i = 0; i < 8; i++) {
+        sprintf(path, "/hole%d", i);
+        ck_assert_int_eq(fs_ops.create(path, 0100666, NULL), 0);
+        ck_assert_int_eq(fs_ops.write(path, block, 10, 0, NULL), 10);
+    }
+    for (int i = 0; i < 8; i += 2) {
+        sprintf(path, "/hole%d", i);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+
+    // a file appended a block at a time doesn't go into the holes, it
+    // stays in one piece - reading it back is a single transfer
+    ck_assert_int_eq(fs_ops.create("/appended", 0100666, NULL), 0);
+    for (int i = 0; i < 8; i++) {
+        ck_assert_int_eq(fs_ops.write("/appended", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+
+    uint64_t r0, w0, s0, r1, w1, s1;
+    char back[8 * FS_BLOCK_SIZE];
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/appended", &st), 0);
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.read("/appended", back, sizeof(back), 0, NULL), sizeof(back));
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(s1 - s0, 1);
+
+    for (int i = 1; i < 8; i += 2) {
+        sprintf(path, "/hole%d", i);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+    ck_assert_int_eq(fs_ops.unlink("/appended"), 0);
+}
+END_TEST
+
+START_TEST(test_mmap_backend)
+{
+    // remount on the mapped image
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "mmap");
+    fs_ops.init(NULL);
+
+    int rv = fs_ops.create("/mapped.txt", 0100666, NULL);
+    ck_assert_int_eq(rv, 0);
+    const char *data = "written through the mapping";
+    int len = strlen(data);
+    rv = fs_ops.write("/mapped.txt", data, len, 0, NULL);
+    ck_assert_int_eq(rv, len);
+
+    // metadata and data come straight from the mapping - no syscalls
+    uint64_t r0, w0, s0, r1, w1, s1;
+    char buf[100];
+    struct stat st;
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.getattr("/mapped.txt", &st), 0);
+    ck_assert_int_eq(st.st_size, len);
+    rv = fs_ops.read("/mapped.txt", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, len);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(s1, s0);
+    ck_assert(memcmp(buf, data, len) == 0);
+
+    // unmount msyncs; the data is then visible to plain file I/O
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "sync");
+    fs_ops.init(NULL);
+    memset(buf, 0, sizeof(buf));
+    rv = fs_ops.read("/mapped.txt", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, len);
+    ck_assert(memcmp(buf, data, len) == 0);
+}
+END_TEST
+
+START_TEST(test_ram_backend)
+{
+    // a RAM disk starts as a copy of the image and is never written back
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "ram");
+    fs_ops.init(NULL);
+
+    uint64_t r0, w0, s0, r1, w1, s1;
+    char buf[100];
+    const char *data = "only in memory";
+    int len = strlen(data);
+    ck_assert_int_eq(fs_ops.create("/ram.txt", 0100666, NULL), 0);
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.write("/ram.txt", data, len, 0, NULL), len);
+    ck_assert_int_eq(fs_ops.read("/ram.txt", buf, sizeof(buf), 0, NULL), len);
+    ck_assert_int_eq(fs_ops.fsync("/ram.txt", 0, NULL), 0);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(s1, s0);
+    ck_assert(memcmp(buf, data, len) == 0);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/ram.txt", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/mapped.txt", &st), 0);
+}
+END_TEST
+
+START_TEST(test_unlink_discards)
+{
+    // blocks of a file deleted while still dirty are never written
+    uint64_t h, m, wb0, wb1;
+    char block[FS_BLOCK_SIZE];
+    memset(block, 'd', sizeof(block));
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    cache_counts(&h, &m, &wb0);
+    ck_assert_int_eq(fs_ops.create("/short-lived", 0100666, NULL), 0);
+    for (int i = 0; i < 8; i++) {
+        ck_assert_int_eq(fs_ops.write("/short-lived", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+    }
+    ck_assert_int_eq(fs_ops.unlink("/short-lived"), 0);
+    fs_ops.destroy(NULL);
+    cache_counts(&h, &m, &wb1);
+    fs_ops.init(NULL);
+
+    // just the root directory block and the bitmap
+    ck_assert_int_eq(wb1 - wb0, 2);
+    struct stat st;
+    ck_assert_int_eq(fs_ops.getattr("/short-lived", &st), -ENOENT);
+}
+END_TEST
+
+START_TEST(test_discard_deferred)
+{
+    // the device isn't told a deleted file's block is free (the image
+    // file gets a hole punched) until the metadata that freed it has
+    // been written back, and a block used again before then isn't
+    // discarded at all. block_read looks at the image past the cache.
+    char block[FS_BLOCK_SIZE], back[FS_BLOCK_SIZE], zeros[FS_BLOCK_SIZE] = {0};
+    struct statvfs sv;
+    int lba = -1;
+    memset(block, 'k', sizeof(block));
+    strcpy(block, "discard me later");
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/discarded", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/discarded", block, sizeof(block), 0, NULL),
+                     sizeof(block));
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    for (int i = 1; i < (int)sv.f_blocks && lba < 0; i++) {
+        ck_assert_int_eq(block_read(back, i, 1), 0);
+        if (memcmp(back, block, sizeof(block)) == 0)
+            lba = i;
+    }
+    ck_assert_int_ge(lba, 0);
+
+    ck_assert_int_eq(fs_ops.unlink("/discarded"), 0);
+    ck_assert_int_eq(block_read(back, lba, 1), 0);
+    ck_assert(memcmp(back, block, sizeof(block)) == 0);
+
+    // the next file gets the same block
+    memset(block, 'r', sizeof(block));
+    ck_assert_int_eq(fs_ops.create("/reused", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/reused", block, sizeof(block), 0, NULL),
+                     sizeof(block));
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_read(back, lba, 1), 0);
+    ck_assert(memcmp(back, block, sizeof(block)) == 0);
+    ck_assert_int_eq(fs_ops.read("/reused", back, sizeof(back), 0, NULL), sizeof(back));
+    ck_assert(memcmp(back, block, sizeof(block)) == 0);
+
+    // unmounting writes everything back and then sends the discard
+    ck_assert_int_eq(fs_ops.unlink("/reused"), 0);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_read(back, lba, 1), 0);
+    ck_assert(memcmp(back, zeros, sizeof(zeros)) == 0);
+}
+END_TEST
+
+START_TEST(test_statfs_counts)
+{
+    // the free count follows every allocation and free, and agrees
+    // with a fresh count of the bitmap after remounting
+    struct statvfs sv0, sv1;
+    char block[FS_BLOCK_SIZE];
+    memset(block, 's', sizeof(block));
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.create("/counted", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/counted-dir", 0777), 0);
+    for (int i = 0; i < 5; i++) {
+        ck_assert_int_eq(fs_ops.write("/counted", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1 + 5 + 2);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1 + 5 + 2);
+
+    ck_assert_int_eq(fs_ops.truncate("/counted", 0), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1 + 2);
+    ck_assert_int_eq(fs_ops.unlink("/counted"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/counted-dir"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+}
+END_TEST
+
+/* an empty image of 'nblocks' blocks with a bitmap of 'nbitmap' blocks,
+ * after which come the root inode and its directory block. If 'full',
+ * the first bitmap block is all ones, so everything new goes past block
+ * 32768.
+ */
+#define BIG_IMAGE  "big.img"
+#define BIG_BLOCKS (FS_BITS_PER_BLOCK + 1000)
+
+static void make_image(int nblocks, int nbitmap, int full)
+{
+    char block[FS_BLOCK_SIZE];
+    struct fs_super *sb = (void*)block;
+    struct fs_inode *root = (void*)block;
+    int fd = open(BIG_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ck_assert(fd >= 0);
+    ck_assert_int_eq(ftruncate(fd, (off_t)nblocks * FS_BLOCK_SIZE), 0);
+
+    memset(block, 0, sizeof(block));
+    sb->magic = FS_MAGIC;
+    sb->disk_size = nblocks;
+    sb->bitmap_blocks = nbitmap;
+    sb->version = FS_VERSION_INDIRECT;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 0), FS_BLOCK_SIZE);
+    memset(block, full ? 0xff : 0, sizeof(block));
+    for (int i = 0; i < nbitmap + 3; i++) {
+        block[i / 8] |= 1 << (i % 8);
+    }
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+
+    memset(block, 0, sizeof(block));
+    root->mode = S_IFDIR | 0777;
+    root->size = FS_BLOCK_SIZE;
+    root->ptrs[0] = nbitmap + 2;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, (off_t)(nbitmap + 1) * FS_BLOCK_SIZE),
+                     FS_BLOCK_SIZE);
+    close(fd);
+}
+
+START_TEST(test_version0_image)
+{
+    // in a version 0 image the end of the inode is block pointers, so
+    // an inode with anything there can't be used, and nothing new is
+    // put there: files aren't inline and stop at FS_NDIRECT blocks
+    char block[FS_BLOCK_SIZE], back[FS_BLOCK_SIZE];
+    struct fs_dirent *de = (void*)block;
+    struct fs_inode *ino = (void*)block;
+    struct fs_super *sb = (void*)block;
+    struct stat st;
+    uint32_t version = 0;
+
+    // 2 is the root inode and 3 its directory block; /old's inode is
+    // 4 and its data 5, /big's inode (a 1015-block file) is 6
+    make_image(100, 1, 0);
+    int fd = open(BIG_IMAGE, O_RDWR);
+    ck_assert_int_eq(pwrite(fd, &version, sizeof(version),
+                            offsetof(struct fs_super, version)), sizeof(version));
+    ck_assert_int_eq(pread(fd, block, FS_BLOCK_SIZE, FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    block[0] |= 0x70;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    memset(block, 0, sizeof(block));
+    de[0].valid = de[1].valid = 1;
+    de[0].inode = 4;
+    strcpy(de[0].name, "old");
+    de[1].inode = 6;
+    strcpy(de[1].name, "big");
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 3 * FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    memset(block, 0, sizeof(block));
+    ino->mode = S_IFREG | 0666;
+    ino->size = 100;
+    ino->ptrs[0] = 5;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 4 * FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    ino->size = (FS_NDIRECT + 1) * FS_BLOCK_SIZE;
+    ino->indir[0] = 5;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 6 * FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    memset(block, 'v', sizeof(block));
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 5 * FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.read("/old", back, sizeof(back), 0, NULL), 100);
+    ck_assert_int_eq(back[99], 'v');
+    ck_assert_int_eq(fs_ops.getattr("/big", &st), -EIO);
+
+    ck_assert_int_eq(fs_ops.create("/new", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/new", "new", 3, 0, NULL), 3);
+    ck_assert_int_eq(fs_ops.release("/new", NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/new", &st), 0);
+    ck_assert_int_eq(st.st_blocks, FS_BLOCK_SIZE / 512);
+    ck_assert_int_eq(fs_ops.fallocate("/new", 0, (off_t)FS_NDIRECT * FS_BLOCK_SIZE,
+                                      FS_BLOCK_SIZE, NULL), -EFBIG);
+    fs_ops.destroy(NULL);
+    ck_assert_int_eq(pread(fd, block, FS_BLOCK_SIZE, 0), FS_BLOCK_SIZE);
+    ck_assert_int_eq(sb->version, 0);
+    close(fd);
+
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+START_TEST(test_big_image)
+{
+    struct statvfs sv0, sv1;
+    struct stat st;
+    char block[FS_BLOCK_SIZE], back[FS_BLOCK_SIZE];
+    memset(block, 'b', sizeof(block));
+
+    make_image(BIG_BLOCKS, 2, 1);
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(sv0.f_blocks, BIG_BLOCKS - 3);
+    ck_assert_int_eq(sv0.f_bfree, BIG_BLOCKS - FS_BITS_PER_BLOCK - 3);
+
+    // zero part of the full bitmap block behind the file system's back:
+    // it isn't changed below, so it must not be written back over this
+    int fd = open(BIG_IMAGE, O_RDWR);
+    char zeros[64] = {0};
+    ck_assert_int_eq(pwrite(fd, zeros, sizeof(zeros), FS_BLOCK_SIZE + 1024), sizeof(zeros));
+
+    ck_assert_int_eq(fs_ops.create("/big", 0100666, NULL), 0);
+    for (int i = 0; i < 4; i++) {
+        ck_assert_int_eq(fs_ops.write("/big", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree + sizeof(zeros) * 8, 1 + 4);
+    ck_assert_int_eq(fs_ops.getattr("/big", &st), 0);
+    ck_assert_int_eq(st.st_size, 4 * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.read("/big", back, sizeof(back), 3 * FS_BLOCK_SIZE, NULL),
+                     sizeof(back));
+    ck_assert(memcmp(back, block, sizeof(block)) == 0);
+
+    char map[sizeof(zeros)];
+    ck_assert_int_eq(pread(fd, map, sizeof(map), FS_BLOCK_SIZE + 1024), sizeof(map));
+    ck_assert(memcmp(map, zeros, sizeof(map)) == 0);
+    close(fd);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+static void *mkdir_thread(void *path)
+{
+    ck_assert_int_eq(fs_ops.mkdir(path, 0777), 0);
+    return NULL;
+}
+
+START_TEST(test_alloc_groups)
+{
+    // three allocation groups; directories made by different threads
+    // go to different groups
+    char map[FS_BLOCK_SIZE];
+    pthread_t t;
+
+    make_image(3 * FS_BITS_PER_BLOCK, 3, 0);
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.mkdir("/main", 0777), 0);
+    pthread_create(&t, NULL, mkdir_thread, "/other");
+    pthread_join(t, NULL);
+    fs_ops.destroy(NULL);
+
+    // the root and /main are in one group, /other in another
+    int fd = open(BIG_IMAGE, O_RDONLY), used[3];
+    for (int g = 0; g < 3; g++) {
+        ck_assert_int_eq(pread(fd, map, sizeof(map), (off_t)(1 + g) * FS_BLOCK_SIZE),
+                         sizeof(map));
+        used[g] = 0;
+        for (int i = 0; i < FS_BLOCK_SIZE * 8; i++) {
+            used[g] += (map[i / 8] >> (i % 8)) & 1;
+        }
+    }
+    close(fd);
+    ck_assert_int_eq(used[0] + used[1] + used[2], 6 + 2 + 2);
+    ck_assert(used[0] == 8 || used[1] == 8 || used[2] == 8);
+    ck_assert(used[0] == 2 || used[1] == 2 || used[2] == 2);
+
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+#define CW_THREADS 4
+#define CW_FILES   24	/* created by each thread */
+#define CW_WRITTEN 2	/* ... of which these get CW_BLOCKS blocks */
+#define CW_BLOCKS  8
+#define CW_ROUNDS  10
+
+struct cw_arg {
+    int id;
+    pthread_barrier_t *start;
+    int failed;		/* what went wrong, if anything; checked after the join */
+};
+
+static void cw_fill(char *block, int id, int f, int i)
+{
+    memset(block, 'A' + id, FS_BLOCK_SIZE);
+    sprintf(block, "%d/%d/%d", id, f, i);
+}
+
+/* each thread deletes its odd files again as it goes, all but the last */
+static int cw_kept(int f)
+{
+    return f < 0 || f % 2 == 0 || f == CW_FILES - 1;
+}
+
+static void *cw_thread(void *p)
+{
+    struct cw_arg *a = p;
+    char path[32], block[FS_BLOCK_SIZE];
+    pthread_barrier_wait(a->start);
+    for (int r = 0; r < CW_ROUNDS && !a->failed; r++) {
+        for (int f = 0; f < CW_FILES && !a->failed; f++) {
+            sprintf(path, "/cw/%d-%d", a->id, f);
+            if (fs_ops.create(path, 0100666, NULL) != 0) {
+                a->failed = 1;
+                break;
+            }
+            for (int i = 0; i < CW_BLOCKS && f < CW_WRITTEN && !a->failed; i++) {
+                cw_fill(block, a->id, f, i);
+                if (fs_ops.write(path, block, sizeof(block), (off_t)i * FS_BLOCK_SIZE,
+                                 NULL) != sizeof(block))
+                    a->failed = 2;
+            }
+            if (fs_ops.release(path, NULL) != 0)
+                a->failed = 3;
+            sprintf(path, "/cw/%d-%d", a->id, f - 1);
+            if (!cw_kept(f - 1) && fs_ops.unlink(path) != 0)
+                a->failed = 4;
+        }
+        /* all but the last round start again from nothing */
+        for (int f = 0; f < CW_FILES && r < CW_ROUNDS - 1 && !a->failed; f++) {
+            sprintf(path, "/cw/%d-%d", a->id, f);
+            if (cw_kept(f) && fs_ops.unlink(path) != 0)
+                a->failed = 5;
+        }
+    }
+    return NULL;
+}
+
+/* looks up two paths that always exist, over and over, until *stop */
+struct cw_lookup {
+    int stop;
+    int failed;
+    long lookups;
+};
+
+static void *cw_lookup_thread(void *p)
+{
+    struct cw_lookup *l = p;
+    struct stat st;
+    while (!__atomic_load_n(&l->stop, __ATOMIC_RELAXED) && !l->failed) {
+        if (fs_ops.getattr("/cw/stable/file", &st) != 0 || !S_ISREG(st.st_mode) ||
+            fs_ops.getattr("/cw/stable", &st) != 0 || !S_ISDIR(st.st_mode))
+            l->failed = 1;
+        l->lookups++;
+    }
+    return NULL;
+}
+
+START_TEST(test_concurrent_writers)
+{
+    // threads creating, appending to and deleting files in one
+    // directory all run at once, with another thread looking up paths
+    // the whole time; every lookup finds what is there, every name and
+    // every block is as it should be afterwards, and deleting the files
+    // gives back exactly the blocks they took
+    pthread_t t[CW_THREADS], lt;
+    struct cw_arg args[CW_THREADS];
+    struct cw_lookup look = {0};
+    pthread_barrier_t start;
+    char path[32], block[FS_BLOCK_SIZE], back[FS_BLOCK_SIZE];
+    struct statvfs sv0, sv1;
+    struct stat st;
+
+    ck_assert_int_eq(fs_ops.mkdir("/cw", 0777), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/cw/stable", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/cw/stable/file", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(pthread_create(&lt, NULL, cw_lookup_thread, &look), 0);
+    pthread_barrier_init(&start, NULL, CW_THREADS);
+    for (int i = 0; i < CW_THREADS; i++) {
+        args[i] = (struct cw_arg){i, &start, 0};
+        ck_assert_int_eq(pthread_create(&t[i], NULL, cw_thread, &args[i]), 0);
+    }
+    for (int i = 0; i < CW_THREADS; i++) {
+        pthread_join(t[i], NULL);
+        ck_assert_int_eq(args[i].failed, 0);
+    }
+    pthread_barrier_destroy(&start);
+    __atomic_store_n(&look.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(lt, NULL);
+    ck_assert_int_eq(look.failed, 0);
+    ck_assert(look.lookups > 0);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int id = 0; id < CW_THREADS; id++) {
+            for (int f = 0; f < CW_FILES; f++) {
+                sprintf(path, "/cw/%d-%d", id, f);
+                if (!cw_kept(f)) {
+                    ck_assert_int_eq(fs_ops.getattr(path, &st), -ENOENT);
+                    continue;
+                }
+                ck_assert_int_eq(fs_ops.getattr(path, &st), 0);
+                ck_assert_int_eq(st.st_size, f < CW_WRITTEN ? CW_BLOCKS * FS_BLOCK_SIZE : 0);
+                for (int i = 0; i < CW_BLOCKS && f < CW_WRITTEN; i++) {
+                    cw_fill(block, id, f, i);
+                    ck_assert_int_eq(fs_ops.read(path, back, sizeof(back),
+                                                 (off_t)i * FS_BLOCK_SIZE, NULL), sizeof(back));
+                    ck_assert(memcmp(back, block, sizeof(block)) == 0);
+                }
+            }
+        }
+        fs_ops.destroy(NULL);
+        fs_ops.init(NULL);
+    }
+
+    for (int id = 0; id < CW_THREADS; id++) {
+        for (int f = 0; f < CW_FILES; f++) {
+            sprintf(path, "/cw/%d-%d", id, f);
+            ck_assert_int_eq(fs_ops.unlink(path), cw_kept(f) ? 0 : -ENOENT);
+        }
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+    ck_assert_int_eq(fs_ops.unlink("/cw/stable/file"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/cw/stable"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/cw"), 0);
+}
+END_TEST
+
+START_TEST(test_delayed_alloc)
+{
+    // two files appended to in turn, a block at a time, each end up in
+    // one piece: their blocks are only allocated when they are closed
+    char block[FS_BLOCK_SIZE], back[8 * FS_BLOCK_SIZE];
+    const char *names[] = {"/delay-x", "/delay-y"};
+    struct statvfs sv0, sv1;
+    struct stat st;
+
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.create(names[f], 0100666, NULL), 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    for (int i = 0; i < 8; i++) {
+        for (int f = 0; f < 2; f++) {
+            memset(block, 'a' + 8 * f + i, sizeof(block));
+            ck_assert_int_eq(fs_ops.write(names[f], block, sizeof(block),
+                                          i * FS_BLOCK_SIZE, NULL), sizeof(block));
+        }
+    }
+
+    // the blocks are already counted as used, and the data reads back
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 16);
+    ck_assert_int_eq(fs_ops.read(names[1], back, sizeof(back), 0, NULL), sizeof(back));
+    ck_assert_int_eq(back[7 * FS_BLOCK_SIZE], 'a' + 15);
+
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.release(names[f], NULL), 0);
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 16);
+
+    uint64_t r0, w0, s0, r1, w1, s1;
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.getattr(names[f], &st), 0);
+        block_counts(&r0, &w0, &s0);
+        ck_assert_int_eq(fs_ops.read(names[f], back, sizeof(back), 0, NULL), sizeof(back));
+        block_counts(&r1, &w1, &s1);
+        ck_assert_int_eq(s1 - s0, 1);
+        ck_assert_int_eq(back[0], 'a' + 8 * f);
+        ck_assert_int_eq(back[7 * FS_BLOCK_SIZE], 'a' + 8 * f + 7);
+        ck_assert_int_eq(fs_ops.unlink(names[f]), 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree + 2);
+}
+END_TEST
+
+static int appended;    /* blocks the append thread has written */
+
+static void *append_thread(void *path)
+{
+    char block[FS_BLOCK_SIZE];
+    for (int i = 0; i < 64; i++) {
+        memset(block, 'a' + i % 26, sizeof(block));
+        ck_assert_int_eq(fs_ops.write(path, block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+        __atomic_store_n(&appended, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+START_TEST(test_delayed_alloc_reader)
+{
+    // buffered blocks read back correctly while another thread is
+    // still appending to the buffer
+    char back[FS_BLOCK_SIZE];
+    pthread_t t;
+    int n;
+
+    ck_assert_int_eq(fs_ops.create("/delay-rw", 0100666, NULL), 0);
+    appended = 0;
+    pthread_create(&t, NULL, append_thread, "/delay-rw");
+    while ((n = __atomic_load_n(&appended, __ATOMIC_ACQUIRE)) < 64) {
+        if (n == 0)
+            continue;
+        int i = (n - 1) / 2 * 2;    // an older block, and the latest one
+        ck_assert_int_eq(fs_ops.read("/delay-rw", back, sizeof(back),
+                                     i * FS_BLOCK_SIZE, NULL), sizeof(back));
+        ck_assert_int_eq(back[0], 'a' + i % 26);
+        ck_assert_int_eq(back[FS_BLOCK_SIZE - 1], 'a' + i % 26);
+    }
+    pthread_join(t, NULL);
+
+    for (int i = 0; i < 64; i++) {
+        ck_assert_int_eq(fs_ops.read("/delay-rw", back, sizeof(back),
+                                     i * FS_BLOCK_SIZE, NULL), sizeof(back));
+        ck_assert_int_eq(back[100], 'a' + i % 26);
+    }
+    ck_assert_int_eq(fs_ops.unlink("/delay-rw"), 0);
+}
+END_TEST
+
+static void *evict_thread(void *arg)
+{
+    // appends a block to /delay-ev, sleeps so the reader gets going,
+    // then has each of 16 other files buffer a block - one of them
+    // shares its slot and pushes its data out, maybe mid-read
+    char block[FS_BLOCK_SIZE], path[32];
+    for (int i = 0; i < 64; i++) {
+        memset(block, 'a' + i % 26, sizeof(block));
+        ck_assert_int_eq(fs_ops.write("/delay-ev", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+        __atomic_store_n(&appended, i + 1, __ATOMIC_RELEASE);
+        usleep(1000);
+        for (int f = 0; f < 16; f++) {
+            sprintf(path, "/delay-ev%d", f);
+            ck_assert_int_eq(fs_ops.truncate(path, 0), 0);
+            ck_assert_int_eq(fs_ops.write(path, block, sizeof(block), 0, NULL),
+                             sizeof(block));
+        }
+    }
+    return NULL;
+}
+
+START_TEST(test_delayed_alloc_evicted)
+{
+    // a buffered block reads back while other files' writes keep
+    // moving it out of the buffer and onto the disk
+    char back[FS_BLOCK_SIZE], path[32];
+    pthread_t t;
+    int n;
+
+    ck_assert_int_eq(fs_ops.create("/delay-ev", 0100666, NULL), 0);
+    for (int f = 0; f < 16; f++) {
+        sprintf(path, "/delay-ev%d", f);
+        ck_assert_int_eq(fs_ops.create(path, 0100666, NULL), 0);
+    }
+    appended = 0;
+    pthread_create(&t, NULL, evict_thread, NULL);
+    while ((n = __atomic_load_n(&appended, __ATOMIC_ACQUIRE)) < 64) {
+        if (n == 0)
+            continue;
+        ck_assert_int_eq(fs_ops.read("/delay-ev", back, sizeof(back),
+                                     (n - 1) * FS_BLOCK_SIZE, NULL), sizeof(back));
+        ck_assert_int_eq(back[0], 'a' + (n - 1) % 26);
+    }
+    pthread_join(t, NULL);
+
+    ck_assert_int_eq(fs_ops.unlink("/delay-ev"), 0);
+    for (int f = 0; f < 16; f++) {
+        sprintf(path, "/delay-ev%d", f);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+}
+END_TEST
+
+START_TEST(test_fallocate)
+{
+    char block[FS_BLOCK_SIZE], back[8 * FS_BLOCK_SIZE];
+    struct statvfs sv0, sv1;
+    struct stat st;
+    memset(block, 'p', sizeof(block));
+
+    // keep-size: 8 blocks taken, the file stays empty
+    ck_assert_int_eq(fs_ops.create("/prealloc", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.fallocate("/prealloc", FALLOC_FL_KEEP_SIZE, 0,
+                                      8 * FS_BLOCK_SIZE, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/prealloc", &st), 0);
+    ck_assert_int_eq(st.st_size, 0);
+    ck_assert_int_eq(st.st_blocks, 8 * (FS_BLOCK_SIZE / 512));
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 8);
+
+    // appends go into those blocks without allocating any more
+    for (int i = 0; i < 8; i++) {
+        ck_assert_int_eq(fs_ops.write("/prealloc", block, sizeof(block),
+                                      i * FS_BLOCK_SIZE, NULL), sizeof(block));
+    }
+    ck_assert_int_eq(fs_ops.release("/prealloc", NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 8);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    uint64_t r0, w0, s0, r1, w1, s1;
+    ck_assert_int_eq(fs_ops.getattr("/prealloc", &st), 0);
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.read("/prealloc", back, sizeof(back), 0, NULL), sizeof(back));
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(s1 - s0, 1);
+    ck_assert(memcmp(back + 7 * FS_BLOCK_SIZE, block, sizeof(block)) == 0);
+
+    // without keep-size the file grows, and reads as zeros
+    ck_assert_int_eq(fs_ops.create("/zeroed", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/zeroed", "abc", 3, 0, NULL), 3);
+    ck_assert_int_eq(fs_ops.fallocate("/zeroed", 0, 0, 3 * FS_BLOCK_SIZE + 100, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/zeroed", &st), 0);
+    ck_assert_int_eq(st.st_size, 3 * FS_BLOCK_SIZE + 100);
+    memset(back, 'x', sizeof(back));
+    ck_assert_int_eq(fs_ops.read("/zeroed", back, sizeof(back), 0, NULL), st.st_size);
+    ck_assert(memcmp(back, "abc", 3) == 0);
+    for (int i = 3; i < st.st_size; i++) {
+        ck_assert_int_eq(back[i], 0);
+    }
+
+    ck_assert_int_eq(fs_ops.fallocate("/zeroed", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                      0, 10, NULL), -EOPNOTSUPP);
+    ck_assert_int_eq(fs_ops.unlink("/prealloc"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/zeroed"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree + 1);	// and /prealloc's inode
+}
+END_TEST
+
+START_TEST(test_indirect_blocks)
+{
+    // a file past the direct pointers: 2100 blocks take the single
+    // indirect block and one leaf under the double indirect one
+    struct statvfs sv0, sv1;
+    struct stat st;
+    int nblks = 2100, chunk = 64;
+    char *buf = malloc((size_t)chunk * FS_BLOCK_SIZE);
+
+    make_image(3000, 1, 0);
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.create("/huge", 0100666, NULL), 0);
+    for (int i = 0; i < nblks; i += chunk) {
+        int n = nblks - i < chunk ? nblks - i : chunk;
+        for (int j = 0; j < n; j++) {
+            memset(buf + (size_t)j * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            sprintf(buf + (size_t)j * FS_BLOCK_SIZE, "block %d", i + j);
+        }
+        ck_assert_int_eq(fs_ops.write("/huge", buf, (size_t)n * FS_BLOCK_SIZE,
+                                      (off_t)i * FS_BLOCK_SIZE, NULL), n * FS_BLOCK_SIZE);
+    }
+    ck_assert_int_eq(fs_ops.release("/huge", NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1 + nblks + 1 + 2);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/huge", &st), 0);
+    ck_assert_int_eq(st.st_size, (off_t)nblks * FS_BLOCK_SIZE);
+    ck_assert_int_eq(st.st_blocks, nblks * (FS_BLOCK_SIZE / 512));
+    for (int i = 0; i < nblks; i += chunk) {
+        int n = nblks - i < chunk ? nblks - i : chunk;
+        ck_assert_int_eq(fs_ops.read("/huge", buf, (size_t)n * FS_BLOCK_SIZE,
+                                     (off_t)i * FS_BLOCK_SIZE, NULL), n * FS_BLOCK_SIZE);
+        for (int j = 0; j < n; j++) {
+            char tag[24];
+            sprintf(tag, "block %d", i + j);
+            ck_assert_str_eq(buf + (size_t)j * FS_BLOCK_SIZE, tag);
+        }
+    }
+
+    // an overwrite across the direct / indirect boundary
+    memset(buf, 'o', 2 * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.write("/huge", buf, 2 * FS_BLOCK_SIZE,
+                                  (off_t)(FS_NDIRECT - 1) * FS_BLOCK_SIZE + 100, NULL),
+                     2 * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.read("/huge", buf, 20, (off_t)FS_NDIRECT * FS_BLOCK_SIZE, NULL), 20);
+    ck_assert_int_eq(buf[0], 'o');
+
+    ck_assert_int_eq(fs_ops.fallocate("/huge", 0, (off_t)1 << 43, FS_BLOCK_SIZE, NULL), -EFBIG);
+    ck_assert_int_eq(fs_ops.unlink("/huge"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+    free(buf);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+static void *extend_thread(void *arg)
+{
+    // grows /leaves a block at a time - fallocate maps it, the write
+    // fills it in place - sleeping in between so the reader is
+    // interrupted somewhere in a read when the next one comes
+    int *nblks = arg;
+    char block[FS_BLOCK_SIZE];
+    for (int i = 0; i < 64; i++) {
+        int n = *nblks + i;
+        memset(block, 'a' + i % 26, sizeof(block));
+        ck_assert_int_eq(fs_ops.fallocate("/leaves", 0, (off_t)n * FS_BLOCK_SIZE,
+                                          FS_BLOCK_SIZE, NULL), 0);
+        ck_assert_int_eq(fs_ops.write("/leaves", block, sizeof(block),
+                                      (off_t)n * FS_BLOCK_SIZE, NULL), sizeof(block));
+        __atomic_store_n(&appended, i + 1, __ATOMIC_RELEASE);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+START_TEST(test_leaf_cache_reader)
+{
+    // a reader that looks up the leaf being extended must not leave
+    // its older copy in map_table for the next read to find. The file
+    // ends in the first leaf under the double indirect block; reading
+    // a block under the single indirect one in between makes each
+    // read of the end go down the tree
+    int nblks = FS_NDIRECT + FS_PTRS_PER_BLOCK + 2, chunk = 64;
+    char *buf = calloc(chunk, FS_BLOCK_SIZE);
+    pthread_t t;
+    int n;
+
+    make_image(3000, 1, 0);
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/leaves", 0100666, NULL), 0);
+    for (int i = 0; i < nblks; i += chunk) {
+        int k = nblks - i < chunk ? nblks - i : chunk;
+        ck_assert_int_eq(fs_ops.write("/leaves", buf, (size_t)k * FS_BLOCK_SIZE,
+                                      (off_t)i * FS_BLOCK_SIZE, NULL), k * FS_BLOCK_SIZE);
+    }
+    ck_assert_int_eq(fs_ops.release("/leaves", NULL), 0);
+
+    appended = 0;
+    pthread_create(&t, NULL, extend_thread, &nblks);
+    while ((n = __atomic_load_n(&appended, __ATOMIC_ACQUIRE)) < 64) {
+        for (int r = 0; r < 2 && n > 0; r++) {
+            int i = __atomic_load_n(&appended, __ATOMIC_ACQUIRE) - 1;
+            ck_assert_int_eq(fs_ops.read("/leaves", buf, FS_BLOCK_SIZE,
+                                         (off_t)(nblks + i) * FS_BLOCK_SIZE, NULL),
+                             FS_BLOCK_SIZE);
+            ck_assert_int_eq(buf[0], 'a' + i % 26);
+        }
+        ck_assert_int_eq(fs_ops.read("/leaves", buf, FS_BLOCK_SIZE,
+                                     (off_t)FS_NDIRECT * FS_BLOCK_SIZE, NULL), FS_BLOCK_SIZE);
+    }
+    pthread_join(t, NULL);
+
+    ck_assert_int_eq(fs_ops.unlink("/leaves"), 0);
+    free(buf);
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+START_TEST(test_dense_image)
+{
+    // disk1.in in the dense format: the same files, inodes in a table
+    struct statvfs sv0, sv1;
+    struct stat st;
+    uint64_t r0, w0, s0, r1, w1, s1;
+    char buf[30 * FS_BLOCK_SIZE], back[sizeof(buf)], name[16];
+    struct {
+        const char *name;
+        int seen;
+    } dir_table[] = {
+        {"file.1k", 0}, {"file.10", 0}, {"dir-with-long-name", 0},
+        {"dir2", 0}, {"dir3", 0}, {"file.8k+", 0}, {NULL, 0}
+    };
+
+    ck_assert_int_eq(system("python gen-disk.py -q -d disk1.in dense.img"), 0);
+    fs_ops.destroy(NULL);
+    block_init_backend("dense.img", "file");
+    fs_ops.init(NULL);
+
+    // the root and all its entries share one table block: listing it
+    // reads that and the directory block
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.readdir("/", dir_table, readdir_filler, 0, NULL), 0);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(r1 - r0, 2);
+    for (int i = 0; dir_table[i].name != NULL; i++) {
+        ck_assert_int_eq(dir_table[i].seen, 1);
+    }
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &st), 0);
+    ck_assert_int_eq(st.st_size, 12288);
+    ck_assert_int_eq(fs_ops.read("/file.1k", buf, sizeof(buf), 0, NULL), 1000);
+    ck_assert_int_eq(crc32(0, (unsigned char *)buf, 1000), 1726121896);
+
+    // a contiguous file is one extent in its inode, which takes no
+    // block of its own
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    for (int i = 0; i < sizeof(buf); i++) {
+        buf[i] = 'a' + i % 26;
+    }
+    ck_assert_int_eq(fs_ops.create("/dense", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/dense", buf, sizeof(buf), 0, NULL), sizeof(buf));
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 30);
+    ck_assert_int_eq(fs_ops.read("/dense", back, sizeof(back), 0, NULL), sizeof(back));
+    ck_assert(memcmp(back, buf, sizeof(buf)) == 0);
+
+    // three files appended to in turn, a block at a time, end up with
+    // their blocks interleaved: most have too many extents for the
+    // inode and get an extent tree block, freed with the file
+    for (int f = 0; f < 3; f++) {
+        sprintf(name, "/frag%d", f);
+        ck_assert_int_eq(fs_ops.create(name, 0100666, NULL), 0);
+    }
+    for (int i = 0; i < 20; i++) {
+        for (int f = 0; f < 3; f++) {
+            off_t off = (off_t)i * FS_BLOCK_SIZE;
+            sprintf(name, "/frag%d", f);
+            ck_assert_int_eq(fs_ops.write(name, buf + off + f, FS_BLOCK_SIZE, off, NULL), FS_BLOCK_SIZE);
+            ck_assert_int_eq(fs_ops.fsync(name, 0, NULL), 0);
+        }
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert(sv0.f_bfree - sv1.f_bfree > 30 + 3 * 20);
+    for (int f = 0; f < 3; f++) {
+        sprintf(name, "/frag%d", f);
+        ck_assert_int_eq(fs_ops.read(name, back, 20 * FS_BLOCK_SIZE, 0, NULL), 20 * FS_BLOCK_SIZE);
+        ck_assert(memcmp(back, buf + f, 20 * FS_BLOCK_SIZE) == 0);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.mkdir("/dense-dir", 0777), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dense-dir", &st), 0);
+    ck_assert(S_ISDIR(st.st_mode));
+    ck_assert_int_eq(fs_ops.rmdir("/dense-dir"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/dense"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink("dense.img");
+}
+END_TEST
+
+#define DENSE_BLOCKS 12000
+#define DENSE_FRAG   3000
+
+START_TEST(test_dense_extent_tree)
+{
+    // files with more blocks than an inode has pointers: one that is
+    // a few long extents, and two allocated a block at a time in turn,
+    // so that each block is an extent of its own and the tree gets two
+    // levels of nodes. They read back, and free every block, nodes too.
+    const char *frag[] = {"/even", "/odd"};
+    int nbig = 2000;
+    char *buf = malloc((size_t)DENSE_FRAG * FS_BLOCK_SIZE);
+    char *back = malloc((size_t)DENSE_FRAG * FS_BLOCK_SIZE);
+    struct statvfs sv0, sv1;
+    struct stat st;
+
+    FILE *fp = fopen("dense-big.in", "w");
+    fprintf(fp, "$z 0\n$d 0o40777\nsize %d\ndir 2 / $z $z $d $z $z 4096 3\n", DENSE_BLOCKS);
+    fclose(fp);
+    ck_assert_int_eq(system("python gen-disk.py -q -d dense-big.in dense.img"), 0);
+    unlink("dense-big.in");
+    fs_ops.destroy(NULL);
+    block_init_backend("dense.img", "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+
+    for (int i = 0; i < DENSE_FRAG * FS_BLOCK_SIZE; i++) {
+        buf[i] = 'a' + (i / 7) % 26;
+    }
+    ck_assert_int_eq(fs_ops.create("/big", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/big", buf, nbig * FS_BLOCK_SIZE, 0, NULL),
+                     nbig * FS_BLOCK_SIZE);
+
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.create(frag[f], 0100666, NULL), 0);
+    }
+    for (int i = 0; i < DENSE_FRAG; i++) {
+        for (int f = 0; f < 2; f++) {
+            ck_assert_int_eq(fs_ops.fallocate(frag[f], 0, (off_t)i * FS_BLOCK_SIZE,
+                                              FS_BLOCK_SIZE, NULL), 0);
+        }
+    }
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.write(frag[f], buf + f, DENSE_FRAG * FS_BLOCK_SIZE, 0, NULL),
+                         DENSE_FRAG * FS_BLOCK_SIZE);
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert(sv0.f_bfree - sv1.f_bfree > nbig + 2 * DENSE_FRAG);
+    ck_assert_int_eq(fs_ops.getattr("/big", &st), 0);
+    ck_assert_int_eq(st.st_size, nbig * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.read("/big", back, nbig * FS_BLOCK_SIZE, 0, NULL),
+                     nbig * FS_BLOCK_SIZE);
+    ck_assert(memcmp(back, buf, nbig * FS_BLOCK_SIZE) == 0);
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.read(frag[f], back, DENSE_FRAG * FS_BLOCK_SIZE, 0, NULL),
+                         DENSE_FRAG * FS_BLOCK_SIZE);
+        ck_assert(memcmp(back, buf + f, DENSE_FRAG * FS_BLOCK_SIZE) == 0);
+        ck_assert_int_eq(fs_ops.read(frag[f], back, 100, (off_t)2345 * FS_BLOCK_SIZE + 10, NULL), 100);
+        ck_assert(memcmp(back, buf + f + 2345 * FS_BLOCK_SIZE + 10, 100) == 0);
+    }
+
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    for (int f = 0; f < 2; f++) {
+        ck_assert_int_eq(fs_ops.unlink(frag[f]), 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+    free(buf);
+    free(back);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink("dense.img");
+}
+END_TEST
+
+START_TEST(test_inline_data)
+{
+    // a small file lives in its inode: no data block, and reading it
+    // after getattr costs no more I/O
+    struct statvfs sv0, sv1;
+    struct stat st;
+    char buf[2 * FS_BLOCK_SIZE];
+    uint64_t r0, w0, s0, r1, w1, s1;
+
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.create("/tiny", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/tiny", "0123456789", 10, 0, NULL), 10);
+    ck_assert_int_eq(fs_ops.write("/tiny", "abc", 3, 4, NULL), 3);
+    ck_assert_int_eq(fs_ops.release("/tiny", NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/tiny", &st), 0);
+    ck_assert_int_eq(st.st_size, 10);
+    ck_assert_int_eq(st.st_blocks, 0);
+    block_counts(&r0, &w0, &s0);
+    ck_assert_int_eq(fs_ops.read("/tiny", buf, sizeof(buf), 0, NULL), 10);
+    block_counts(&r1, &w1, &s1);
+    ck_assert_int_eq(r1, r0);
+    ck_assert(memcmp(buf, "0123abc789", 10) == 0);
+
+    // growing past the inode moves the data out to blocks
+    memset(buf, 'g', sizeof(buf));
+    ck_assert_int_eq(fs_ops.write("/tiny", buf, FS_BLOCK_SIZE, 10, NULL), FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.release("/tiny", NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv0.f_bfree - sv1.f_bfree, 1 + 2);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.read("/tiny", buf, sizeof(buf), 0, NULL), 10 + FS_BLOCK_SIZE);
+    ck_assert(memcmp(buf, "0123abc789", 10) == 0);
+    ck_assert_int_eq(buf[10], 'g');
+    ck_assert_int_eq(buf[9 + FS_BLOCK_SIZE], 'g');
+
+    // truncated, and written again, it is a block file still
+    ck_assert_int_eq(fs_ops.truncate("/tiny", 0), 0);
+    ck_assert_int_eq(fs_ops.write("/tiny", "xyz", 3, 0, NULL), 3);
+    ck_assert_int_eq(fs_ops.read("/tiny", buf, sizeof(buf), 0, NULL), 3);
+    ck_assert(memcmp(buf, "xyz", 3) == 0);
+    ck_assert_int_eq(fs_ops.unlink("/tiny"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv1), 0);
+    ck_assert_int_eq(sv1.f_bfree, sv0.f_bfree);
+}
+END_TEST
+
+START_TEST(test_inline_flag_checked)
+{
+    // an inode marked inline is only used if it is a regular file
+    // small enough to be in ptrs[], and no other flag is known
+    char block[FS_BLOCK_SIZE], back[16];
+    struct fs_dirent *de = (void*)block;
+    struct fs_inode *ino = (void*)block;
+    const char *names[] = {"dir", "long", "odd", "ok"};
+    struct stat st;
+
+    // 2 is the root inode and 3 its directory block: the inodes of
+    // the files above are 4 to 7, with no blocks of their own
+    make_image(100, 1, 0);
+    int fd = open(BIG_IMAGE, O_RDWR);
+    ck_assert_int_eq(pread(fd, block, FS_BLOCK_SIZE, FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    block[0] |= 0xf0;
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < 4; i++) {
+        de[i].valid = 1;
+        de[i].inode = 4 + i;
+        strcpy(de[i].name, names[i]);
+    }
+    ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, 3 * FS_BLOCK_SIZE), FS_BLOCK_SIZE);
+    for (int i = 0; i < 4; i++) {
+        memset(block, 0, sizeof(block));
+        ino->mode = i == 0 ? S_IFDIR | 0777 : S_IFREG | 0666;
+        ino->size = i == 1 ? FS_INLINE_MAX + 1 : 3;
+        ino->flags = i == 2 ? 2 : FS_INODE_INLINE;
+        memcpy(ino->ptrs, "abc", 3);
+        ck_assert_int_eq(pwrite(fd, block, FS_BLOCK_SIZE, (4 + i) * FS_BLOCK_SIZE),
+                         FS_BLOCK_SIZE);
+    }
+    close(fd);
+
+    fs_ops.destroy(NULL);
+    block_init_backend(BIG_IMAGE, "file");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/dir", &st), -EIO);
+    ck_assert_int_eq(fs_ops.getattr("/long", &st), -EIO);
+    ck_assert_int_eq(fs_ops.getattr("/odd", &st), -EIO);
+    ck_assert_int_eq(fs_ops.read("/ok", back, sizeof(back), 0, NULL), 3);
+    ck_assert(memcmp(back, "abc", 3) == 0);
+
+    fs_ops.destroy(NULL);
+    block_init_backend("test2.img", "file");
+    fs_ops.init(NULL);
+    unlink(BIG_IMAGE);
+}
+END_TEST
+
+START_TEST(test_dentry_cache)
+{
+    // a second lookup of a path, or of a missing name, doesn't search
+    // the directories again; each change to them shows up at once
+    struct stat st;
+    uint64_t h0, m0, wb, h1, m1;
+    ck_assert_int_eq(fs_ops.mkdir("/dc", 0777), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/dc/sub", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/dc/sub/f", 0100666, NULL), 0);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/f", &st), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/nope", &st), -ENOENT);
+    cache_counts(&h0, &m0, &wb);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/f", &st), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/nope", &st), -ENOENT);
+    cache_counts(&h1, &m1, &wb);
+    ck_assert_int_eq(h1 + m1, h0 + m0);
+
+    ck_assert_int_eq(fs_ops.create("/dc/sub/nope", 0100666, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/nope", &st), 0);
+    ck_assert_int_eq(fs_ops.rename("/dc/sub/nope", "/dc/sub/yes"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/nope", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/yes", &st), 0);
+    ck_assert_int_eq(fs_ops.unlink("/dc/sub/yes"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/yes", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.unlink("/dc/sub/f"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/f", &st), -ENOENT);
+
+    // a directory's entries go with it
+    ck_assert_int_eq(fs_ops.rmdir("/dc/sub"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.mkdir("/dc/sub", 0777), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub", &st), 0);
+    ck_assert(S_ISDIR(st.st_mode));
+    ck_assert_int_eq(fs_ops.getattr("/dc/sub/f", &st), -ENOENT);
+    ck_assert_int_eq(fs_ops.rmdir("/dc/sub"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/dc"), 0);
+}
+END_TEST
+
+/* block cache reads made by one call */
+static uint64_t cache_reads(void)
+{
+    uint64_t h, m, wb;
+    cache_counts(&h, &m, &wb);
+    return h + m;
+}
+
+START_TEST(test_lookup_one_pass)
+{
+    // once the path's directories have been looked up, each of these
+    // reads the directory block just once per path it is given (rmdir
+    // also checks that the directory being removed is empty)
+    uint64_t n;
+    ck_assert_int_eq(fs_ops.mkdir("/one", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/one/x", 0100666, NULL), 0);
+
+    n = cache_reads();
+    ck_assert_int_eq(fs_ops.create("/one/y", 0100666, NULL), 0);
+    ck_assert_int_eq(cache_reads() - n, 1);
+    n = cache_reads();
+    ck_assert_int_eq(fs_ops.rename("/one/y", "/one/z"), 0);
+    ck_assert_int_eq(cache_reads() - n, 2);
+    n = cache_reads();
+    ck_assert_int_eq(fs_ops.unlink("/one/z"), 0);
+    ck_assert_int_eq(cache_reads() - n, 1);
+    n = cache_reads();
+    ck_assert_int_eq(fs_ops.mkdir("/one/d", 0777), 0);
+    ck_assert_int_eq(cache_reads() - n, 1);
+    n = cache_reads();
+    ck_assert_int_eq(fs_ops.rmdir("/one/d"), 0);
+    ck_assert_int_eq(cache_reads() - n, 2);
+
+    ck_assert_int_eq(fs_ops.create("/one/x", 0100666, NULL), -EEXIST);
+    ck_assert_int_eq(fs_ops.unlink("/one/y"), -ENOENT);
+    ck_assert_int_eq(fs_ops.rmdir("/one/x"), -ENOTDIR);
+    ck_assert_int_eq(fs_ops.unlink("/one/x"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/one"), 0);
+}
+END_TEST
+
 /* note that your tests will call:
  *  fs_ops.getattr(path, struct stat *sb)
  *  fs_ops.readdir(path, NULL, filler_function, 0, NULL)
@@ -775,6 +2331,37 @@ int main(int argc, char **argv)
     tcase_add_test(tc, test_write);
     tcase_add_test(tc, test_truncate);
     tcase_add_test(tc, test_utime);
+    tcase_add_test(tc, test_write_read_multiblock);
+    tcase_add_test(tc, test_readahead);
+    tcase_add_test(tc, test_fsync);
+    tcase_add_test(tc, test_writeback_error);
+    tcase_add_test(tc, test_cache_read_write_race);
+    tcase_add_test(tc, test_inode_expire);
+    tcase_add_test(tc, test_find_free_run);
+    tcase_add_test(tc, test_find_free_summary);
+    tcase_add_test(tc, test_write_enospc);
+    tcase_add_test(tc, test_contiguous_append);
+    tcase_add_test(tc, test_mmap_backend);
+    tcase_add_test(tc, test_ram_backend);
+    tcase_add_test(tc, test_unlink_discards);
+    tcase_add_test(tc, test_discard_deferred);
+    tcase_add_test(tc, test_statfs_counts);
+    tcase_add_test(tc, test_big_image);
+    tcase_add_test(tc, test_version0_image);
+    tcase_add_test(tc, test_alloc_groups);
+    tcase_add_test(tc, test_concurrent_writers);
+    tcase_add_test(tc, test_delayed_alloc);
+    tcase_add_test(tc, test_delayed_alloc_reader);
+    tcase_add_test(tc, test_delayed_alloc_evicted);
+    tcase_add_test(tc, test_fallocate);
+    tcase_add_test(tc, test_dense_image);
+    tcase_add_test(tc, test_dense_extent_tree);
+    tcase_add_test(tc, test_indirect_blocks);
+    tcase_add_test(tc, test_leaf_cache_reader);
+    tcase_add_test(tc, test_inline_data);
+    tcase_add_test(tc, test_inline_flag_checked);
+    tcase_add_test(tc, test_dentry_cache);
+    tcase_add_test(tc, test_lookup_one_pass);
     
 
     suite_add_tcase(s, tc);